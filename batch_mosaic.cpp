@@ -0,0 +1,267 @@
+#include "batch_mosaic.h"
+
+#include "frame_source.h"
+#include "homography_refinement.h"
+#include "metrics.h"
+#include "mosaic_canvas.h"
+#include "mosaic_pipeline.h"
+
+#include "opencv2/core/eigen.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+/// \brief The registration of a frame.
+struct FrameResult
+{
+  int id;
+  bool registered;
+  size_t num_inliers;
+  Eigen::Matrix3f to_mosaic;
+};
+
+/// \brief Writes a homography as a row in the CSV file.
+void writeHomography(std::ofstream& file, int frame_id, size_t num_inliers, const Eigen::Matrix3f& H)
+{
+  file << frame_id << "," << num_inliers;
+  for (int row = 0; row < 3; ++row)
+  {
+    for (int col = 0; col < 3; ++col)
+    {
+      file << "," << H(row, col);
+    }
+  }
+  file << "\n";
+}
+
+/// \brief Inserts a registered frame into the canvas.
+void insertFrame(MosaicCanvas& canvas, const cv::Mat& frame, const Eigen::Matrix3f& to_mosaic)
+{
+  LAB_MOSAIC_SCOPED_TIMER(TimedEvent::compositing);
+
+  cv::Matx33f H_cv;
+  cv::eigen2cv(to_mosaic, H_cv);
+  canvas.insert(frame, H_cv);
+}
+}
+
+void runBatchMosaic(const std::string& input, const std::string& output_dir, bool optimize,
+                    const FeatureSettings& features, RecordingWriter* recording, TileExporter* tiles,
+                    bool refine_homographies, bool sprt)
+{
+  MosaicPipeline::FrameSource source = openFrameSource(input);
+
+  fs::create_directories(output_dir);
+  std::ofstream homography_file(fs::path(output_dir) / "homographies.csv");
+  if (!homography_file)
+  {
+    throw std::runtime_error("Could not write to " + output_dir);
+  }
+  homography_file << "frame,num_inliers,h11,h12,h13,h21,h22,h23,h31,h32,h33\n";
+  homography_file << std::setprecision(9);
+
+  // Process the frames as fast as possible.
+  // The source is not live, so no frames are dropped.
+  // The first frame defines the mosaic, so its homography is the identity.
+  // New keyframes are inserted as the frames move away from the reference.
+  // Frames are tracked from the previous frame when possible.
+  // High resolution frames are registered coarse-to-fine.
+  PipelineSettings settings;
+  settings.live_source = false;
+  settings.auto_reference = true;
+  settings.tracking = true;
+  settings.features = features;
+  settings.coarse_width = 640;
+  settings.refine_homographies = refine_homographies;
+  settings.sprt = sprt;
+  MosaicPipeline pipeline(source, settings);
+  StageStats& compositing_stats = pipeline.stats(PipelineStage::compositing);
+
+  // Speed matters less than quality here, so the frames are blended with multi-band blending.
+  MosaicCanvas canvas{256, CV_8UC3, BlendMode::multiband};
+
+  // When optimizing, each registered frame and its correspondences with its keyframe are added to the optimizer.
+  MosaicOptimizer optimizer;
+  std::unordered_map<int, int> optimizer_frames;
+
+  const auto start = Clock::now();
+  pipeline.start();
+
+  FramePtr data;
+  std::vector<FrameResult> results;
+  int num_registered = 0;
+  std::array<int, 3> num_per_path{};
+  while (!pipeline.finished())
+  {
+    if (!pipeline.tryPopResult(data))
+    {
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+      continue;
+    }
+
+    const auto composite_start = Clock::now();
+    results.push_back({data->id, data->registered, data->estimate.num_inliers, data->to_mosaic});
+
+    if (data->registered)
+    {
+      ++num_registered;
+      ++num_per_path[static_cast<size_t>(data->path)];
+
+      if (optimize)
+      {
+        // The keyframes are registered before the frames that are matched against them.
+        const int frame = optimizer.addFrame(data->to_mosaic, data->is_reference);
+        optimizer_frames[data->id] = frame;
+
+        const auto keyframe = data->reference ? optimizer_frames.find(data->reference->frame_id) : optimizer_frames.end();
+        if (!data->is_reference && keyframe != optimizer_frames.end())
+        {
+          optimizer.addCorrespondences(frame, keyframe->second, data->inlier_pts.leftCols(data->num_inlier_pts),
+                                       data->reference_inlier_pts.leftCols(data->num_inlier_pts));
+        }
+      }
+      else
+      {
+        // Frames are chained to the mosaic through the keyframe they were matched against.
+        insertFrame(canvas, data->frame, data->to_mosaic);
+
+        // Export the changed tiles, unless the previous export is still being written.
+        if (tiles)
+        { tiles->exportChanges(canvas); }
+      }
+    }
+    else
+    {
+      // The frame could not be registered.
+      compositing_stats.num_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    compositing_stats.record(Clock::now() - composite_start);
+
+    if (recording)
+    {
+      recording->append(*data);
+    }
+
+    // Return the frame to the pipeline, so that its buffers are reused for the next frames.
+    pipeline.recycle(data);
+  }
+  pipeline.stop();
+
+  if (optimize && optimizer.numPairs() > 0)
+  {
+    // Distribute the drift over all frames.
+    const double rms_before = optimizer.rmsError();
+    const auto optimize_start = Clock::now();
+    const double rms_after = optimizer.optimize();
+    const DurationInMs optimize_duration = Clock::now() - optimize_start;
+    std::cout << std::fixed << std::setprecision(2)
+              << "Optimized " << optimizer.numFrames() << " frames over " << optimizer.numPairs() << " pairs in "
+              << optimize_duration.count() << "ms, RMS error " << rms_before << " -> " << rms_after << " pixels\n";
+
+    for (auto& result : results)
+    {
+      if (const auto frame = optimizer_frames.find(result.id); frame != optimizer_frames.end())
+      {
+        result.to_mosaic = optimizer.toMosaic(frame->second);
+      }
+    }
+  }
+
+  if (optimize)
+  {
+    // Read the frames again, and insert them with the optimized homographies.
+    // The frame ids count the frames in the order they are read.
+    MosaicPipeline::FrameSource second_pass = openFrameSource(input);
+    cv::Mat frame;
+    for (const auto& result : results)
+    {
+      if (!second_pass(frame) || frame.empty())
+      { break; }
+
+      if (result.registered)
+      {
+        insertFrame(canvas, frame, result.to_mosaic);
+        if (tiles)
+        { tiles->exportChanges(canvas); }
+      }
+    }
+  }
+  if (tiles)
+  {
+    tiles->exportChanges(canvas, true);
+    tiles->flush();
+  }
+  const DurationInMs duration = Clock::now() - start;
+
+  for (const auto& result : results)
+  {
+    if (result.registered)
+    {
+      writeHomography(homography_file, result.id, result.num_inliers, result.to_mosaic);
+    }
+    else
+    {
+      homography_file << result.id << ",0,,,,,,,,,\n";
+    }
+  }
+
+  // Write the final mosaic, unless it has been exported as tiles.
+  cv::Mat mosaic;
+  const fs::path mosaic_path = fs::path(output_dir) / "mosaic.png";
+  if (!tiles)
+  {
+    canvas.render(canvas.bounds(), mosaic);
+    if (mosaic.empty() || !cv::imwrite(mosaic_path.string(), mosaic))
+    {
+      throw std::runtime_error("Could not write mosaic to " + mosaic_path.string());
+    }
+  }
+
+  // Report throughput and per-stage latencies.
+  const auto num_frames = pipeline.stats(PipelineStage::capture).num_processed.load();
+  std::cout << std::fixed << std::setprecision(1)
+            << "Registered " << num_registered << " of " << num_frames << " frames in " << duration.count() << "ms ("
+            << 1000. * static_cast<double>(num_frames) / duration.count() << " fps)\n";
+
+  for (const auto stage : {PipelineStage::capture, PipelineStage::features, PipelineStage::matching, PipelineStage::compositing})
+  {
+    const StageStats& stats = pipeline.stats(stage);
+    std::cout << "  " << stageName(stage) << ": " << stats.latency_ms.load() << "ms, "
+              << stats.num_dropped.load() << " dropped\n";
+  }
+  for (const auto path : {FramePath::detection, FramePath::tracking, FramePath::tracking_fallback})
+  {
+    std::cout << "  " << pathName(path) << ": " << num_per_path[static_cast<size_t>(path)] << " registered\n";
+  }
+  if (tiles)
+  {
+    std::cout << "Exported " << canvas.numTiles() << " tiles (" << canvas.bounds().width << "x"
+              << canvas.bounds().height << ") with overview levels\n";
+  }
+  else
+  {
+    std::cout << "Wrote " << mosaic_path.string() << " (" << mosaic.cols << "x" << mosaic.rows << ")\n";
+  }
+
+#ifdef LAB_MOSAIC_ENABLE_METRICS
+  // Write the latency statistics for the whole run, and a trace of the most recent events.
+  const LatencySummaries summaries = Metrics::instance().drainSummaries();
+  std::ofstream metrics_csv{fs::path(output_dir) / "metrics.csv"};
+  writeSummariesCsv(metrics_csv, summaries);
+  std::ofstream metrics_json{fs::path(output_dir) / "metrics.json"};
+  writeSummariesJson(metrics_json, summaries);
+  std::ofstream trace_json{fs::path(output_dir) / "trace.json"};
+  Metrics::instance().writeChromeTrace(trace_json);
+  std::cout << "Wrote metrics.csv, metrics.json and trace.json\n";
+#endif
+}
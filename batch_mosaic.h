@@ -0,0 +1,27 @@
+#pragma once
+
+#include "feature_config.h"
+#include "recording.h"
+#include "tile_exporter.h"
+
+#include <string>
+
+/// \brief Stitches a video file or a directory of images into a mosaic, without any GUI.
+///
+/// The first frame is used as the reference, and defines the mosaic coordinate system.
+/// Later frames are registered against the nearest keyframe, and chained to the mosaic through it.
+/// Writes the mosaic to "mosaic.png" and the homographies from each frame to the mosaic to "homographies.csv"
+/// in the output directory.
+/// \param input Path to a video file, or to a directory of images which are read in alphabetical order.
+/// \param output_dir Directory for the results, which is created if necessary.
+/// \param optimize If true, all homographies are optimized jointly before the mosaic is composited,
+///                 which reads the input a second time.
+/// \param features The keypoint detector, descriptor extractor and matcher.
+/// \param recording If set, the processed frames are recorded to it.
+/// \param tiles If set, the mosaic is exported to it as a tile pyramid while it is built, instead of to "mosaic.png",
+///              so that it never has to fit in one image.
+/// \param refine_homographies If true, homographies are refined after RANSAC, see PipelineSettings::refine_homographies.
+/// \param sprt If true, RANSAC rejects bad hypotheses early with the SPRT, see PipelineSettings::sprt.
+void runBatchMosaic(const std::string& input, const std::string& output_dir, bool optimize = false,
+                    const FeatureSettings& features = FeatureSettings{}, RecordingWriter* recording = nullptr,
+                    TileExporter* tiles = nullptr, bool refine_homographies = true, bool sprt = true);
@@ -0,0 +1,275 @@
+#include "allocation_counter.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#ifdef __GLIBC__
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <link.h>
+#endif
+
+namespace
+{
+std::atomic<std::size_t> allocation_count{0};
+std::atomic<std::size_t> own_allocation_count{0};
+std::atomic<bool> attribution_enabled{false};
+}
+
+#ifdef __GLIBC__
+
+namespace
+{
+/// \brief The base address of the executable, whose code is our own.
+const void* executable_base = nullptr;
+
+/// \brief True on a thread while it attributes an allocation, so that the stack walk does not attribute its own.
+thread_local bool attributing = false;
+
+/// \return The file name of a shared object, without its directory.
+const char* fileName(const char* path)
+{
+  const char* name = std::strrchr(path, '/');
+  return name ? name + 1 : path;
+}
+
+/// \return True if a shared object is an OpenCV library.
+bool isOpenCv(const char* path)
+{
+  return std::strncmp(fileName(path), "libopencv_", 10) == 0;
+}
+
+/// \return True if a shared object is our own code, which is the executable and the mosaic library.
+bool isOwnCode(const Dl_info& info)
+{
+  return info.dli_fbase == executable_base || std::strncmp(fileName(info.dli_fname), "libmosaic", 9) == 0;
+}
+
+/// \brief Stops dl_iterate_phdr() at the OpenCV core library.
+int findOpenCvCore(dl_phdr_info* info, std::size_t, void*)
+{
+  return info->dlpi_name && std::strstr(fileName(info->dlpi_name), "libopencv_core") ? 1 : 0;
+}
+
+/// \brief Counts an allocation, and attributes it to OpenCV or our own code when enabled.
+///
+/// The innermost caller in either OpenCV or our own code made the allocation,
+/// while the runtime libraries and any other libraries in between are passed through.
+/// This must be called directly by the allocation functions, since the stack walk skips their frame and its own,
+/// and is kept out of line for the same reason.
+#ifdef __clang__
+__attribute__((noinline))
+#else
+__attribute__((noipa))
+#endif
+void countAllocation()
+{
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (!attribution_enabled.load(std::memory_order_relaxed) || attributing)
+  { return; }
+  attributing = true;
+
+  constexpr int max_frames = 128;
+  constexpr int num_skipped = 2;
+  void* frames[max_frames];
+  const int num_frames = backtrace(frames, max_frames);
+  for (int i = num_skipped; i < num_frames; ++i)
+  {
+    Dl_info info;
+    if (dladdr(frames[i], &info) == 0 || !info.dli_fname)
+    { continue; }
+
+    if (isOpenCv(info.dli_fname))
+    { break; }
+
+    if (isOwnCode(info))
+    {
+      own_allocation_count.fetch_add(1, std::memory_order_relaxed);
+      break;
+    }
+  }
+
+  attributing = false;
+}
+}
+
+// Eigen and OpenCV allocate with malloc rather than operator new, so with glibc we count all heap allocations
+// by interposing the C allocation functions in the executable.
+// The default operator new calls malloc, so it is counted as well.
+extern "C"
+{
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t num, std::size_t size);
+void* __libc_realloc(void* ptr, std::size_t size);
+void* __libc_memalign(std::size_t alignment, std::size_t size);
+
+void* malloc(std::size_t size)
+{
+  countAllocation();
+  return __libc_malloc(size);
+}
+
+void* calloc(std::size_t num, std::size_t size)
+{
+  countAllocation();
+  return __libc_calloc(num, size);
+}
+
+void* realloc(void* ptr, std::size_t size)
+{
+  countAllocation();
+  return __libc_realloc(ptr, size);
+}
+
+void* memalign(std::size_t alignment, std::size_t size)
+{
+  countAllocation();
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(std::size_t alignment, std::size_t size)
+{
+  countAllocation();
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, std::size_t alignment, std::size_t size)
+{
+  countAllocation();
+  void* result = __libc_memalign(alignment, size);
+  if (!result)
+  { return ENOMEM; }
+
+  *ptr = result;
+  return 0;
+}
+}
+
+#else
+
+// Elsewhere, we can only count the allocations through operator new.
+// The array and nothrow versions call these by default.
+namespace
+{
+void countAllocation()
+{
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* allocate(std::size_t size)
+{
+  countAllocation();
+  if (void* ptr = std::malloc(size == 0 ? 1 : size))
+  { return ptr; }
+
+  throw std::bad_alloc{};
+}
+
+void* allocateAligned(std::size_t size, std::align_val_t alignment)
+{
+  countAllocation();
+  const auto align = static_cast<std::size_t>(alignment);
+
+#ifdef _WIN32
+  void* ptr = _aligned_malloc(size == 0 ? 1 : size, align);
+#else
+  // The size must be a multiple of the alignment.
+  void* ptr = std::aligned_alloc(align, (size + align - 1) / align * align);
+#endif
+  if (ptr)
+  { return ptr; }
+
+  throw std::bad_alloc{};
+}
+
+void freeAligned(void* ptr)
+{
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  std::free(ptr);
+#endif
+}
+}
+
+void* operator new(std::size_t size)
+{ return allocate(size); }
+
+void* operator new[](std::size_t size)
+{ return allocate(size); }
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{ return allocateAligned(size, alignment); }
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{ return allocateAligned(size, alignment); }
+
+void operator delete(void* ptr) noexcept
+{ std::free(ptr); }
+
+void operator delete[](void* ptr) noexcept
+{ std::free(ptr); }
+
+void operator delete(void* ptr, std::size_t) noexcept
+{ std::free(ptr); }
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{ std::free(ptr); }
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{ freeAligned(ptr); }
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{ freeAligned(ptr); }
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{ freeAligned(ptr); }
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept
+{ freeAligned(ptr); }
+
+#endif
+
+std::size_t allocationCount()
+{
+  return allocation_count.load(std::memory_order_relaxed);
+}
+
+bool setOpenCvAttribution(bool enabled)
+{
+#ifdef __GLIBC__
+  if (enabled)
+  {
+    // OpenCV linked into the executable cannot be told apart from our own code.
+    if (dl_iterate_phdr(findOpenCvCore, nullptr) == 0)
+    { return false; }
+
+    Dl_info info;
+    if (dladdr(reinterpret_cast<const void*>(&ownAllocationCount), &info) == 0)
+    { return false; }
+    executable_base = info.dli_fbase;
+
+    // The unwinder is loaded the first time the stack is walked, which allocates.
+    void* frame = nullptr;
+    backtrace(&frame, 1);
+  }
+
+  attribution_enabled.store(enabled, std::memory_order_relaxed);
+  return true;
+#else
+  static_cast<void>(enabled);
+  return false;
+#endif
+}
+
+std::size_t ownAllocationCount()
+{
+  return own_allocation_count.load(std::memory_order_relaxed);
+}
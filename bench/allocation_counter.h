@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+
+/// \brief Returns the number of heap allocations so far, from all threads.
+std::size_t allocationCount();
+
+/// \brief Starts or stops telling the heap allocations made by OpenCV apart from those made by our own code.
+///
+/// While attribution is enabled, the stack of each allocation is walked to find the innermost caller
+/// outside of the C and C++ runtime libraries.
+/// The allocation is made by OpenCV if that caller is in an OpenCV library, and by our own code otherwise.
+/// This is slow, and needs glibc and OpenCV built as shared libraries.
+/// \return False if allocations cannot be attributed, in which case ownAllocationCount() does not change.
+bool setOpenCvAttribution(bool enabled);
+
+/// \return The number of heap allocations made by our own code, rather than by OpenCV, while attribution was enabled.
+std::size_t ownAllocationCount();
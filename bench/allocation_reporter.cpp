@@ -0,0 +1,13 @@
+#include "allocation_reporter.h"
+
+#include "allocation_counter.h"
+
+AllocationReporter::AllocationReporter()
+    : start_count_{allocationCount()}
+{ }
+
+void AllocationReporter::report(benchmark::State& state) const
+{
+  state.counters["allocs"] = benchmark::Counter(static_cast<double>(allocationCount() - start_count_),
+                                                benchmark::Counter::kAvgIterations);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "benchmark/benchmark.h"
+
+#include <cstddef>
+
+/// \brief Reports the number of allocations per iteration of a benchmark.
+///
+/// Construct it right before the benchmark loop, and call report() right after.
+class AllocationReporter
+{
+public:
+  AllocationReporter();
+
+  /// \brief Adds the allocations per iteration since construction as the "allocs" counter.
+  void report(benchmark::State& state) const;
+
+private:
+  std::size_t start_count_;
+};
@@ -0,0 +1,123 @@
+#include "allocation_reporter.h"
+#include "mosaic_canvas.h"
+#include "perspective_warp.h"
+#include "synthetic_data.h"
+
+#include "benchmark/benchmark.h"
+#include "opencv2/imgproc.hpp"
+
+namespace
+{
+/// \brief A frame, and a homography that scales it by 0.5 with a slight rotation and perspective.
+struct WarpData
+{
+  cv::Mat frame;
+  cv::Matx33f H;
+};
+
+WarpData makeWarpData()
+{
+  WarpData data;
+  cv::cvtColor(makeTexturedImage({640, 480}), data.frame, cv::COLOR_GRAY2BGR);
+  data.H = {
+      0.49f, -0.05f, 160.f,
+      0.05f, 0.49f, 120.f,
+      1e-5f, 2e-5f, 1.f};
+  return data;
+}
+
+/// \brief Warps a frame and an all-ones mask with OpenCV, and copies the warped frame through the mask,
+/// as the canvas did before the fused warp.
+void BM_WarpOpenCv(benchmark::State& state)
+{
+  const WarpData data = makeWarpData();
+  const cv::Mat mask = cv::Mat::ones(data.frame.size(), CV_8UC1);
+  cv::Mat dst = cv::Mat::zeros(data.frame.size(), data.frame.type());
+
+  cv::Mat image_warp;
+  cv::Mat mask_warp;
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    cv::warpPerspective(mask, mask_warp, data.H, dst.size(), cv::INTER_NEAREST, cv::BORDER_CONSTANT, 0);
+    cv::warpPerspective(data.frame, image_warp, data.H, dst.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+    image_warp.copyTo(dst, mask_warp);
+    benchmark::DoNotOptimize(dst.data);
+  }
+  allocations.report(state);
+
+  state.SetItemsProcessed(state.iterations() * dst.size().area());
+}
+
+/// \brief Warps a frame directly into the destination with the fused warp.
+void BM_WarpFused(benchmark::State& state)
+{
+  const WarpData data = makeWarpData();
+  cv::Mat dst = cv::Mat::zeros(data.frame.size(), data.frame.type());
+
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    warpPerspectiveFused(data.frame, data.H, dst);
+    benchmark::DoNotOptimize(dst.data);
+  }
+  allocations.report(state);
+
+  state.SetItemsProcessed(state.iterations() * dst.size().area());
+}
+
+/// \brief Warps a frame and computes its mask with the fused warp, as when blending.
+void BM_WarpFusedWithMask(benchmark::State& state)
+{
+  const WarpData data = makeWarpData();
+  cv::Mat dst = cv::Mat::zeros(data.frame.size(), data.frame.type());
+
+  cv::Mat mask;
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    warpPerspectiveFused(data.frame, data.H, dst, mask, WarpBorder::replicate);
+    benchmark::DoNotOptimize(dst.data);
+    benchmark::DoNotOptimize(mask.data);
+  }
+  allocations.report(state);
+
+  state.SetItemsProcessed(state.iterations() * dst.size().area());
+}
+
+/// \brief Inserts a frame into a canvas with the blend mode as argument.
+/// The frame is scaled by 0.5 as in the live mosaic, and moves back and forth over the same part of the canvas,
+/// so that each insert overlaps the previous one.
+void BM_CanvasInsert(benchmark::State& state)
+{
+  cv::Mat frame;
+  cv::cvtColor(makeTexturedImage({640, 480}), frame, cv::COLOR_GRAY2BGR);
+  MosaicCanvas canvas{256, CV_8UC3, static_cast<BlendMode>(state.range(0))};
+
+  const cv::Matx33f H[2] = {
+      {0.5f, 0.f, 160.f, 0.f, 0.5f, 120.f, 0.f, 0.f, 1.f},
+      {0.5f, 0.f, 240.f, 0.f, 0.5f, 180.f, 0.f, 0.f, 1.f}};
+  canvas.insert(frame, H[0]);
+  canvas.insert(frame, H[1]);
+
+  const AllocationReporter allocations;
+  size_t i = 0;
+  for (auto _ : state)
+  {
+    const cv::Rect bbox = canvas.insert(frame, H[i++ % 2]);
+    benchmark::DoNotOptimize(bbox);
+  }
+  allocations.report(state);
+
+  state.SetLabel(state.range(0) == 0 ? "overwrite" : state.range(0) == 1 ? "feather" : "multiband");
+}
+}
+
+BENCHMARK(BM_WarpOpenCv)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_WarpFused)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_WarpFusedWithMask)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_CanvasInsert)
+    ->Arg(static_cast<int>(BlendMode::overwrite))
+    ->Arg(static_cast<int>(BlendMode::feather))
+    ->Arg(static_cast<int>(BlendMode::multiband))
+    ->Unit(benchmark::kMicrosecond);
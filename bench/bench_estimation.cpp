@@ -0,0 +1,179 @@
+#include "allocation_reporter.h"
+#include "homography_estimator.h"
+#include "homography_refinement.h"
+#include "synthetic_data.h"
+
+#include "benchmark/benchmark.h"
+
+namespace
+{
+/// \brief Estimates homographies with RANSAC, with the number of points and the inlier percentage as arguments.
+void estimateHomographies(benchmark::State& state, std::unique_ptr<PointSampler> sampler, bool sprt = false)
+{
+  const auto data = makeCorrespondences(state.range(0), static_cast<float>(state.range(1)) / 100.f, 0.5f);
+
+  // Use a fixed seed, so that each run tests the same hypotheses.
+  HomographyEstimator estimator(0.99f, 3.f, 10000, 1, 42u, std::move(sampler), false, sprt);
+
+  size_t num_inliers = 0;
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    const auto estimate = estimator.estimate(data.pts1, data.pts2);
+    num_inliers = estimate.num_inliers;
+    benchmark::DoNotOptimize(estimate.homography.data());
+  }
+  allocations.report(state);
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.counters["inliers"] = static_cast<double>(num_inliers);
+}
+
+void BM_EstimateUniform(benchmark::State& state)
+{
+  estimateHomographies(state, std::make_unique<UniformSampler>());
+}
+
+void BM_EstimateProsac(benchmark::State& state)
+{
+  // The synthetic correspondences are not ordered by quality, which is the worst case for PROSAC.
+  estimateHomographies(state, std::make_unique<ProsacSampler>());
+}
+
+void BM_EstimateSprt(benchmark::State& state)
+{
+  // Bad hypotheses are rejected after a few points, so this should gain the most over BM_EstimateUniform
+  // with many points and few inliers.
+  estimateHomographies(state, std::make_unique<UniformSampler>(), true);
+}
+
+/// \brief Estimates homographies into a reused estimate, which should not allocate memory once its buffers have grown.
+/// The number of points, the inlier percentage and the number of threads are the arguments.
+/// The allocations are checked by the allocation test.
+void BM_EstimateInPlace(benchmark::State& state)
+{
+  const auto data = makeCorrespondences(state.range(0), static_cast<float>(state.range(1)) / 100.f, 0.5f);
+  HomographyEstimator estimator(0.99f, 3.f, 10000, static_cast<int>(state.range(2)), 42u,
+                                std::make_unique<ProsacSampler>(), true);
+
+  // Let the buffers grow to their final size.
+  HomographyEstimate estimate;
+  for (int i = 0; i < 3; ++i)
+  {
+    estimator.estimate(data.pts1, data.pts2, estimate);
+  }
+
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    estimator.estimate(data.pts1, data.pts2, estimate);
+    benchmark::DoNotOptimize(estimate.homography.data());
+  }
+  allocations.report(state);
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.counters["inliers"] = static_cast<double>(estimate.num_inliers);
+}
+
+void BM_DltEstimator(benchmark::State& state)
+{
+  const auto data = makeCorrespondences(state.range(0), 1.f, 1.f);
+
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(HomographyEstimator::dltEstimator(data.pts1, data.pts2).data());
+  }
+  allocations.report(state);
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void BM_NormalizedDltEstimator(benchmark::State& state)
+{
+  const auto data = makeCorrespondences(state.range(0), 1.f, 1.f);
+
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(HomographyEstimator::normalizedDltEstimator(data.pts1, data.pts2).data());
+  }
+  allocations.report(state);
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void BM_RefineHomography(benchmark::State& state)
+{
+  const auto data = makeCorrespondences(state.range(0), 1.f, 0.5f);
+  const Eigen::Matrix3f H = HomographyEstimator::normalizedDltEstimator(data.pts1, data.pts2);
+
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(refineHomography(data.pts1, data.pts2, H).data());
+  }
+  allocations.report(state);
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+/// \brief Optimizes a chain of frames, where every tenth frame also overlaps with the frame ten steps back.
+void BM_MosaicOptimizer(benchmark::State& state)
+{
+  const int num_frames = static_cast<int>(state.range(0));
+  const auto data = makeCorrespondences(50, 1.f, 0.5f);
+
+  // Each frame is shifted relative to the previous, with a small error in the initial estimate.
+  std::vector<Eigen::Matrix3f> to_mosaic(num_frames, Eigen::Matrix3f::Identity());
+  for (int frame = 1; frame < num_frames; ++frame)
+  {
+    Eigen::Matrix3f step = Eigen::Matrix3f::Identity();
+    step(0, 2) = 20.f + 0.01f * static_cast<float>(frame % 7);
+    to_mosaic[frame] = to_mosaic[frame - 1] * step;
+  }
+
+  const auto addPair = [&](MosaicOptimizer& optimizer, int frame_a, int frame_b)
+  {
+    const Eigen::Matrix3f a_to_b = to_mosaic[frame_b].inverse() * to_mosaic[frame_a];
+    const Eigen::Matrix2Xf pts_b = (a_to_b * data.pts1.colwise().homogeneous()).colwise().hnormalized();
+    optimizer.addCorrespondences(frame_a, frame_b, data.pts1, pts_b);
+  };
+
+  for (auto _ : state)
+  {
+    state.PauseTiming();
+    MosaicOptimizer optimizer;
+    for (int frame = 0; frame < num_frames; ++frame)
+    {
+      Eigen::Matrix3f initial = to_mosaic[frame];
+      initial(1, 2) += 0.1f * static_cast<float>(frame % 5);
+      optimizer.addFrame(initial, frame == 0);
+    }
+    for (int frame = 1; frame < num_frames; ++frame)
+    {
+      addPair(optimizer, frame - 1, frame);
+      if (frame >= 10 && frame % 10 == 0)
+      { addPair(optimizer, frame - 10, frame); }
+    }
+    state.ResumeTiming();
+
+    benchmark::DoNotOptimize(optimizer.optimize());
+  }
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+}
+
+BENCHMARK(BM_EstimateUniform)->ArgNames({"points", "inlier_pct"})
+  ->ArgsProduct({{200, 1000, 4000}, {15, 25, 50, 90}})->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_EstimateProsac)->ArgNames({"points", "inlier_pct"})
+  ->ArgsProduct({{200, 1000}, {25, 50, 90}})->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_EstimateSprt)->ArgNames({"points", "inlier_pct"})
+  ->ArgsProduct({{200, 1000, 4000}, {15, 25, 50, 90}})->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_EstimateInPlace)->ArgNames({"points", "inlier_pct", "threads"})
+  ->ArgsProduct({{200, 1000}, {50}, {1, 4}})->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_DltEstimator)->RangeMultiplier(4)->Range(4, 1024)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_NormalizedDltEstimator)->RangeMultiplier(4)->Range(4, 1024)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_RefineHomography)->RangeMultiplier(4)->Range(16, 1024)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_MosaicOptimizer)->RangeMultiplier(4)->Range(16, 1024)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,90 @@
+#include "allocation_reporter.h"
+#include "feature_config.h"
+#include "feature_utils.h"
+#include "synthetic_data.h"
+
+#include "benchmark/benchmark.h"
+
+namespace
+{
+void BM_ExtractGoodRatioMatches(benchmark::State& state)
+{
+  const auto matches = makeKnnMatches(static_cast<int>(state.range(0)), 1000);
+
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    const auto good_matches = extractGoodRatioMatches(matches, 0.8f);
+    benchmark::DoNotOptimize(good_matches.data());
+  }
+  allocations.report(state);
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void BM_ExtractMatchingPoints(benchmark::State& state)
+{
+  const int num_matches = static_cast<int>(state.range(0));
+  const auto keypoints1 = makeKeypoints(num_matches, 1);
+  const auto keypoints2 = makeKeypoints(num_matches, 2);
+  const auto matches = extractGoodRatioMatches(makeKnnMatches(num_matches, num_matches), 1.1f);
+
+  Eigen::Matrix2Xf pts1;
+  Eigen::Matrix2Xf pts2;
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    extractMatchingPoints(keypoints1, keypoints2, matches, pts1, pts2);
+    benchmark::DoNotOptimize(pts1.data());
+    benchmark::DoNotOptimize(pts2.data());
+  }
+  allocations.report(state);
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+/// \brief Detects ORB keypoints in the whole image, as the pipeline does with the global detection strategy.
+void BM_DetectGlobal(benchmark::State& state)
+{
+  const cv::Mat image = makeTexturedImage({640, 480});
+  auto detector = cv::ORB::create(1000);
+
+  std::vector<cv::KeyPoint> keypoints;
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    detector->detect(image, keypoints);
+    cv::KeyPointsFilter::retainBest(keypoints, 1000);
+    benchmark::DoNotOptimize(keypoints.data());
+  }
+  allocations.report(state);
+
+  state.counters["keypoints"] = static_cast<double>(keypoints.size());
+}
+
+/// \brief Detects ORB keypoints in a grid, with the grid width as argument and a 4:3 grid.
+void BM_DetectInGrid(benchmark::State& state)
+{
+  const cv::Mat image = makeTexturedImage({640, 480});
+  const cv::Size grid_size{static_cast<int>(state.range(0)), static_cast<int>(state.range(0)) * 3 / 4};
+  const int max_in_cell = (1000 + grid_size.area() - 1) / grid_size.area();
+  auto detector = GridDetector::create([max_in_cell]() { return cv::ORB::create(4*max_in_cell); },
+                                       grid_size, max_in_cell, detectorPatchWidth(DetectorType::orb));
+
+  std::vector<cv::KeyPoint> keypoints;
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    detector->detect(image, keypoints);
+    benchmark::DoNotOptimize(keypoints.data());
+  }
+  allocations.report(state);
+
+  state.counters["keypoints"] = static_cast<double>(keypoints.size());
+}
+}
+
+BENCHMARK(BM_ExtractGoodRatioMatches)->RangeMultiplier(4)->Range(500, 8000);
+BENCHMARK(BM_ExtractMatchingPoints)->RangeMultiplier(4)->Range(500, 8000);
+BENCHMARK(BM_DetectGlobal)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_DetectInGrid)->Arg(4)->Arg(8)->Arg(16)->Unit(benchmark::kMillisecond)->UseRealTime();
@@ -0,0 +1,49 @@
+#include "homography_estimator.h"
+#include "inlier_scorer.h"
+#include "synthetic_data.h"
+
+#include "benchmark/benchmark.h"
+
+namespace
+{
+void BM_ScalarScoring(benchmark::State& state)
+{
+  // Half of the correspondences are outliers.
+  const auto [H, pts1, pts2] = makeCorrespondences(state.range(0), 0.5f, 0.f);
+  const Eigen::Matrix3f H_inv = H.inverse();
+
+  PointSelection inliers;
+  for (auto _ : state)
+  {
+    // This is how each hypothesis was scored before the batched scorer.
+    inliers.clear();
+    for (Eigen::Index i = 0; i < pts1.cols(); ++i)
+    {
+      if (HomographyEstimator::computeReprojectionError(pts1.col(i), pts2.col(i), H, H_inv) < 3.f)
+      {
+        inliers.push_back(i);
+      }
+    }
+    benchmark::DoNotOptimize(inliers.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void BM_BatchedScoring(benchmark::State& state)
+{
+  // Half of the correspondences are outliers.
+  const auto [H, pts1, pts2] = makeCorrespondences(state.range(0), 0.5f, 0.f);
+  const Eigen::Matrix3f H_inv = H.inverse();
+
+  InlierScorer scorer;
+  scorer.setPoints(pts1, pts2);
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(scorer.countInliers(H, H_inv, 3.f));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+}
+
+BENCHMARK(BM_ScalarScoring)->RangeMultiplier(2)->Range(128, 4096)->Arg(100)->Arg(5000);
+BENCHMARK(BM_BatchedScoring)->RangeMultiplier(2)->Range(128, 4096)->Arg(100)->Arg(5000);
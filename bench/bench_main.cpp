@@ -0,0 +1,5 @@
+#include "benchmark/benchmark.h"
+
+// The benchmarks run offline on synthetic data.
+// Use --benchmark_format=json or --benchmark_out=<file> to store results for regression comparison.
+BENCHMARK_MAIN();
@@ -0,0 +1,87 @@
+#include "allocation_reporter.h"
+#include "feature_config.h"
+#include "feature_utils.h"
+#include "hamming_matcher.h"
+#include "synthetic_data.h"
+
+#include "opencv2/features2d.hpp"
+
+#include "benchmark/benchmark.h"
+
+namespace
+{
+/// \brief Matches with BFMatcher and the ratio test, with the number of query and train descriptors as argument.
+void BM_BFMatcherRatio(benchmark::State& state)
+{
+  cv::Mat query;
+  cv::Mat train;
+  makeBinaryDescriptors(static_cast<int>(state.range(0)), static_cast<int>(state.range(0)), query, train);
+
+  cv::BFMatcher matcher{cv::NORM_HAMMING};
+  std::vector<std::vector<cv::DMatch>> knn_matches;
+  std::vector<cv::DMatch> matches;
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    matcher.knnMatch(query, train, knn_matches, 2);
+    matches = extractGoodRatioMatches(knn_matches, 0.8f);
+    benchmark::DoNotOptimize(matches.data());
+  }
+  allocations.report(state);
+
+  state.SetItemsProcessed(state.iterations() * state.range(0) * state.range(0));
+  state.counters["matches"] = static_cast<double>(matches.size());
+}
+
+/// \brief Matches with HammingMatcher, with the number of descriptors and cross checking as arguments.
+void BM_HammingMatcher(benchmark::State& state)
+{
+  cv::Mat query;
+  cv::Mat train;
+  makeBinaryDescriptors(static_cast<int>(state.range(0)), static_cast<int>(state.range(0)), query, train);
+
+  HammingMatcher matcher{0.8f, state.range(1) != 0};
+  std::vector<cv::DMatch> matches;
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    matcher.match(query, train, matches);
+    benchmark::DoNotOptimize(matches.data());
+  }
+  allocations.report(state);
+
+  state.SetItemsProcessed(state.iterations() * state.range(0) * state.range(0));
+  state.counters["matches"] = static_cast<double>(matches.size());
+}
+
+/// \brief Matches ORB descriptors with the LSH matcher, repeatedly against the same keyframe,
+/// with the number of descriptors as argument. The index is only built before the first iteration.
+void BM_FeatureMatcherLsh(benchmark::State& state)
+{
+  cv::Mat query;
+  cv::Mat train;
+  makeBinaryDescriptors(static_cast<int>(state.range(0)), static_cast<int>(state.range(0)), query, train);
+
+  FeatureSettings settings;
+  settings.matcher = MatcherType::lsh;
+  FeatureMatcher matcher{settings};
+  std::vector<cv::DMatch> matches;
+  matcher.match(query, train, matches);
+
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    matcher.match(query, train, matches);
+    benchmark::DoNotOptimize(matches.data());
+  }
+  allocations.report(state);
+
+  state.SetItemsProcessed(state.iterations() * state.range(0) * state.range(0));
+  state.counters["matches"] = static_cast<double>(matches.size());
+}
+}
+
+BENCHMARK(BM_BFMatcherRatio)->RangeMultiplier(2)->Range(250, 2000)->Unit(benchmark::kMicrosecond)->UseRealTime();
+BENCHMARK(BM_HammingMatcher)->ArgNames({"descriptors", "cross_check"})
+  ->ArgsProduct({{250, 500, 1000, 2000}, {0, 1}})->Unit(benchmark::kMicrosecond)->UseRealTime();
+BENCHMARK(BM_FeatureMatcherLsh)->RangeMultiplier(2)->Range(250, 2000)->Unit(benchmark::kMicrosecond)->UseRealTime();
@@ -0,0 +1,22 @@
+#include "allocation_reporter.h"
+#include "metrics.h"
+
+#include "benchmark/benchmark.h"
+
+namespace
+{
+/// \brief Measures the overhead of a scoped timer, which should not allocate memory.
+void BM_ScopedTimer(benchmark::State& state)
+{
+  const AllocationReporter allocations;
+  for (auto _ : state)
+  {
+    const ScopedTimer timer{TimedEvent::matching};
+  }
+  allocations.report(state);
+
+  Metrics::instance().drainSummaries();
+}
+}
+
+BENCHMARK(BM_ScopedTimer)->Threads(1)->Threads(4);
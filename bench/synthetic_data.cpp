@@ -0,0 +1,144 @@
+#include "synthetic_data.h"
+
+#include "opencv2/imgproc.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+
+namespace
+{
+constexpr float image_width = 640.f;
+constexpr float image_height = 480.f;
+}
+
+SyntheticCorrespondences makeCorrespondences(Eigen::Index num_points, float inlier_ratio, float noise_sigma,
+                                             std::uint32_t seed)
+{
+  SyntheticCorrespondences data;
+  data.homography << 0.9f, -0.1f, 20.f,
+                     0.1f,  0.9f, -10.f,
+                     1e-4f, 0.f,   1.f;
+
+  std::mt19937 generator{seed};
+  std::uniform_real_distribution<float> x_distribution(0.f, image_width);
+  std::uniform_real_distribution<float> y_distribution(0.f, image_height);
+  std::normal_distribution<float> noise_distribution(0.f, noise_sigma > 0.f ? noise_sigma : 1.f);
+
+  // Choose exactly which correspondences are inliers.
+  const auto num_inliers = static_cast<Eigen::Index>(std::round(inlier_ratio * static_cast<float>(num_points)));
+  std::vector<bool> is_inlier(static_cast<size_t>(num_points), false);
+  std::fill_n(is_inlier.begin(), std::clamp<Eigen::Index>(num_inliers, 0, num_points), true);
+  std::shuffle(is_inlier.begin(), is_inlier.end(), generator);
+
+  data.pts1.resize(Eigen::NoChange, num_points);
+  data.pts2.resize(Eigen::NoChange, num_points);
+  for (Eigen::Index i = 0; i < num_points; ++i)
+  {
+    data.pts1.col(i) << x_distribution(generator), y_distribution(generator);
+
+    if (is_inlier[static_cast<size_t>(i)])
+    {
+      data.pts2.col(i) = (data.homography * data.pts1.col(i).homogeneous()).hnormalized();
+      if (noise_sigma > 0.f)
+      {
+        data.pts2.col(i) += Eigen::Vector2f{noise_distribution(generator), noise_distribution(generator)};
+      }
+    }
+    else
+    {
+      data.pts2.col(i) << x_distribution(generator), y_distribution(generator);
+    }
+  }
+
+  return data;
+}
+
+std::vector<std::vector<cv::DMatch>> makeKnnMatches(int num_queries, int num_train, std::uint32_t seed)
+{
+  std::mt19937 generator{seed};
+  std::uniform_int_distribution<int> train_distribution(0, num_train - 1);
+
+  // ORB distances are between 0 and 256 bits, and good matches are much closer than the next best.
+  std::uniform_real_distribution<float> best_distribution(10.f, 80.f);
+  std::uniform_real_distribution<float> ratio_distribution(0.3f, 1.f);
+
+  std::vector<std::vector<cv::DMatch>> matches(static_cast<size_t>(num_queries));
+  for (int i = 0; i < num_queries; ++i)
+  {
+    const float best_distance = best_distribution(generator);
+    const float second_distance = best_distance / ratio_distribution(generator);
+    matches[static_cast<size_t>(i)] = {{i, train_distribution(generator), best_distance},
+                                       {i, train_distribution(generator), second_distance}};
+  }
+
+  return matches;
+}
+
+void makeBinaryDescriptors(int num_queries, int num_train, cv::Mat& query, cv::Mat& train, std::uint32_t seed)
+{
+  cv::RNG rng{seed};
+  query.create(num_queries, 32, CV_8UC1);
+  train.create(num_train, 32, CV_8UC1);
+  rng.fill(query, cv::RNG::UNIFORM, 0, 256);
+  rng.fill(train, cv::RNG::UNIFORM, 0, 256);
+
+  // Let the first half of the queries have a true match in a random train row, with up to 24 bits flipped.
+  for (int i = 0; i < std::min(num_queries / 2, num_train); ++i)
+  {
+    const int train_idx = rng.uniform(0, num_train);
+    query.row(i).copyTo(train.row(train_idx));
+
+    const int num_flips = rng.uniform(0, 25);
+    for (int j = 0; j < num_flips; ++j)
+    {
+      const int bit = rng.uniform(0, 256);
+      train.at<uchar>(train_idx, bit / 8) ^= static_cast<uchar>(1u << (bit % 8));
+    }
+  }
+}
+
+std::vector<cv::KeyPoint> makeKeypoints(int num_keypoints, std::uint32_t seed)
+{
+  std::mt19937 generator{seed};
+  std::uniform_real_distribution<float> x_distribution(0.f, image_width);
+  std::uniform_real_distribution<float> y_distribution(0.f, image_height);
+
+  std::vector<cv::KeyPoint> keypoints;
+  keypoints.reserve(static_cast<size_t>(num_keypoints));
+  for (int i = 0; i < num_keypoints; ++i)
+  {
+    keypoints.emplace_back(x_distribution(generator), y_distribution(generator), 31.f);
+  }
+
+  return keypoints;
+}
+
+cv::Mat makeTexturedImage(cv::Size size, std::uint32_t seed)
+{
+  cv::RNG rng{seed};
+  cv::Mat image(size, CV_8UC1, cv::Scalar{128});
+
+  const int num_shapes = size.area() / 500;
+  for (int i = 0; i < num_shapes; ++i)
+  {
+    const cv::Point center{rng.uniform(0, size.width), rng.uniform(0, size.height)};
+    const int radius = rng.uniform(3, 30);
+    const cv::Scalar intensity{static_cast<double>(rng.uniform(0, 256))};
+
+    if (i % 2 == 0)
+    {
+      cv::rectangle(image, center - cv::Point{radius, radius}, center + cv::Point{radius, radius}, intensity, cv::FILLED);
+    }
+    else
+    {
+      cv::circle(image, center, radius, intensity, cv::FILLED);
+    }
+  }
+
+  // Smooth the edges a little, like a camera would.
+  cv::GaussianBlur(image, image, cv::Size{3, 3}, 0.);
+
+  return image;
+}
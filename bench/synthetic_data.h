@@ -0,0 +1,44 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+#include "Eigen/Dense"
+
+#include <cstdint>
+#include <vector>
+
+/// \brief Point correspondences under a known homography.
+struct SyntheticCorrespondences
+{
+  Eigen::Matrix3f homography;
+  Eigen::Matrix2Xf pts1;
+  Eigen::Matrix2Xf pts2;
+};
+
+/// \brief Creates point correspondences in a 640x480 image under a known homography.
+/// \param num_points The number of correspondences.
+/// \param inlier_ratio The fraction of correspondences that agree with the homography.
+///                     The inliers are spread randomly among the outliers.
+/// \param noise_sigma Standard deviation of the Gaussian noise added to the inliers in image 2, in pixels.
+/// \param seed Seed for the random generator, so that the data is the same for each run.
+SyntheticCorrespondences makeCorrespondences(Eigen::Index num_points, float inlier_ratio, float noise_sigma,
+                                             std::uint32_t seed = 42);
+
+/// \brief Creates the best and second best match for a set of query descriptors.
+/// \param num_queries The number of query descriptors.
+/// \param num_train The number of train descriptors.
+/// \param seed Seed for the random generator.
+std::vector<std::vector<cv::DMatch>> makeKnnMatches(int num_queries, int num_train, std::uint32_t seed = 42);
+
+/// \brief Creates 32 byte binary descriptors, like ORB, where some of the query descriptors have a true match.
+/// \param num_queries The number of query descriptors.
+/// \param num_train The number of train descriptors.
+/// \param[out] query The query descriptors.
+/// \param[out] train The train descriptors, where the first half of the query descriptors are found with a few bits flipped.
+/// \param seed Seed for the random generator.
+void makeBinaryDescriptors(int num_queries, int num_train, cv::Mat& query, cv::Mat& train, std::uint32_t seed = 42);
+
+/// \brief Creates randomly placed keypoints in a 640x480 image.
+std::vector<cv::KeyPoint> makeKeypoints(int num_keypoints, std::uint32_t seed = 42);
+
+/// \brief Creates a textured gray scale image with random rectangles and circles, which have plenty of corners.
+cv::Mat makeTexturedImage(cv::Size size, std::uint32_t seed = 42);
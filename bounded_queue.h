@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+
+/// \brief A bounded, lock-free queue for passing items between threads.
+///
+/// Any number of threads may push and pop concurrently.
+/// Each slot carries a sequence number that tells producers and consumers whether it is free or full,
+/// see D. Vyukov, "Bounded MPMC queue".
+template<typename T>
+class BoundedQueue
+{
+public:
+  /// \brief Constructs the queue.
+  /// \param capacity Maximum number of items in the queue, which must be a power of two.
+  explicit BoundedQueue(size_t capacity)
+      : capacity_{capacity}
+      , mask_{capacity - 1}
+      , cells_{new Cell[capacity]}
+      , enqueue_pos_{0}
+      , dequeue_pos_{0}
+  {
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+    {
+      throw std::invalid_argument("Queue capacity must be a power of two");
+    }
+
+    for (size_t i = 0; i < capacity; ++i)
+    {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  /// \brief Pushes an item onto the queue.
+  /// \return False if the queue is full, in which case the item is left untouched.
+  bool tryPush(T& item)
+  {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+
+    while (true)
+    {
+      cell = &cells_[pos & mask_];
+      const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      const auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+
+      if (diff == 0)
+      {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        { break; }
+      }
+      else if (diff < 0)
+      {
+        return false;
+      }
+      else
+      {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->data = std::move(item);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// \brief Pops the oldest item from the queue.
+  /// \return False if the queue is empty.
+  bool tryPop(T& item)
+  {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+
+    while (true)
+    {
+      cell = &cells_[pos & mask_];
+      const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      const auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1);
+
+      if (diff == 0)
+      {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        { break; }
+      }
+      else if (diff < 0)
+      {
+        return false;
+      }
+      else
+      {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+
+    item = std::move(cell->data);
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// \return The approximate number of items in the queue.
+  size_t size() const
+  {
+    const size_t enqueue_pos = enqueue_pos_.load(std::memory_order_relaxed);
+    const size_t dequeue_pos = dequeue_pos_.load(std::memory_order_relaxed);
+    return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+  }
+
+  /// \return The maximum number of items in the queue.
+  size_t capacity() const
+  {
+    return capacity_;
+  }
+
+private:
+  struct Cell
+  {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  // Keep the producer and consumer positions on separate cache lines.
+  static constexpr size_t cache_line_size = 64;
+
+  size_t capacity_;
+  size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  alignas(cache_line_size) std::atomic<size_t> enqueue_pos_;
+  alignas(cache_line_size) std::atomic<size_t> dequeue_pos_;
+};
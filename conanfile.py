@@ -2,7 +2,7 @@ from conans import ConanFile, CMake
 
 class LabMosaic(ConanFile):
     settings = "os", "compiler", "build_type", "arch"
-    requires = "eigen/3.4.0", "opencv/4.5.5"
+    requires = "eigen/3.4.0", "opencv/4.5.5", "benchmark/1.7.1"
     generators = "cmake_find_package", "virtualrunenv"
     default_options = {
         "opencv:contrib": True,
@@ -0,0 +1,322 @@
+#include "feature_config.h"
+
+#include "feature_utils.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+/// \brief ORB does not detect keypoints closer to the image border than this, and uses it as its patch size.
+constexpr int orb_edge_threshold = 31;
+
+/// \brief Looks up an enum value by its name.
+template<typename Enum, size_t num_values>
+Enum parseName(const std::string& name, const Enum (&values)[num_values], const char* (*toName)(Enum),
+               const char* what)
+{
+  for (const Enum value : values)
+  {
+    if (name == toName(value))
+    {
+      return value;
+    }
+  }
+
+  throw std::invalid_argument("Unknown " + std::string(what) + " \"" + name + "\"");
+}
+
+/// \return The threshold from the settings, or a default value if it is zero.
+float thresholdOr(const FeatureSettings& settings, float default_threshold)
+{
+  return settings.detector_threshold > 0.f ? settings.detector_threshold : default_threshold;
+}
+}
+
+const char* detectorName(DetectorType detector)
+{
+  switch (detector)
+  {
+    case DetectorType::fast: return "fast";
+    case DetectorType::agast: return "agast";
+    case DetectorType::orb: return "orb";
+    case DetectorType::brisk: return "brisk";
+    case DetectorType::akaze: return "akaze";
+    case DetectorType::sift: return "sift";
+  }
+
+  return "";
+}
+
+const char* descriptorName(DescriptorType descriptor)
+{
+  switch (descriptor)
+  {
+    case DescriptorType::orb: return "orb";
+    case DescriptorType::brisk: return "brisk";
+    case DescriptorType::akaze: return "akaze";
+    case DescriptorType::sift: return "sift";
+  }
+
+  return "";
+}
+
+const char* matcherName(MatcherType matcher)
+{
+  switch (matcher)
+  {
+    case MatcherType::hamming: return "hamming";
+    case MatcherType::brute_force: return "brute_force";
+    case MatcherType::flann: return "flann";
+    case MatcherType::lsh: return "lsh";
+  }
+
+  return "";
+}
+
+DetectorType parseDetectorType(const std::string& name)
+{
+  constexpr DetectorType values[] = {DetectorType::fast, DetectorType::agast, DetectorType::orb,
+                                     DetectorType::brisk, DetectorType::akaze, DetectorType::sift};
+  return parseName(name, values, detectorName, "detector");
+}
+
+DescriptorType parseDescriptorType(const std::string& name)
+{
+  constexpr DescriptorType values[] = {DescriptorType::orb, DescriptorType::brisk, DescriptorType::akaze,
+                                       DescriptorType::sift};
+  return parseName(name, values, descriptorName, "descriptor");
+}
+
+MatcherType parseMatcherType(const std::string& name)
+{
+  constexpr MatcherType values[] = {MatcherType::hamming, MatcherType::brute_force, MatcherType::flann,
+                                    MatcherType::lsh};
+  return parseName(name, values, matcherName, "matcher");
+}
+
+std::string describeFeatureSettings(const FeatureSettings& settings)
+{
+  std::ostringstream description;
+  description << detectorName(settings.detector) << "/" << descriptorName(settings.descriptor) << "/"
+              << matcherName(settings.matcher) << "/" << settings.max_keypoints;
+  return description.str();
+}
+
+bool isBinaryDescriptor(DescriptorType descriptor)
+{
+  return descriptor != DescriptorType::sift;
+}
+
+void validateFeatureSettings(const FeatureSettings& settings)
+{
+  if (settings.max_keypoints <= 0)
+  {
+    throw std::invalid_argument("The keypoint budget must be positive");
+  }
+
+  if (settings.detector_threshold < 0.f)
+  {
+    throw std::invalid_argument("The detector threshold must not be negative");
+  }
+
+  if (settings.max_ratio <= 0.f || settings.max_ratio > 1.f)
+  {
+    throw std::invalid_argument("The ratio test threshold must be in (0, 1]");
+  }
+
+  // A homography needs at least four correspondences.
+  if (settings.min_matches < 4)
+  {
+    throw std::invalid_argument("At least four matches are needed to estimate a homography");
+  }
+
+  // AKAZE descriptors use the scale space computed by the AKAZE detector.
+  if (settings.descriptor == DescriptorType::akaze && settings.detector != DetectorType::akaze)
+  {
+    throw std::invalid_argument("AKAZE descriptors can only be computed for AKAZE keypoints");
+  }
+
+  // SIFT packs its layer and scale into the octave of a keypoint, which ORB and BRISK read as a pyramid level.
+  const bool binary = isBinaryDescriptor(settings.descriptor);
+  if (settings.detector == DetectorType::sift && binary)
+  {
+    throw std::invalid_argument("ORB and BRISK descriptors cannot be computed for SIFT keypoints");
+  }
+
+  switch (settings.matcher)
+  {
+    case MatcherType::hamming:
+      if (!binary || settings.descriptor == DescriptorType::akaze)
+      {
+        throw std::invalid_argument("The Hamming matcher needs binary descriptors with a multiple of 8 bytes");
+      }
+      break;
+
+    case MatcherType::lsh:
+      if (!binary)
+      {
+        throw std::invalid_argument("The LSH matcher needs binary descriptors");
+      }
+      break;
+
+    case MatcherType::flann:
+      if (binary)
+      {
+        throw std::invalid_argument("The FLANN kd-tree matcher needs float descriptors");
+      }
+      break;
+
+    case MatcherType::brute_force:
+      break;
+  }
+}
+
+FeatureSettings readFeatureSettings(const std::string& path)
+{
+  cv::FileStorage file(path, cv::FileStorage::READ);
+  if (!file.isOpened())
+  {
+    throw std::runtime_error("Could not read feature settings from " + path);
+  }
+
+  FeatureSettings settings;
+  if (const cv::FileNode node = file["detector"]; !node.empty())
+  { settings.detector = parseDetectorType(node.string()); }
+
+  if (const cv::FileNode node = file["descriptor"]; !node.empty())
+  { settings.descriptor = parseDescriptorType(node.string()); }
+
+  if (const cv::FileNode node = file["matcher"]; !node.empty())
+  { settings.matcher = parseMatcherType(node.string()); }
+
+  if (const cv::FileNode node = file["max_keypoints"]; !node.empty())
+  { settings.max_keypoints = static_cast<int>(node); }
+
+  if (const cv::FileNode node = file["detector_threshold"]; !node.empty())
+  { settings.detector_threshold = static_cast<float>(node); }
+
+  if (const cv::FileNode node = file["max_ratio"]; !node.empty())
+  { settings.max_ratio = static_cast<float>(node); }
+
+  if (const cv::FileNode node = file["min_matches"]; !node.empty())
+  { settings.min_matches = static_cast<size_t>(std::max(static_cast<int>(node), 0)); }
+
+  validateFeatureSettings(settings);
+  return settings;
+}
+
+cv::Ptr<cv::Feature2D> createFeatureDetector(const FeatureSettings& settings, int max_keypoints)
+{
+  switch (settings.detector)
+  {
+    case DetectorType::fast:
+      return cv::FastFeatureDetector::create(static_cast<int>(thresholdOr(settings, 10.f)));
+
+    case DetectorType::agast:
+      return cv::AgastFeatureDetector::create(static_cast<int>(thresholdOr(settings, 10.f)));
+
+    case DetectorType::orb:
+      return cv::ORB::create(max_keypoints, 1.2f, 8, orb_edge_threshold, 0, 2, cv::ORB::HARRIS_SCORE,
+                             orb_edge_threshold, static_cast<int>(thresholdOr(settings, 20.f)));
+
+    case DetectorType::brisk:
+      return cv::BRISK::create(static_cast<int>(thresholdOr(settings, 30.f)));
+
+    case DetectorType::akaze:
+      return cv::AKAZE::create(cv::AKAZE::DESCRIPTOR_MLDB, 0, 3, thresholdOr(settings, 0.001f));
+
+    case DetectorType::sift:
+      return cv::SIFT::create(max_keypoints, 3, thresholdOr(settings, 0.04f));
+  }
+
+  throw std::invalid_argument("Unknown detector");
+}
+
+cv::Ptr<cv::Feature2D> createDescriptorExtractor(const FeatureSettings& settings)
+{
+  switch (settings.descriptor)
+  {
+    case DescriptorType::orb: return cv::ORB::create();
+    case DescriptorType::brisk: return cv::BRISK::create();
+    case DescriptorType::akaze: return cv::AKAZE::create();
+    case DescriptorType::sift: return cv::SIFT::create();
+  }
+
+  throw std::invalid_argument("Unknown descriptor");
+}
+
+int detectorPatchWidth(DetectorType detector)
+{
+  switch (detector)
+  {
+    // The Bresenham circle has a radius of 3 pixels.
+    case DetectorType::fast:
+    case DetectorType::agast:
+      return 7;
+
+    // ORB does not detect keypoints closer to the border than its edge threshold,
+    // so the patch must reach that far on each side of the keypoint.
+    case DetectorType::orb:
+      return 2*orb_edge_threshold + 1;
+
+    // The scale space detectors need a larger border to find keypoints at coarse scales.
+    case DetectorType::brisk:
+    case DetectorType::akaze:
+    case DetectorType::sift:
+      return 48;
+  }
+
+  return 31;
+}
+
+FeatureMatcher::FeatureMatcher(const FeatureSettings& settings)
+    : type_{settings.matcher}
+    , max_ratio_{settings.max_ratio}
+    , hamming_matcher_{settings.max_ratio}
+{
+  switch (type_)
+  {
+    case MatcherType::hamming:
+      break;
+
+    case MatcherType::brute_force:
+      matcher_ = cv::BFMatcher::create(isBinaryDescriptor(settings.descriptor) ? cv::NORM_HAMMING : cv::NORM_L2);
+      break;
+
+    case MatcherType::flann:
+      matcher_ = cv::makePtr<cv::FlannBasedMatcher>();
+      break;
+
+    case MatcherType::lsh:
+      matcher_ = cv::makePtr<cv::FlannBasedMatcher>(cv::makePtr<cv::flann::LshIndexParams>(6, 12, 1));
+      break;
+  }
+}
+
+void FeatureMatcher::match(const cv::Mat& query, const cv::Mat& train, std::vector<cv::DMatch>& matches)
+{
+  if (type_ == MatcherType::hamming)
+  {
+    hamming_matcher_.match(query, train, matches);
+    return;
+  }
+
+  matches.clear();
+  if (query.empty() || train.empty())
+  { return; }
+
+  // Frames are matched against the same keyframe for a while, so only rebuild the index when the keyframe changes.
+  // The train descriptors are kept, so their memory is not reused for other descriptors while they are trained.
+  if (trained_descriptors_.data != train.data || trained_descriptors_.size() != train.size())
+  {
+    matcher_->clear();
+    matcher_->add(std::vector<cv::Mat>{train});
+    matcher_->train();
+    trained_descriptors_ = train;
+  }
+
+  matcher_->knnMatch(query, knn_matches_, 2);
+  matches = extractGoodRatioMatches(knn_matches_, max_ratio_);
+}
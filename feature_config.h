@@ -0,0 +1,146 @@
+#pragma once
+
+#include "hamming_matcher.h"
+
+#include "opencv2/core.hpp"
+#include "opencv2/features2d.hpp"
+
+#include <string>
+#include <vector>
+
+/// \brief Keypoint detectors.
+enum class DetectorType
+{
+  fast,
+  agast,
+  orb,
+  brisk,
+  akaze,
+  sift
+};
+
+/// \brief Descriptor extractors.
+enum class DescriptorType
+{
+  /// \brief 32 byte binary descriptors.
+  orb,
+
+  /// \brief 64 byte binary descriptors.
+  brisk,
+
+  /// \brief 61 byte binary descriptors, which can only be computed for AKAZE keypoints.
+  akaze,
+
+  /// \brief 128 float descriptors.
+  sift
+};
+
+/// \brief Descriptor matchers, which all apply the ratio test.
+enum class MatcherType
+{
+  /// \brief HammingMatcher, for binary descriptors with a multiple of 8 bytes.
+  hamming,
+
+  /// \brief OpenCV brute force kNN matcher, with the Hamming norm for binary descriptors and L2 for float descriptors.
+  brute_force,
+
+  /// \brief FLANN with randomized kd-trees, for float descriptors.
+  flann,
+
+  /// \brief FLANN with locality sensitive hashing, for binary descriptors.
+  lsh
+};
+
+/// \brief Which keypoint detector, descriptor extractor and matcher to use, with their budgets and thresholds.
+struct FeatureSettings
+{
+  DetectorType detector{DetectorType::orb};
+  DescriptorType descriptor{DescriptorType::orb};
+  MatcherType matcher{MatcherType::hamming};
+
+  /// \brief The maximum number of keypoints in each frame. The strongest keypoints are kept.
+  int max_keypoints{1000};
+
+  /// \brief The detector threshold, or zero to use the default of the detector.
+  /// This is the FAST threshold for FAST, AGAST and ORB, the AGAST threshold for BRISK,
+  /// the response threshold for AKAZE, and the contrast threshold for SIFT.
+  float detector_threshold{0.f};
+
+  /// \brief Maximum acceptable ratio between the best and the second best match distance.
+  float max_ratio{0.8f};
+
+  /// \brief The minimum number of matches needed to estimate a homography.
+  size_t min_matches{10};
+};
+
+/// \return The name of a detector, as used in configuration files.
+const char* detectorName(DetectorType detector);
+
+/// \return The name of a descriptor, as used in configuration files.
+const char* descriptorName(DescriptorType descriptor);
+
+/// \return The name of a matcher, as used in configuration files.
+const char* matcherName(MatcherType matcher);
+
+/// \brief Parses a detector name. Throws std::invalid_argument if the name is unknown.
+DetectorType parseDetectorType(const std::string& name);
+
+/// \brief Parses a descriptor name. Throws std::invalid_argument if the name is unknown.
+DescriptorType parseDescriptorType(const std::string& name);
+
+/// \brief Parses a matcher name. Throws std::invalid_argument if the name is unknown.
+MatcherType parseMatcherType(const std::string& name);
+
+/// \return A short description of the settings, such as "orb/orb/hamming/1000".
+std::string describeFeatureSettings(const FeatureSettings& settings);
+
+/// \return True if a descriptor is binary, so that it is compared with the Hamming distance.
+bool isBinaryDescriptor(DescriptorType descriptor);
+
+/// \brief Checks that the detector, descriptor and matcher work together.
+/// Throws std::invalid_argument if they do not, or if a budget or threshold is out of range.
+void validateFeatureSettings(const FeatureSettings& settings);
+
+/// \brief Reads feature settings from a YAML, JSON or XML file.
+///
+/// The file may contain any of the keys "detector", "descriptor", "matcher", "max_keypoints", "detector_threshold",
+/// "max_ratio" and "min_matches". Missing keys keep their default values.
+/// Throws std::runtime_error if the file cannot be read, and std::invalid_argument if the settings are invalid.
+FeatureSettings readFeatureSettings(const std::string& path);
+
+/// \brief Creates a keypoint detector.
+/// \param settings The feature settings.
+/// \param max_keypoints The number of keypoints the detector should aim for, for detectors that take a budget.
+cv::Ptr<cv::Feature2D> createFeatureDetector(const FeatureSettings& settings, int max_keypoints);
+
+/// \brief Creates a descriptor extractor.
+cv::Ptr<cv::Feature2D> createDescriptorExtractor(const FeatureSettings& settings);
+
+/// \return The width of the patch around a keypoint that a detector needs to detect it,
+///         which reaches as far as the detector ignores near the image border on each side of the keypoint.
+int detectorPatchWidth(DetectorType detector);
+
+/// \brief Matches descriptors with the matcher chosen in the feature settings, and keeps the matches that pass the ratio test.
+///
+/// The OpenCV matchers keep the train descriptors and their index between calls,
+/// so that the index is only rebuilt when matching against new train descriptors.
+class FeatureMatcher
+{
+public:
+  /// \brief Constructs the matcher.
+  explicit FeatureMatcher(const FeatureSettings& settings);
+
+  /// \brief Matches query descriptors against train descriptors.
+  /// \param query Query descriptors, one per row.
+  /// \param train Train descriptors, in the same format as the query descriptors.
+  /// \param[out] matches The matches that pass the ratio test, ordered by decreasing quality (increasing ratio).
+  void match(const cv::Mat& query, const cv::Mat& train, std::vector<cv::DMatch>& matches);
+
+private:
+  MatcherType type_;
+  float max_ratio_;
+  HammingMatcher hamming_matcher_;
+  cv::Ptr<cv::DescriptorMatcher> matcher_;
+  cv::Mat trained_descriptors_;
+  std::vector<std::vector<cv::DMatch>> knn_matches_;
+};
@@ -0,0 +1,254 @@
+#include "feature_tuning.h"
+
+#include "feature_utils.h"
+#include "frame_source.h"
+#include "homography_estimator.h"
+#include "mosaic_pipeline.h"
+
+#include "opencv2/imgproc.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+namespace
+{
+/// \brief Keypoints and descriptors for a frame.
+struct FrameFeatures
+{
+  std::vector<cv::KeyPoint> keypoints;
+  cv::Mat descriptors;
+};
+
+/// \brief Measures a single configuration.
+TuningResult measureConfiguration(const std::vector<cv::Mat>& frames, const FeatureSettings& settings, int frame_step)
+{
+  validateFeatureSettings(settings);
+
+  auto detector = createFeatureDetector(settings, settings.max_keypoints);
+  auto desc_extractor = createDescriptorExtractor(settings);
+  FeatureMatcher matcher{settings};
+
+  // Use the same estimator as the pipeline, with a fixed seed so that all configurations are treated alike.
+  HomographyEstimator estimator{0.99f, 3.f, 10000, 1, 5030u, std::make_unique<ProsacSampler>(), true, true};
+
+  TuningResult result;
+  result.settings = settings;
+
+  // Keep the features of the last frame_step frames.
+  std::vector<FrameFeatures> features(static_cast<size_t>(frame_step) + 1);
+  std::vector<cv::DMatch> matches;
+  Eigen::Matrix2Xf pts1;
+  Eigen::Matrix2Xf pts2;
+  size_t num_pairs = 0;
+  size_t num_registered = 0;
+  double total_inliers = 0.;
+
+  for (size_t i = 0; i < frames.size(); ++i)
+  {
+    FrameFeatures& current = features[i % features.size()];
+
+    auto start = Clock::now();
+    detector->detect(frames[i], current.keypoints);
+    cv::KeyPointsFilter::retainBest(current.keypoints, settings.max_keypoints);
+    auto end = Clock::now();
+    result.detection_ms += DurationInMs(end - start).count();
+
+    start = end;
+    desc_extractor->compute(frames[i], current.keypoints, current.descriptors);
+    end = Clock::now();
+    result.description_ms += DurationInMs(end - start).count();
+    result.keypoints += static_cast<double>(current.keypoints.size());
+
+    if (i < static_cast<size_t>(frame_step))
+    { continue; }
+
+    // Register the frame against the frame frame_step frames earlier.
+    const FrameFeatures& previous = features[(i - frame_step) % features.size()];
+    ++num_pairs;
+
+    start = end;
+    matcher.match(current.descriptors, previous.descriptors, matches);
+    end = Clock::now();
+    result.matching_ms += DurationInMs(end - start).count();
+
+    if (matches.size() < settings.min_matches)
+    { continue; }
+
+    start = end;
+    extractMatchingPoints(current.keypoints, previous.keypoints, matches, pts1, pts2);
+    const HomographyEstimate estimate = estimator.estimate(pts1, pts2);
+    end = Clock::now();
+    result.estimation_ms += DurationInMs(end - start).count();
+
+    total_inliers += static_cast<double>(estimate.num_inliers);
+    if (estimate.num_inliers >= settings.min_matches)
+    { ++num_registered; }
+  }
+
+  // Average the latencies over all frames, and the inliers over the frame pairs.
+  const double num_frames = static_cast<double>(std::max<size_t>(frames.size(), 1));
+  result.keypoints /= num_frames;
+  result.detection_ms /= num_frames;
+  result.description_ms /= num_frames;
+  result.matching_ms /= num_frames;
+  result.estimation_ms /= num_frames;
+  result.inliers = num_pairs > 0 ? total_inliers / static_cast<double>(num_pairs) : 0.;
+  result.success_rate = num_pairs > 0 ? static_cast<double>(num_registered) / static_cast<double>(num_pairs) : 0.;
+  return result;
+}
+
+/// \brief Prints the results as a table.
+void printResults(std::ostream& stream, const std::vector<TuningResult>& results)
+{
+  stream << std::left << std::setw(28) << "Configuration" << std::right
+         << std::setw(10) << "Keypoints" << std::setw(10) << "Detect" << std::setw(10) << "Describe"
+         << std::setw(10) << "Match" << std::setw(10) << "Estimate" << std::setw(10) << "Total"
+         << std::setw(10) << "Inliers" << std::setw(10) << "Success" << "\n";
+
+  stream << std::fixed;
+  for (const auto& result : results)
+  {
+    stream << std::left << std::setw(28) << describeFeatureSettings(result.settings) << std::right
+           << std::setprecision(0) << std::setw(10) << result.keypoints << std::setprecision(2)
+           << std::setw(8) << result.detection_ms << "ms"
+           << std::setw(8) << result.description_ms << "ms"
+           << std::setw(8) << result.matching_ms << "ms"
+           << std::setw(8) << result.estimation_ms << "ms"
+           << std::setw(8) << result.totalMs() << "ms"
+           << std::setprecision(1) << std::setw(10) << result.inliers
+           << std::setw(9) << 100. * result.success_rate << "%"
+           << (result.pareto_optimal ? " *" : "") << "\n";
+  }
+  stream << std::defaultfloat;
+}
+
+/// \brief Writes the results as CSV.
+void writeResultsCsv(std::ostream& stream, const std::vector<TuningResult>& results)
+{
+  stream << "detector,descriptor,matcher,max_keypoints,keypoints,detection_ms,description_ms,matching_ms,"
+            "estimation_ms,total_ms,inliers,success_rate,pareto_optimal\n";
+
+  for (const auto& result : results)
+  {
+    const FeatureSettings& settings = result.settings;
+    stream << detectorName(settings.detector) << "," << descriptorName(settings.descriptor) << ","
+           << matcherName(settings.matcher) << "," << settings.max_keypoints << ","
+           << result.keypoints << "," << result.detection_ms << "," << result.description_ms << ","
+           << result.matching_ms << "," << result.estimation_ms << "," << result.totalMs() << ","
+           << result.inliers << "," << result.success_rate << "," << (result.pareto_optimal ? 1 : 0) << "\n";
+  }
+}
+}
+
+double TuningResult::totalMs() const
+{
+  return detection_ms + description_ms + matching_ms + estimation_ms;
+}
+
+std::vector<FeatureSettings> tuningCandidates()
+{
+  struct Combination
+  {
+    DetectorType detector;
+    DescriptorType descriptor;
+    MatcherType matcher;
+  };
+
+  const Combination combinations[] = {
+      {DetectorType::orb, DescriptorType::orb, MatcherType::hamming},
+      {DetectorType::orb, DescriptorType::orb, MatcherType::lsh},
+      {DetectorType::orb, DescriptorType::orb, MatcherType::brute_force},
+      {DetectorType::fast, DescriptorType::orb, MatcherType::hamming},
+      {DetectorType::agast, DescriptorType::orb, MatcherType::hamming},
+      {DetectorType::fast, DescriptorType::brisk, MatcherType::hamming},
+      {DetectorType::brisk, DescriptorType::brisk, MatcherType::hamming},
+      {DetectorType::akaze, DescriptorType::akaze, MatcherType::brute_force},
+      {DetectorType::akaze, DescriptorType::akaze, MatcherType::lsh},
+      {DetectorType::sift, DescriptorType::sift, MatcherType::flann},
+      {DetectorType::sift, DescriptorType::sift, MatcherType::brute_force}};
+
+  std::vector<FeatureSettings> candidates;
+  for (const int max_keypoints : {500, 1000})
+  {
+    for (const auto& combination : combinations)
+    {
+      FeatureSettings settings;
+      settings.detector = combination.detector;
+      settings.descriptor = combination.descriptor;
+      settings.matcher = combination.matcher;
+      settings.max_keypoints = max_keypoints;
+      candidates.push_back(settings);
+    }
+  }
+
+  return candidates;
+}
+
+std::vector<TuningResult> tuneFeatures(const std::vector<cv::Mat>& frames, const std::vector<FeatureSettings>& candidates,
+                                       int frame_step)
+{
+  if (frame_step <= 0)
+  {
+    throw std::invalid_argument("The frame step must be positive");
+  }
+
+  std::vector<TuningResult> results;
+  for (const auto& settings : candidates)
+  {
+    results.push_back(measureConfiguration(frames, settings, frame_step));
+  }
+
+  // Mark the configurations that are not beaten on both latency and inliers by any other.
+  for (auto& result : results)
+  {
+    result.pareto_optimal = std::none_of(results.begin(), results.end(), [&result](const TuningResult& other)
+    {
+      return other.totalMs() <= result.totalMs() && other.inliers >= result.inliers &&
+             (other.totalMs() < result.totalMs() || other.inliers > result.inliers);
+    });
+  }
+
+  return results;
+}
+
+void runFeatureTuning(const std::string& input, const std::string& output_csv, int max_frames)
+{
+  // Read the clip into memory.
+  MosaicPipeline::FrameSource source = openFrameSource(input);
+  std::vector<cv::Mat> frames;
+  cv::Mat frame;
+  while (static_cast<int>(frames.size()) < max_frames && source(frame))
+  {
+    cv::Mat gray_frame;
+    cv::cvtColor(frame, gray_frame, cv::COLOR_BGR2GRAY);
+    frames.push_back(gray_frame);
+  }
+
+  if (frames.empty())
+  {
+    throw std::runtime_error("No frames in " + input);
+  }
+
+  const auto candidates = tuningCandidates();
+  std::cout << "Measuring " << candidates.size() << " configurations over " << frames.size() << " frames" << std::endl;
+
+  std::vector<TuningResult> results = tuneFeatures(frames, candidates);
+  std::sort(results.begin(), results.end(),
+            [](const TuningResult& a, const TuningResult& b) { return a.totalMs() < b.totalMs(); });
+
+  printResults(std::cout, results);
+  std::cout << "Configurations marked with * are Pareto optimal in latency and inliers." << std::endl;
+
+  if (!output_csv.empty())
+  {
+    std::ofstream file{output_csv};
+    if (!file)
+    {
+      throw std::runtime_error("Could not write to " + output_csv);
+    }
+    writeResultsCsv(file, results);
+  }
+}
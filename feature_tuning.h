@@ -0,0 +1,55 @@
+#pragma once
+
+#include "feature_config.h"
+
+#include <string>
+#include <vector>
+
+/// \brief Latency and registration quality for a feature configuration over a clip.
+struct TuningResult
+{
+  FeatureSettings settings;
+
+  /// \brief Mean number of keypoints per frame.
+  double keypoints{0.};
+
+  /// \brief Mean latencies per frame in milliseconds.
+  double detection_ms{0.};
+  double description_ms{0.};
+  double matching_ms{0.};
+  double estimation_ms{0.};
+
+  /// \brief Mean number of inliers per registered frame pair.
+  double inliers{0.};
+
+  /// \brief Fraction of the frame pairs with at least the minimum number of matches and inliers.
+  double success_rate{0.};
+
+  /// \brief True if no other configuration is both at least as fast and has at least as many inliers.
+  bool pareto_optimal{false};
+
+  /// \return The total latency per frame in milliseconds.
+  double totalMs() const;
+};
+
+/// \return The configurations tried by runFeatureTuning(), which are all valid combinations of the common
+///         detectors, descriptors and matchers with two keypoint budgets.
+std::vector<FeatureSettings> tuningCandidates();
+
+/// \brief Runs each configuration over a clip, and measures latency and the number of inliers.
+///
+/// Each frame is registered against the frame frame_step frames earlier,
+/// which gives a larger baseline than consecutive frames, like a frame matched against its keyframe.
+/// The frames are read into memory first, so that reading the clip is not part of the measurements.
+/// \param frames The gray scale frames of the clip.
+/// \param candidates The configurations to try.
+/// \param frame_step The distance between the frames in each pair.
+/// \return The results in the order of the candidates, with the Pareto optimal configurations marked.
+std::vector<TuningResult> tuneFeatures(const std::vector<cv::Mat>& frames, const std::vector<FeatureSettings>& candidates,
+                                       int frame_step = 5);
+
+/// \brief Runs all tuning candidates over a recorded clip, prints a table sorted by latency, and writes it as CSV.
+/// \param input Path to a video file, or to a directory of images.
+/// \param output_csv Path to the CSV file, or empty to only print the table.
+/// \param max_frames The maximum number of frames to read from the clip.
+void runFeatureTuning(const std::string& input, const std::string& output_csv, int max_frames = 200);
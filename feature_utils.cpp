@@ -1,9 +1,53 @@
 #include "feature_utils.h"
 
+#include "opencv2/core/utility.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace
+{
+/// \brief The arguments to the grid detection workers, which the job captures by reference.
+struct GridJob
+{
+  const cv::Mat& image;
+  int num_cells;
+  int num_workers;
+  cv::Size cell_size;
+};
+}
+
 std::vector<cv::DMatch> extractGoodRatioMatches(const std::vector<std::vector<cv::DMatch>>& matches, float max_ratio)
 {
-  // Todo 2: Implement the ratio test.
+  // Keep the ratio for each good match, so that we can order them by quality.
+  std::vector<std::pair<float, cv::DMatch>> ratio_matches;
+  ratio_matches.reserve(matches.size());
+
+  for (const auto& match : matches)
+  {
+    if (match.size() < 2)
+    { continue; }
+
+    const float ratio = match[0].distance / match[1].distance;
+    if (ratio < max_ratio)
+    {
+      ratio_matches.emplace_back(ratio, match[0]);
+    }
+  }
+
+  // Order the matches by increasing ratio, and then by increasing distance.
+  std::sort(ratio_matches.begin(), ratio_matches.end(),
+            [](const auto& a, const auto& b)
+            {
+              return a.first < b.first || (a.first == b.first && a.second.distance < b.second.distance);
+            });
+
   std::vector<cv::DMatch> good_ratio_matches;
+  good_ratio_matches.reserve(ratio_matches.size());
+  for (const auto& ratio_match : ratio_matches)
+  {
+    good_ratio_matches.push_back(ratio_match.second);
+  }
 
   return good_ratio_matches;
 }
@@ -14,6 +58,20 @@ void extractMatchingPoints(const std::vector<cv::KeyPoint>& keypts1, const std::
 {
   matched_pts1.resize(Eigen::NoChange, matches.size());
   matched_pts2.resize(Eigen::NoChange, matches.size());
+  extractMatchingPoints(keypts1, keypts2, matches, Eigen::Ref<Eigen::Matrix2Xf>{matched_pts1},
+                        Eigen::Ref<Eigen::Matrix2Xf>{matched_pts2});
+}
+
+void extractMatchingPoints(const std::vector<cv::KeyPoint>& keypts1, const std::vector<cv::KeyPoint>& keypts2,
+                           const std::vector<cv::DMatch>& matches, Eigen::Ref<Eigen::Matrix2Xf> matched_pts1,
+                           Eigen::Ref<Eigen::Matrix2Xf> matched_pts2)
+{
+  if (matched_pts1.cols() != static_cast<Eigen::Index>(matches.size()) ||
+      matched_pts2.cols() != static_cast<Eigen::Index>(matches.size()))
+  {
+    throw std::invalid_argument("Point matrices must have one column for each match");
+  }
+
   for (size_t i = 0; i < matches.size(); ++i)
   {
     matched_pts1.col(i) = Eigen::Vector2f{keypts1[matches[i].queryIdx].pt.x, keypts1[matches[i].queryIdx].pt.y};
@@ -21,38 +79,112 @@ void extractMatchingPoints(const std::vector<cv::KeyPoint>& keypts1, const std::
   }
 }
 
-std::vector<cv::KeyPoint> detectInGrid(const cv::Mat& image, cv::Ptr<cv::Feature2D> detector, cv::Size grid_size, int max_in_cell, int patch_width)
+GridDetector::GridDetector(DetectorFactory create_detector, cv::Size grid_size, int max_in_cell, int patch_width)
+    : create_detector_{std::move(create_detector)}
+    , grid_size_{grid_size}
+    , max_in_cell_{max_in_cell}
+    , patch_width_{patch_width}
+{
+  if (grid_size.width < 1 || grid_size.height < 1)
+  {
+    throw std::invalid_argument("Grid must have at least one cell");
+  }
+}
+
+cv::Ptr<GridDetector> GridDetector::create(DetectorFactory create_detector, cv::Size grid_size, int max_in_cell,
+                                           int patch_width)
 {
-  std::vector<cv::KeyPoint> all_keypoints;
+  return cv::makePtr<GridDetector>(std::move(create_detector), grid_size, max_in_cell, patch_width);
+}
 
-  const int height = image.rows / grid_size.height;
-  const int width = image.cols / grid_size.width;
+void GridDetector::detect(cv::InputArray image, std::vector<cv::KeyPoint>& keypoints, cv::InputArray mask)
+{
+  keypoints.clear();
+  const cv::Mat img = image.getMat();
+  if (img.empty())
+  { return; }
 
-  const int patch_rad = patch_width / 2;
+  // Create a detector for each worker the first time, and reuse them for later images.
+  const int num_cells = grid_size_.area();
+  const int num_workers = std::max(1, std::min(cv::getNumThreads(), num_cells));
+  while (detectors_.size() < static_cast<size_t>(num_workers))
+  {
+    detectors_.push_back(create_detector_());
+  }
+  cell_keypoints_.resize(static_cast<size_t>(num_cells));
 
-  for (int x=0; x<grid_size.width; ++x)
+  // Each worker has its own detector, and processes every num_workers-th cell.
+  // The job only captures two pointers, so that std::function can store it without allocating memory.
+  const GridJob job{img, num_cells, num_workers, {img.cols / grid_size_.width, img.rows / grid_size_.height}};
+  cv::parallel_for_(cv::Range(0, num_workers), [this, &job](const cv::Range& workers)
   {
-    for (int y=0; y<grid_size.height; ++y)
+    const int width = job.cell_size.width;
+    const int height = job.cell_size.height;
+    const int patch_rad = patch_width_ / 2;
+    const cv::Rect image_rect{0, 0, job.image.cols, job.image.rows};
+
+    for (int worker = workers.start; worker < workers.end; ++worker)
     {
-      cv::Range row_range(std::max(y*height - patch_rad, 0), std::min((y+1)*height + patch_rad, image.rows));
-      cv::Range col_range(std::max(x*width - patch_rad, 0), std::min((x+1)*width + patch_rad, image.cols));
+      cv::Feature2D& detector = *detectors_[worker];
 
-      cv::Mat sub_img = image(row_range, col_range);
-      
-      std::vector<cv::KeyPoint> grid_keypoints;
-      detector->detect(sub_img, grid_keypoints);
+      for (int cell = worker; cell < job.num_cells; cell += job.num_workers)
+      {
+        // The last column and row of cells also cover the remainder of the image.
+        const int x = cell % grid_size_.width;
+        const int y = cell / grid_size_.width;
+        const int col_end = x + 1 == grid_size_.width ? job.image.cols : (x + 1)*width;
+        const int row_end = y + 1 == grid_size_.height ? job.image.rows : (y + 1)*height;
+        const cv::Rect cell_rect{x*width, y*height, col_end - x*width, row_end - y*height};
+        const cv::Rect patch_rect = (cell_rect - cv::Point{patch_rad, patch_rad} + cv::Size{patch_width_, patch_width_}) & image_rect;
 
-      cv::KeyPointsFilter::retainBest(grid_keypoints, max_in_cell);
+        auto& cell_keypoints = cell_keypoints_[cell];
+        detector.detect(job.image(patch_rect), cell_keypoints);
 
-      for (auto& keypoint : grid_keypoints)
-      {
-        keypoint.pt.x += col_range.start;
-        keypoint.pt.y += row_range.start;
-      }
+        // Only keep the keypoints inside the cell, so that neighbouring cells do not return the same keypoints.
+        const cv::Rect2f cell_area{cell_rect};
+        for (auto& keypoint : cell_keypoints)
+        {
+          keypoint.pt.x += static_cast<float>(patch_rect.x);
+          keypoint.pt.y += static_cast<float>(patch_rect.y);
+        }
+        cell_keypoints.erase(std::remove_if(cell_keypoints.begin(), cell_keypoints.end(),
+                                            [&cell_area](const cv::KeyPoint& keypoint)
+                                            { return !cell_area.contains(keypoint.pt); }),
+                             cell_keypoints.end());
 
-      all_keypoints.insert(all_keypoints.end(), grid_keypoints.begin(), grid_keypoints.end());
+        cv::KeyPointsFilter::retainBest(cell_keypoints, max_in_cell_);
+      }
     }
+  }, num_workers);
+
+  // Merge the cells in order.
+  size_t num_keypoints = 0;
+  for (const auto& cell_keypoints : cell_keypoints_)
+  {
+    num_keypoints += cell_keypoints.size();
+  }
+
+  keypoints.reserve(num_keypoints);
+  for (const auto& cell_keypoints : cell_keypoints_)
+  {
+    keypoints.insert(keypoints.end(), cell_keypoints.begin(), cell_keypoints.end());
+  }
+
+  if (!mask.empty())
+  {
+    cv::KeyPointsFilter::runByPixelsMask(keypoints, mask.getMat());
   }
+}
+
+cv::String GridDetector::getDefaultName() const
+{
+  return "Feature2D.GridDetector";
+}
 
-  return all_keypoints;
+std::vector<cv::KeyPoint> detectInGrid(const cv::Mat& image, const GridDetector::DetectorFactory& create_detector,
+                                       cv::Size grid_size, int max_in_cell, int patch_width)
+{
+  std::vector<cv::KeyPoint> keypoints;
+  GridDetector(create_detector, grid_size, max_in_cell, patch_width).detect(image, keypoints);
+  return keypoints;
 }
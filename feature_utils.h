@@ -4,16 +4,19 @@
 #include "opencv2/features2d.hpp"
 #include "Eigen/Dense"
 
+#include <functional>
+
 /// \brief Extracts a set of good matches according to the ratio test.
 /// \param matches Input set of matches, the best and the second best match for each putative correspondence.
 /// \param max_ratio Maximum acceptable ratio between the best and the next best match.
-/// \return The set of matches that pass the ratio test.
+/// \return The set of matches that pass the ratio test, ordered by decreasing quality (increasing ratio).
 std::vector<cv::DMatch> extractGoodRatioMatches(const std::vector<std::vector<cv::DMatch>>& matches, float max_ratio);
 
 /// \brief Extracts the point correspondences from matches as columns in Eigen matrices.
 /// \param[in] keypts1 Keypoints from first (query) image.
 /// \param[in] keypts2 Keypoints from second (train) image.
 /// \param[in] matches Point correspondence matches between the two images.
+///                    The order of the matches is preserved in the point matrices.
 /// \param[out] matched_pts1 Points from first image as columns in an Eigen matrix.
 /// \param[out] matched_pts2 Points from second image as columns in an Eigen matrix.
 void extractMatchingPoints(
@@ -23,11 +26,65 @@ void extractMatchingPoints(
     Eigen::Matrix2Xf& matched_pts1,
     Eigen::Matrix2Xf& matched_pts2);
 
+/// \brief Extracts the point correspondences from matches into the first columns of existing matrices.
+/// This does not allocate memory, so that the matrices can be reused as buffers between frames.
+/// \param[out] matched_pts1 Points from first image, with exactly one column for each match.
+/// \param[out] matched_pts2 Points from second image, with exactly one column for each match.
+void extractMatchingPoints(
+    const std::vector<cv::KeyPoint>& keypts1,
+    const std::vector<cv::KeyPoint>& keypts2,
+    const std::vector<cv::DMatch>& matches,
+    Eigen::Ref<Eigen::Matrix2Xf> matched_pts1,
+    Eigen::Ref<Eigen::Matrix2Xf> matched_pts2);
+
+/// \brief Detects keypoints in independent cells on a grid, in parallel over the cells.
+///
+/// Detectors are not thread-safe, so each worker has its own detector.
+/// The keypoints for each cell are kept in buffers that are reused for the next image.
+class GridDetector : public cv::Feature2D
+{
+public:
+  /// \brief Creates the detector for a worker.
+  using DetectorFactory = std::function<cv::Ptr<cv::Feature2D>()>;
+
+  /// \brief Constructs the grid detector.
+  /// \param create_detector Creates the detector for each worker.
+  /// \param grid_size Size of the grid.
+  /// \param max_in_cell Maximum number of detections in each cell.
+  /// \param patch_width Width of patch used for detection or description.
+  ///                    Each cell is extended by half the patch width, so that keypoints near the cell border are found.
+  GridDetector(DetectorFactory create_detector, cv::Size grid_size, int max_in_cell, int patch_width);
+
+  /// \brief Creates a grid detector.
+  static cv::Ptr<GridDetector> create(DetectorFactory create_detector, cv::Size grid_size, int max_in_cell,
+                                      int patch_width);
+
+  using cv::Feature2D::detect;
+
+  /// \brief Detects keypoints in all cells.
+  /// \param image The image to detect keypoints in.
+  /// \param[out] keypoints The collection of detected keypoints in all cells, ordered by cell.
+  /// \param mask Optional mask for the keypoints.
+  void detect(cv::InputArray image, std::vector<cv::KeyPoint>& keypoints, cv::InputArray mask = cv::noArray()) override;
+
+  cv::String getDefaultName() const override;
+
+private:
+  DetectorFactory create_detector_;
+  cv::Size grid_size_;
+  int max_in_cell_;
+  int patch_width_;
+
+  std::vector<cv::Ptr<cv::Feature2D>> detectors_;
+  std::vector<std::vector<cv::KeyPoint>> cell_keypoints_;
+};
+
 /// \brief Detects keypoints in independent cells on a grid.
 /// \param image The image to detect keypoints in.
-/// \param detector The keypoint detector to use.
+/// \param create_detector Creates the keypoint detector for each worker.
 /// \param grid_size Size of the grid.
 /// \param max_in_cell Maximum number of detections in each cell.
 /// \param patch_width Width of patch used for detection or description.
 /// \return The collection of detected keypoints in all cells.
-std::vector<cv::KeyPoint> detectInGrid(const cv::Mat& image, cv::Ptr<cv::Feature2D> detector, cv::Size grid_size, int max_in_cell, int patch_width);
+std::vector<cv::KeyPoint> detectInGrid(const cv::Mat& image, const GridDetector::DetectorFactory& create_detector,
+                                       cv::Size grid_size, int max_in_cell, int patch_width);
@@ -0,0 +1,96 @@
+#include "frame_source.h"
+
+#include "recording.h"
+
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/videoio.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+/// \brief Lists the image files in a directory in alphabetical order.
+std::vector<fs::path> listImages(const fs::path& dir)
+{
+  const std::vector<std::string> image_extensions{".png", ".jpg", ".jpeg", ".tif", ".tiff", ".bmp", ".ppm", ".pgm"};
+
+  std::vector<fs::path> images;
+  for (const auto& entry : fs::directory_iterator(dir))
+  {
+    std::string extension = entry.path().extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+    if (entry.is_regular_file() &&
+        std::find(image_extensions.begin(), image_extensions.end(), extension) != image_extensions.end())
+    {
+      images.push_back(entry.path());
+    }
+  }
+
+  std::sort(images.begin(), images.end());
+  return images;
+}
+}
+
+MosaicPipeline::FrameSource openFrameSource(const std::string& input)
+{
+  if (isRecordingPath(input))
+  {
+    // The frames refer to the memory map of the recording, which is kept open by the source.
+    auto recording = std::make_shared<RecordingReader>(input);
+    if (recording->numFrames() == 0 || recording->frame(0).image.empty())
+    {
+      throw std::runtime_error("The recording " + input + " has no frames");
+    }
+
+    return [recording, next = size_t{0}](cv::Mat& frame) mutable
+    {
+      while (next < recording->numFrames())
+      {
+        frame = recording->frame(next++).image;
+        if (!frame.empty())
+        { return true; }
+      }
+      return false;
+    };
+  }
+
+  if (fs::is_directory(input))
+  {
+    auto images = std::make_shared<std::vector<fs::path>>(listImages(input));
+    if (images->empty())
+    {
+      throw std::runtime_error("No images found in " + input);
+    }
+
+    return [images, next = size_t{0}](cv::Mat& frame) mutable
+    {
+      while (next < images->size())
+      {
+        const fs::path& path = images->at(next++);
+        frame = cv::imread(path.string(), cv::IMREAD_COLOR);
+        if (!frame.empty())
+        { return true; }
+
+        std::cerr << "Skipping unreadable image " << path.string() << std::endl;
+      }
+      return false;
+    };
+  }
+
+  auto cap = std::make_shared<cv::VideoCapture>();
+  if (!cap->open(input))
+  {
+    throw std::runtime_error("Could not open video " + input);
+  }
+
+  return [cap](cv::Mat& frame) { return cap->read(frame); };
+}
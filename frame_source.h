@@ -0,0 +1,12 @@
+#pragma once
+
+#include "mosaic_pipeline.h"
+
+#include <string>
+
+/// \brief Opens a video file, a directory of images or a recording as a frame source.
+/// \param input Path to a video file, to a directory of images which are read in alphabetical order,
+///              or to a recording with frames. Unreadable images are skipped.
+///              The frames from a recording are read-only views of the recording, which stays open with the source.
+/// \return The frame source. Throws std::runtime_error if the input cannot be opened.
+MosaicPipeline::FrameSource openFrameSource(const std::string& input);
@@ -0,0 +1,237 @@
+#include "hamming_matcher.h"
+
+#include "opencv2/core/utility.hpp"
+
+#include <algorithm>
+#include <bitset>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+// Use AVX2 when the compiler targets it, for example with the LAB_MOSAIC_NATIVE_ARCH build option.
+#if defined(__AVX2__) && (defined(__x86_64__) || defined(_M_X64))
+#define LAB_MOSAIC_HAMMING_AVX2
+#include <immintrin.h>
+#endif
+
+namespace
+{
+constexpr int no_distance = std::numeric_limits<int>::max();
+
+/// \brief Number of query rows per stripe, so that small sets are not split over many threads.
+constexpr int min_rows_per_stripe = 64;
+
+/// \brief The arguments to the matching stripes, which the job captures by reference.
+struct StripeJob
+{
+  const cv::Mat& query;
+  const cv::Mat& train;
+  int num_stripes;
+};
+
+int popcount64(std::uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(x);
+#else
+  return static_cast<int>(std::bitset<64>(x).count());
+#endif
+}
+
+/// \brief Computes the Hamming distance between two descriptors with num_words 64-bit words.
+int hammingDistance(const uchar* a, const uchar* b, int num_words)
+{
+  int distance = 0;
+  for (int i = 0; i < num_words; ++i)
+  {
+    std::uint64_t word_a;
+    std::uint64_t word_b;
+    std::memcpy(&word_a, a + 8*i, 8);
+    std::memcpy(&word_b, b + 8*i, 8);
+    distance += popcount64(word_a ^ word_b);
+  }
+
+  return distance;
+}
+
+/// \brief Keeps the best and second best distance.
+inline void updateNearest(int distance, int train_idx, int& best_distance, int& second_distance, int& best_idx)
+{
+  if (distance < best_distance)
+  {
+    second_distance = best_distance;
+    best_distance = distance;
+    best_idx = train_idx;
+  }
+  else if (distance < second_distance)
+  {
+    second_distance = distance;
+  }
+}
+
+#ifdef LAB_MOSAIC_HAMMING_AVX2
+/// \brief Counts the bits in each byte, with a lookup table for each nibble.
+inline __m256i popcountBytes(__m256i x)
+{
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  const __m256i low = _mm256_and_si256(x, low_mask);
+  const __m256i high = _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask);
+  return _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low), _mm256_shuffle_epi8(lookup, high));
+}
+
+/// \brief Computes the distances from a 32 byte query descriptor to four train descriptors.
+inline void hammingDistances32x4(__m256i query, const uchar* train0, const uchar* train1, const uchar* train2,
+                                 const uchar* train3, int distances[4])
+{
+  // Sum the bit counts in each 64-bit lane. Each lane sum is at most 64, so it fits in 16 bits.
+  const __m256i zero = _mm256_setzero_si256();
+  const auto laneSums = [&](const uchar* train)
+  {
+    const __m256i x = _mm256_xor_si256(query, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(train)));
+    return _mm256_sad_epu8(popcountBytes(x), zero);
+  };
+
+  // Pack the four lane sums into separate 16-bit fields, and add the lanes.
+  const __m256i packed = _mm256_or_si256(
+      _mm256_or_si256(laneSums(train0), _mm256_slli_epi64(laneSums(train1), 16)),
+      _mm256_or_si256(_mm256_slli_epi64(laneSums(train2), 32), _mm256_slli_epi64(laneSums(train3), 48)));
+  const __m128i half_sums = _mm_add_epi64(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1));
+  const auto sums = static_cast<std::uint64_t>(_mm_cvtsi128_si64(half_sums) + _mm_extract_epi64(half_sums, 1));
+
+  distances[0] = static_cast<int>(sums & 0xffff);
+  distances[1] = static_cast<int>((sums >> 16) & 0xffff);
+  distances[2] = static_cast<int>((sums >> 32) & 0xffff);
+  distances[3] = static_cast<int>((sums >> 48) & 0xffff);
+}
+#endif
+}
+
+HammingMatcher::HammingMatcher(float max_ratio, bool cross_check)
+    : max_ratio_{max_ratio}
+    , cross_check_{cross_check}
+{ }
+
+void HammingMatcher::match(const cv::Mat& query, const cv::Mat& train, std::vector<cv::DMatch>& matches)
+{
+  matches.clear();
+  if (query.empty() || train.empty())
+  { return; }
+
+  if (query.type() != CV_8UC1 || train.type() != CV_8UC1 || query.cols != train.cols || query.cols % 8 != 0)
+  {
+    throw std::invalid_argument("Descriptors must be CV_8U rows of equal length, with a multiple of 8 bytes");
+  }
+
+  // Match the query rows in stripes, where each stripe keeps its own nearest query for each train descriptor.
+  const int num_stripes = std::max(1, std::min(cv::getNumThreads(), query.rows / min_rows_per_stripe));
+  query_results_.resize(static_cast<size_t>(query.rows));
+  stripe_train_results_.resize(static_cast<size_t>(num_stripes));
+
+  // The job only captures two pointers, so that std::function can store it without allocating memory.
+  const StripeJob job{query, train, num_stripes};
+  cv::parallel_for_(cv::Range(0, num_stripes), [this, &job](const cv::Range& stripes)
+  {
+    for (int stripe = stripes.start; stripe < stripes.end; ++stripe)
+    {
+      auto& train_results = stripe_train_results_[stripe];
+      train_results.assign(static_cast<size_t>(job.train.rows), TrainResult{-1, no_distance});
+      matchRows(job.query, job.train, stripe * job.query.rows / job.num_stripes,
+                (stripe + 1) * job.query.rows / job.num_stripes, train_results);
+    }
+  }, num_stripes);
+
+  // Combine the stripes, preferring the lowest query index for equal distances.
+  auto& train_results = stripe_train_results_[0];
+  for (int stripe = 1; stripe < num_stripes; ++stripe)
+  {
+    const auto& stripe_results = stripe_train_results_[stripe];
+    for (size_t i = 0; i < train_results.size(); ++i)
+    {
+      if (stripe_results[i].distance < train_results[i].distance)
+      {
+        train_results[i] = stripe_results[i];
+      }
+    }
+  }
+
+  // Collect the matches that passed the ratio test in the workers, and the cross check.
+  matches.reserve(static_cast<size_t>(query.rows));
+  for (int query_idx = 0; query_idx < query.rows; ++query_idx)
+  {
+    const QueryResult& result = query_results_[query_idx];
+    if (result.train_idx >= 0 && (!cross_check_ || train_results[result.train_idx].query_idx == query_idx))
+    {
+      matches.emplace_back(query_idx, result.train_idx, static_cast<float>(result.best_distance));
+    }
+  }
+
+  // Order the matches by increasing ratio, and then by increasing distance.
+  // Compare best_a/second_a < best_b/second_b exactly with integers.
+  std::sort(matches.begin(), matches.end(),
+            [this](const cv::DMatch& a, const cv::DMatch& b)
+            {
+              const QueryResult& result_a = query_results_[a.queryIdx];
+              const QueryResult& result_b = query_results_[b.queryIdx];
+              const auto lhs = static_cast<std::int64_t>(result_a.best_distance) * result_b.second_distance;
+              const auto rhs = static_cast<std::int64_t>(result_b.best_distance) * result_a.second_distance;
+              if (lhs != rhs)
+              { return lhs < rhs; }
+              if (result_a.best_distance != result_b.best_distance)
+              { return result_a.best_distance < result_b.best_distance; }
+              return a.queryIdx < b.queryIdx;
+            });
+}
+
+void HammingMatcher::matchRows(const cv::Mat& query, const cv::Mat& train, int begin, int end,
+                               std::vector<TrainResult>& train_results)
+{
+  const int num_words = query.cols / 8;
+
+  for (int query_idx = begin; query_idx < end; ++query_idx)
+  {
+    const uchar* query_row = query.ptr<uchar>(query_idx);
+    int best_distance = no_distance;
+    int second_distance = no_distance;
+    int best_idx = -1;
+
+    const auto update = [&](int distance, int train_idx)
+    {
+      updateNearest(distance, train_idx, best_distance, second_distance, best_idx);
+
+      if (cross_check_ && distance < train_results[train_idx].distance)
+      {
+        train_results[train_idx] = {query_idx, distance};
+      }
+    };
+
+    int train_idx = 0;
+#ifdef LAB_MOSAIC_HAMMING_AVX2
+    if (num_words == 4)
+    {
+      // ORB descriptors fit in one AVX2 register, so compute four distances at a time.
+      const __m256i query_vector = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(query_row));
+      int distances[4];
+      for (; train_idx + 4 <= train.rows; train_idx += 4)
+      {
+        hammingDistances32x4(query_vector, train.ptr<uchar>(train_idx), train.ptr<uchar>(train_idx + 1),
+                             train.ptr<uchar>(train_idx + 2), train.ptr<uchar>(train_idx + 3), distances);
+        for (int i = 0; i < 4; ++i)
+        {
+          update(distances[i], train_idx + i);
+        }
+      }
+    }
+#endif
+    for (; train_idx < train.rows; ++train_idx)
+    {
+      update(hammingDistance(query_row, train.ptr<uchar>(train_idx), num_words), train_idx);
+    }
+
+    // Apply the ratio test. There is no second best distance with a single train descriptor.
+    const bool is_good = second_distance != no_distance &&
+                         static_cast<float>(best_distance) < max_ratio_ * static_cast<float>(second_distance);
+    query_results_[query_idx] = {is_good ? best_idx : -1, best_distance, second_distance};
+  }
+}
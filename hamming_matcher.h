@@ -0,0 +1,54 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+
+#include <cstdint>
+#include <vector>
+
+/// \brief Matches binary descriptors, such as ORB, by brute force with the ratio test built in.
+///
+/// The best and second best Hamming distance for each query descriptor are tracked while scanning the train descriptors,
+/// so no intermediate kNN match lists are created.
+/// The query rows are matched in parallel, with AVX2 for 32 byte descriptors when available.
+/// The internal buffers are reused between calls.
+class HammingMatcher
+{
+public:
+  /// \brief Constructs the matcher.
+  /// \param max_ratio Maximum acceptable ratio between the best and the second best distance.
+  /// \param cross_check If true, a match is only kept if the query descriptor is also the best match for the train descriptor.
+  explicit HammingMatcher(float max_ratio = 0.8f, bool cross_check = false);
+
+  /// \brief Matches query descriptors against train descriptors.
+  /// \param query Query descriptors, one CV_8U row per descriptor, with a multiple of 8 bytes per row.
+  /// \param train Train descriptors, in the same format as the query descriptors.
+  /// \param[out] matches The matches that pass the ratio test, and the cross check if enabled.
+  ///                     They are ordered by decreasing quality (increasing ratio), like extractGoodRatioMatches().
+  void match(const cv::Mat& query, const cv::Mat& train, std::vector<cv::DMatch>& matches);
+
+private:
+  /// \brief The two nearest train descriptors for a query descriptor.
+  struct QueryResult
+  {
+    int train_idx;
+    int best_distance;
+    int second_distance;
+  };
+
+  /// \brief The nearest query descriptor for a train descriptor.
+  struct TrainResult
+  {
+    int query_idx;
+    int distance;
+  };
+
+  /// \brief Matches the query rows [begin, end), and updates the nearest query for each train descriptor.
+  void matchRows(const cv::Mat& query, const cv::Mat& train, int begin, int end,
+                 std::vector<TrainResult>& train_results);
+
+  float max_ratio_;
+  bool cross_check_;
+
+  std::vector<QueryResult> query_results_;
+  std::vector<std::vector<TrainResult>> stripe_train_results_;
+};
@@ -1,14 +1,89 @@
 #include "homography_estimator.h"
 
-HomographyEstimator::HomographyEstimator(float p, float distance_threshold, int max_iterations)
+#include "homography_refinement.h"
+#include "metrics.h"
+
+namespace
+{
+/// \brief The arguments to the RANSAC workers, which the job captures by reference.
+struct RansacJob
+{
+  const Eigen::Ref<const Eigen::Matrix2Xf>& pts1;
+  const Eigen::Ref<const Eigen::Matrix2Xf>& pts2;
+  std::atomic<int>& iteration_bound;
+};
+
+/// \brief The initial SPRT parameters, before the inlier ratio and the consistency of bad hypotheses are known.
+/// Delta is the same as the probability of random support assumed when checking for non-random support.
+constexpr float sprt_initial_epsilon = 0.1f;
+constexpr float sprt_initial_delta = 0.05f;
+constexpr float sprt_min_delta = 0.01f;
+
+/// \brief Generating a hypothesis takes about as long as verifying this many correspondences with the scorer.
+constexpr float sprt_hypothesis_cost = 50.f;
+
+/// \brief Each worker checks the deadline every this many hypotheses, and tests at least this many.
+constexpr int deadline_check_interval = 8;
+
+/// \brief Mixes the seed, the estimate number and the worker into a seed for a worker's random generator.
+/// This is a SplitMix64 step, which unlike std::seed_seq does not allocate memory.
+std::uint32_t mixSeed(std::uint32_t seed, std::uint32_t estimate, std::uint32_t worker)
+{
+  std::uint64_t z = (static_cast<std::uint64_t>(seed) << 32 | estimate) + 0x9e3779b97f4a7c15ull * (worker + 1ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return static_cast<std::uint32_t>((z ^ (z >> 31)) >> 32);
+}
+}
+
+HomographyEstimator::HomographyEstimator(float p, float distance_threshold, int max_iterations,
+                                         int num_threads, std::optional<std::uint32_t> seed,
+                                         std::unique_ptr<PointSampler> sampler, bool refine, bool sprt)
     : p_{p}
     , distance_threshold_{distance_threshold}
     , max_iterations_{max_iterations}
-    , rd_{}
-    , generator_{rd_()}
-{ }
+    , seed_{seed ? *seed : std::random_device{}()}
+    , num_estimates_{0}
+    , thread_pool_{std::make_unique<ThreadPool>(num_threads)}
+    , improvements_(num_threads)
+    , sampler_{sampler ? std::move(sampler) : std::make_unique<UniformSampler>()}
+    , refine_{refine}
+    , sprt_{sprt}
+    , deadline_{std::chrono::steady_clock::time_point::max()}
+    , deadline_reached_{false}
+{
+  // A worker rarely improves on its best hypothesis more than a few times,
+  // so reserving room for the improvements up front avoids allocating while estimating.
+  for (auto& worker_improvements : improvements_)
+  {
+    worker_improvements.reserve(32);
+  }
+}
+
+HomographyEstimate HomographyEstimator::estimate(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                                 const Eigen::Ref<const Eigen::Matrix2Xf>& pts2)
+{
+  HomographyEstimate result;
+  estimate(pts1, pts2, result);
+  return result;
+}
+
+bool HomographyEstimator::estimate(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                   const Eigen::Ref<const Eigen::Matrix2Xf>& pts2, HomographyEstimate& result,
+                                   std::chrono::duration<double, std::milli> time_budget)
+{
+  deadline_ = std::chrono::steady_clock::now() +
+              std::chrono::duration_cast<std::chrono::steady_clock::duration>(time_budget);
+  deadline_reached_ = false;
+  estimate(pts1, pts2, result);
+
+  const bool completed = !deadline_reached_;
+  deadline_ = std::chrono::steady_clock::time_point::max();
+  return completed;
+}
 
-HomographyEstimate HomographyEstimator::estimate(const Eigen::Matrix2Xf& pts1, const Eigen::Matrix2Xf& pts2)
+void HomographyEstimator::estimate(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                   const Eigen::Ref<const Eigen::Matrix2Xf>& pts2, HomographyEstimate& result)
 {
   if (pts1.cols() != pts2.cols())
   {
@@ -16,112 +91,319 @@ HomographyEstimate HomographyEstimator::estimate(const Eigen::Matrix2Xf& pts1, c
   }
 
   // Find inliers.
-  PointSelection is_inlier = ransacEstimator(pts1, pts2);
+  PointSelection& is_inlier = result.inliers;
+  ransacEstimator(pts1, pts2, is_inlier);
 
   if (is_inlier.size() < 4)
   {
-    return HomographyEstimate{};
+    result.homography.setIdentity();
+    result.num_inliers = 0;
+    is_inlier.clear();
+    return;
   }
 
   // Estimate homography from set of inliers.
-  Eigen::Matrix2Xf inliers_1 = extractPoints(pts1, is_inlier);
-  Eigen::Matrix2Xf inliers_2 = extractPoints(pts2, is_inlier);
+  LAB_MOSAIC_SCOPED_TIMER(TimedEvent::refit);
+  extractInlierPoints(pts1, pts2, is_inlier);
+  const auto num_inliers = static_cast<Eigen::Index>(is_inlier.size());
+  const auto inliers_1 = inlier_pts1_.leftCols(num_inliers);
+  const auto inliers_2 = inlier_pts2_.leftCols(num_inliers);
+
+  Eigen::Matrix3f H = normalizedDltEstimator(inliers_1, inliers_2);
+
+  // Minimize the reprojection error, which DLT only approximates.
+  if (refine_)
+  {
+    H = refineHomography(inliers_1, inliers_2, H);
+  }
+
+  result.homography = H;
+  result.num_inliers = is_inlier.size();
+}
+
+void HomographyEstimator::ransacEstimator(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                          const Eigen::Ref<const Eigen::Matrix2Xf>& pts2, PointSelection& inliers)
+{
+  inliers.clear();
+  if (pts1.cols() < 4)
+  {
+    return;
+  }
+
+  LAB_MOSAIC_SCOPED_TIMER(TimedEvent::ransac);
+
+  // Store the points in a layout suitable for scoring all of them at once.
+  scorer_.setPoints(pts1, pts2);
+  sampler_->prepare(pts1.cols());
+
+  // Test hypotheses in parallel.
+  // The workers share an upper bound on the number of iterations, which shrinks as better hypotheses are found.
+  // The job only captures two pointers, so that std::function can store it without allocating memory.
+  std::atomic<int> iteration_bound{max_iterations_};
+  const RansacJob job{pts1, pts2, iteration_bound};
+  thread_pool_->run([this, &job](int worker) { ransacWorker(job.pts1, job.pts2, worker, job.iteration_bound); });
+  ++num_estimates_;
 
-  return {normalizedDltEstimator(inliers_1, inliers_2), is_inlier.size(), is_inlier};
+  // Find the number of iterations the sequential algorithm would have used.
+  // All hypotheses below this number have been tested, independent of how the workers were scheduled.
+  int num_iterations = max_iterations_;
+  for (const auto& worker_improvements : improvements_)
+  {
+    for (const auto& improvement : worker_improvements)
+    {
+      num_iterations = std::min(num_iterations, improvement.iteration_bound);
+    }
+  }
+
+  // Choose the first hypothesis with the most inliers among these, which makes the result reproducible.
+  const Improvement* best = nullptr;
+  for (const auto& worker_improvements : improvements_)
+  {
+    for (const auto& improvement : worker_improvements)
+    {
+      if (improvement.iteration < num_iterations &&
+          (!best || improvement.num_inliers > best->num_inliers ||
+           (improvement.num_inliers == best->num_inliers && improvement.iteration < best->iteration)))
+      {
+        best = &improvement;
+      }
+    }
+  }
+
+  // Only extract the inlier set for the best homography.
+  // Reserving room for all points means that a reused inlier set only allocates when there are more points.
+  if (best)
+  {
+    inliers.reserve(pts1.cols());
+    scorer_.extractInliers(best->homography, best->homography.inverse(), distance_threshold_, inliers);
+  }
 }
 
-PointSelection HomographyEstimator::ransacEstimator(const Eigen::Matrix2Xf& pts1, const Eigen::Matrix2Xf& pts2)
+void HomographyEstimator::ransacWorker(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                       const Eigen::Ref<const Eigen::Matrix2Xf>& pts2, int worker,
+                                       std::atomic<int>& iteration_bound)
 {
+  // Each worker has its own stream of random numbers, determined by the seed.
+  std::mt19937 generator(mixSeed(seed_, num_estimates_, static_cast<std::uint32_t>(worker)));
+
+  std::vector<Improvement>& improvements = improvements_[worker];
+  improvements.clear();
+
   Eigen::Index best_num_inliers{0};
-  PointSelection best_inliers;
 
-  PointSelection test_inliers;
+  // The SPRT is adapted as the worker runs, so that the state only depends on the hypotheses tested by this worker.
+  // Epsilon is the inlier ratio of the best hypothesis, and delta the inlier ratio among the rejected hypotheses.
+  SprtTest test = sprt_ ? SprtTest::design(sprt_initial_epsilon, sprt_initial_delta, sprt_hypothesis_cost)
+                        : SprtTest{};
+  Eigen::Index num_rejected_inliers{0};
+  Eigen::Index num_rejected_verified{0};
+
   Eigen::Matrix3f test_H;
   Eigen::Matrix3f test_H_inv;
 
-  Eigen::Matrix2Xf samples_1;
-  Eigen::Matrix2Xf samples_2;
+  PointSampler::Sample sample;
+  MinimalSample samples_1;
+  MinimalSample samples_2;
 
-  int num_iterations = max_iterations_;
-  for (int curr_iteration = 0; curr_iteration < num_iterations; ++curr_iteration)
+  const int num_threads = thread_pool_->numThreads();
+  const bool has_deadline = deadline_ != std::chrono::steady_clock::time_point::max();
+  int num_tested = 0;
+  for (int curr_iteration = worker;
+       curr_iteration < iteration_bound.load(std::memory_order_relaxed);
+       curr_iteration += num_threads, ++num_tested)
   {
+    // Stop at the deadline, and leave the best hypothesis so far.
+    // The hypotheses that were tested are still chosen between as if the iteration bound had been reached.
+    if (has_deadline && num_tested > 0 && num_tested % deadline_check_interval == 0 &&
+        std::chrono::steady_clock::now() > deadline_)
+    {
+      deadline_reached_ = true;
+      break;
+    }
+
     // Sample 4 random points.
-    PointSelection rand_selection = randomlySelectPoints(pts1.cols(), 4);
-    samples_1 = extractPoints(pts1, rand_selection);
-    samples_2 = extractPoints(pts2, rand_selection);
+    sampler_->sample(curr_iteration, generator, sample);
+    for (int i = 0; i < 4; ++i)
+    {
+      samples_1.col(i) = pts1.col(sample[i]);
+      samples_2.col(i) = pts2.col(sample[i]);
+    }
 
-    // Determine test homography.
-    test_H = dltEstimator(samples_1, samples_2);
+    // Determine test homography, and reject degenerate samples before scoring.
+    if (!minimalEstimator(samples_1, samples_2, test_H))
+    { continue; }
     test_H_inv = test_H.inverse();
 
-    // Count number of inliers.
+    // Count number of inliers, unless the SPRT rejects the hypothesis on the way.
     Eigen::Index test_num_inliers{0};
-    test_inliers.clear();
-    for (Eigen::Index i=0; i < pts1.cols(); ++i)
+    if (test.active())
     {
-      if (computeReprojectionError(pts1.col(i), pts2.col(i), test_H, test_H_inv) < distance_threshold_)
+      Eigen::Index num_verified{0};
+      if (!scorer_.verifyInliers(test_H, test_H_inv, distance_threshold_, test, test_num_inliers, num_verified))
       {
-        test_inliers.push_back(i);
-        test_num_inliers++;
+        num_rejected_inliers += test_num_inliers;
+        num_rejected_verified += num_verified;
+        const float delta = std::max(sprt_min_delta, static_cast<float>(num_rejected_inliers) /
+                                                     static_cast<float>(num_rejected_verified));
+        if (std::abs(delta - test.delta) > 0.05f * test.delta)
+        {
+          test = SprtTest::design(test.epsilon, delta, sprt_hypothesis_cost);
+        }
+        continue;
       }
     }
+    else
+    {
+      test_num_inliers = scorer_.countInliers(test_H, test_H_inv, distance_threshold_);
+    }
 
-    // Update homography if test homography has the most inliers so far.
+    // Store the test homography if it has the most inliers so far.
     if (test_num_inliers > 4 && test_num_inliers > best_num_inliers)
     {
-      // Update homography with largest inlier set.
-      std::swap(best_inliers, test_inliers);
       best_num_inliers = test_num_inliers;
 
-      // Update number of iterations.
-      const float inlier_ratio = static_cast<float>(best_num_inliers) / static_cast<float>(pts1.cols());
-      const float p_all_inliers = inlier_ratio*inlier_ratio*inlier_ratio*inlier_ratio;
-      const float estimated_min_iterations = std::log(1.f - p_) / std::log(1.f - p_all_inliers);
-      num_iterations = std::min(static_cast<int>(estimated_min_iterations), max_iterations_);
+      if (sprt_)
+      {
+        const float epsilon = static_cast<float>(test_num_inliers) / static_cast<float>(pts1.cols());
+        test = SprtTest::design(epsilon, test.delta, sprt_hypothesis_cost);
+      }
+
+      // Compute the number of iterations needed from the inlier ratio among all points.
+      // Good hypotheses may be rejected by the SPRT, which needs a few more iterations.
+      const float rejection_probability = test.rejectionProbability();
+      int bound = iterationBound(curr_iteration, test_num_inliers, pts1.cols(), rejection_probability);
+
+      // When sampling from a subset of the best points, the inlier ratio in the subset may give a tighter bound.
+      const Eigen::Index sample_set_size = sampler_->sampleSetSize(curr_iteration);
+      if (sample_set_size < pts1.cols())
+      {
+        const Eigen::Index sample_set_inliers = scorer_.countInliers(test_H, test_H_inv, distance_threshold_, sample_set_size);
+        if (isNonRandom(sample_set_inliers, sample_set_size))
+        {
+          bound = std::min(bound, iterationBound(curr_iteration, sample_set_inliers, sample_set_size,
+                                                 rejection_probability));
+        }
+      }
+      improvements.push_back({curr_iteration, test_num_inliers, bound, test_H});
+
+      // Publish the new number of iterations to all workers.
+      int current_bound = iteration_bound.load(std::memory_order_relaxed);
+      while (bound < current_bound &&
+             !iteration_bound.compare_exchange_weak(current_bound, bound, std::memory_order_relaxed))
+      { }
     }
   }
+}
 
-  return best_inliers;
+int HomographyEstimator::iterationBound(int iteration, Eigen::Index num_inliers, Eigen::Index num_points,
+                                        float rejection_probability) const
+{
+  const float inlier_ratio = static_cast<float>(num_inliers) / static_cast<float>(num_points);
+  const float p_all_inliers = inlier_ratio*inlier_ratio*inlier_ratio*inlier_ratio*(1.f - rejection_probability);
+  const float estimated_min_iterations = std::log1p(-p_) / std::log1p(-p_all_inliers);
+
+  const int num_iterations = estimated_min_iterations < static_cast<float>(max_iterations_)
+                             ? static_cast<int>(estimated_min_iterations) : max_iterations_;
+
+  // The iteration that found the hypothesis has always been performed.
+  return std::max(num_iterations, iteration + 1);
 }
 
-Eigen::Matrix3f HomographyEstimator::dltEstimator(const Eigen::Matrix2Xf& pts1, const Eigen::Matrix2Xf& pts2) const
+bool HomographyEstimator::isNonRandom(Eigen::Index num_inliers, Eigen::Index num_points) const
 {
-  // Define these for convenience.
-  using Vector9f = Eigen::Matrix<float, 9, 1>;
-  using Matrix3fRowMajor = Eigen::Matrix<float, 3, 3, Eigen::RowMajor>;
+  // Probability that a correspondence outside the sample supports a wrong homography.
+  constexpr float beta = 0.05f;
 
-  // Construct the equation matrix.
-  Eigen::MatrixXf A(2 * pts1.cols(), 9);
-  for (Eigen::Index i = 0; i < pts1.cols(); ++i)
-  {
-    const auto& pt1 = pts1.col(i);
-    const auto& pt2 = pts2.col(i);
+  // Quantile in the normal approximation of the binomial distribution of random support, for a 1% tail.
+  constexpr float z = 2.33f;
+
+  // We also require some support beyond the sample itself.
+  constexpr float min_support = 4.f;
+
+  const float n = static_cast<float>(num_points - 4);
+  const float random_support = n*beta + z*std::sqrt(n*beta*(1.f - beta));
 
-    A.block<2,9>(2*i, 0) <<
-          0.f,     0.f, 0.f, -pt1.x(), -pt1.y(), -1.f,  pt2.y()*pt1.x(),  pt2.y()*pt1.y(),  pt2.y(),
-      pt1.x(), pt1.y(), 1.f,      0.f,      0.f,  0.f, -pt2.x()*pt1.x(), -pt2.x()*pt1.y(), -pt2.x();
+  return static_cast<float>(num_inliers - 4) >= std::max(random_support, min_support);
+}
+
+bool HomographyEstimator::minimalEstimator(const MinimalSample& pts1, const MinimalSample& pts2, Eigen::Matrix3f& H) const
+{
+  if (isDegenerate(pts1, pts2))
+  {
+    return false;
   }
 
-  // Solve using SVD.
-  Vector9f h = A.jacobiSvd(Eigen::ComputeThinU | Eigen::ComputeFullV).matrixV().rightCols<1>();
+  // Find the transformation from the canonical projective basis to each set of points.
+  // The first three points define the columns of M,
+  // and the fourth point is used to determine the scale lambda of each column.
+  const Eigen::Matrix3f M1 = pts1.leftCols<3>().colwise().homogeneous();
+  const Eigen::Matrix3f M2 = pts2.leftCols<3>().colwise().homogeneous();
+  const Eigen::Matrix3f M1_inv = M1.inverse();
+  const Eigen::Vector3f lambda1 = M1_inv * pts1.col(3).homogeneous();
+  const Eigen::Vector3f lambda2 = M2.inverse() * pts2.col(3).homogeneous();
 
-  // Map solution to a 3x3 homography matrix.
-  Matrix3fRowMajor H(h.data());
+  // H maps points in image 1 to the basis, and from the basis to image 2.
+  H = M2 * (lambda2.array() / lambda1.array()).matrix().asDiagonal() * M1_inv;
 
-  return H;
+  return true;
 }
 
-Eigen::Matrix3f HomographyEstimator::normalizedDltEstimator(const Eigen::Matrix2Xf& pts1, const Eigen::Matrix2Xf& pts2) const
+bool HomographyEstimator::isDegenerate(const MinimalSample& pts1, const MinimalSample& pts2) const
 {
-  // Normalize points
-  Eigen::Matrix3f S1 = findNormalizingSimilarity(pts1);
-  Eigen::Matrix2Xf pts1_normalized = (S1*pts1.colwise().homogeneous()).colwise().hnormalized();
+  // Minimum sine of the angle between the two sides in a triangle spanned by three points.
+  constexpr float min_sine = 1e-3f;
+
+  // The four triangles that can be made from the four points.
+  constexpr int triangles[4][3] = {{0, 1, 2}, {0, 1, 3}, {0, 2, 3}, {1, 2, 3}};
+
+  bool first_flips = false;
+  for (int t = 0; t < 4; ++t)
+  {
+    const int* triangle = triangles[t];
+    const Eigen::Vector2f a1 = pts1.col(triangle[1]) - pts1.col(triangle[0]);
+    const Eigen::Vector2f b1 = pts1.col(triangle[2]) - pts1.col(triangle[0]);
+    const Eigen::Vector2f a2 = pts2.col(triangle[1]) - pts2.col(triangle[0]);
+    const Eigen::Vector2f b2 = pts2.col(triangle[2]) - pts2.col(triangle[0]);
+
+    const float cross1 = a1.x()*b1.y() - a1.y()*b1.x();
+    const float cross2 = a2.x()*b2.y() - a2.y()*b2.x();
+
+    // Three of the points are (close to) collinear.
+    if (std::abs(cross1) <= min_sine*a1.norm()*b1.norm() || std::abs(cross2) <= min_sine*a2.norm()*b2.norm())
+    {
+      return true;
+    }
+
+    // A valid homography either preserves or flips the orientation of all triangles.
+    const bool flips = (cross1 < 0.f) != (cross2 < 0.f);
+    if (t == 0)
+    {
+      first_flips = flips;
+    }
+    else if (flips != first_flips)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
 
-  Eigen::Matrix3f S2 = findNormalizingSimilarity(pts2);
-  Eigen::Matrix2Xf pts2_normalized = (S2*pts2.colwise().homogeneous()).colwise().hnormalized();
+Eigen::Matrix3f HomographyEstimator::dltEstimator(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                                  const Eigen::Ref<const Eigen::Matrix2Xf>& pts2)
+{
+  return solveDlt(pts1, pts2, Eigen::Matrix3f::Identity(), Eigen::Matrix3f::Identity());
+}
+
+Eigen::Matrix3f HomographyEstimator::normalizedDltEstimator(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                                            const Eigen::Ref<const Eigen::Matrix2Xf>& pts2)
+{
+  // Normalize points
+  const Eigen::Matrix3f S1 = findNormalizingSimilarity(pts1);
+  const Eigen::Matrix3f S2 = findNormalizingSimilarity(pts2);
 
   // Estimate the homography.
-  Eigen::Matrix3f H = dltEstimator(pts1_normalized, pts2_normalized);
+  Eigen::Matrix3f H = solveDlt(pts1, pts2, S1, S2);
 
   // Transform back to the original frame.
   H = S2.inverse()*H*S1;
@@ -135,13 +417,54 @@ Eigen::Matrix3f HomographyEstimator::normalizedDltEstimator(const Eigen::Matrix2
   return H;
 }
 
-Eigen::Matrix3f HomographyEstimator::findNormalizingSimilarity(const Eigen::Matrix2Xf& pts) const
+Eigen::Matrix3f HomographyEstimator::solveDlt(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                              const Eigen::Ref<const Eigen::Matrix2Xf>& pts2,
+                                              const Eigen::Matrix3f& S1, const Eigen::Matrix3f& S2)
+{
+  // Define these for convenience.
+  using Vector9d = Eigen::Matrix<double, 9, 1>;
+  using Matrix9d = Eigen::Matrix<double, 9, 9>;
+  using Matrix3dRowMajor = Eigen::Matrix<double, 3, 3, Eigen::RowMajor>;
+
+  // Accumulate the normal equations A^T*A from the two equations for each correspondence,
+  // so that the equation matrix A does not have to be stored.
+  Matrix9d AtA = Matrix9d::Zero();
+  Eigen::Matrix<double, 2, 9> A_i;
+  for (Eigen::Index i = 0; i < pts1.cols(); ++i)
+  {
+    const Eigen::Vector2d pt1 = (S1*pts1.col(i).homogeneous()).hnormalized().cast<double>();
+    const Eigen::Vector2d pt2 = (S2*pts2.col(i).homogeneous()).hnormalized().cast<double>();
+
+    A_i <<
+          0.,      0., 0., -pt1.x(), -pt1.y(), -1.,  pt2.y()*pt1.x(),  pt2.y()*pt1.y(),  pt2.y(),
+      pt1.x(), pt1.y(), 1.,       0.,       0.,  0., -pt2.x()*pt1.x(), -pt2.x()*pt1.y(), -pt2.x();
+
+    AtA.noalias() += A_i.transpose()*A_i;
+  }
+
+  // The solution is the eigenvector of A^T*A with the smallest eigenvalue, which is the last right singular vector of A.
+  // The eigenvalues are sorted in increasing order.
+  const Eigen::SelfAdjointEigenSolver<Matrix9d> solver(AtA);
+  const Vector9d h = solver.eigenvectors().col(0);
+
+  // Map solution to a 3x3 homography matrix.
+  const Matrix3dRowMajor H(h.data());
+
+  return H.cast<float>();
+}
+
+Eigen::Matrix3f HomographyEstimator::findNormalizingSimilarity(const Eigen::Ref<const Eigen::Matrix2Xf>& pts)
 {
   // Centroid of points
   const Eigen::Vector2f center = pts.rowwise().mean();
 
   // Compute the mean distance from centroid for all pts
-  const float r_mean = ((pts.colwise() - center).colwise().norm()).mean();
+  float r_sum = 0.f;
+  for (Eigen::Index i = 0; i < pts.cols(); ++i)
+  {
+    r_sum += (pts.col(i) - center).norm();
+  }
+  const float r_mean = r_sum / static_cast<float>(pts.cols());
 
   // The normalizing similarity matrix S
   const float s = std::sqrt(2.0f) / r_mean;
@@ -155,38 +478,30 @@ Eigen::Matrix3f HomographyEstimator::findNormalizingSimilarity(const Eigen::Matr
 }
 
 float HomographyEstimator::computeReprojectionError(const Eigen::Vector2f& pt1, const Eigen::Vector2f& pt2,
-                                                    const Eigen::Matrix3f& H, const Eigen::Matrix3f& H_inv) const
+                                                    const Eigen::Matrix3f& H, const Eigen::Matrix3f& H_inv)
 {
-  // Todo 5: Compute the two-sided reprojection error.
   // Map points onto each other using the homography.
-  Eigen::Vector2f pt_1_in_2;
-  Eigen::Vector2f pt_2_in_1;
+  const Eigen::Vector2f pt_1_in_2 = (H*pt1.homogeneous()).hnormalized();
+  const Eigen::Vector2f pt_2_in_1 = (H_inv*pt2.homogeneous()).hnormalized();
 
   // Compute the two-sided reprojection error \epsilon_i.
-  return 2*distance_threshold_; // Remove this dummy result!
+  return (pt_1_in_2 - pt2).norm() + (pt1 - pt_2_in_1).norm();
 }
 
-Eigen::Matrix2Xf HomographyEstimator::extractPoints(const Eigen::Matrix2Xf& pts, const PointSelection& selection) const
+void HomographyEstimator::extractInlierPoints(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                              const Eigen::Ref<const Eigen::Matrix2Xf>& pts2,
+                                              const PointSelection& inliers)
 {
-  Eigen::Matrix2Xf samples(2, selection.size());
-
-  for (size_t i = 0; i < selection.size(); ++i)
+  const auto num_inliers = static_cast<Eigen::Index>(inliers.size());
+  if (inlier_pts1_.cols() < num_inliers)
   {
-    samples.col(i) = pts.col(selection[i]);
+    inlier_pts1_.resize(Eigen::NoChange, num_inliers);
+    inlier_pts2_.resize(Eigen::NoChange, num_inliers);
   }
 
-  return samples;
-}
-
-PointSelection HomographyEstimator::randomlySelectPoints(Eigen::Index total_size, int sample_size)
-{
-  PointSelection selection;
-  std::uniform_int_distribution<Eigen::Index> distribution(0, total_size-1);
-
-  for (int i=0; i < sample_size; ++i)
+  for (Eigen::Index i = 0; i < num_inliers; ++i)
   {
-    selection.push_back(distribution(generator_));
+    inlier_pts1_.col(i) = pts1.col(inliers[i]);
+    inlier_pts2_.col(i) = pts2.col(inliers[i]);
   }
-
-  return selection;
 }
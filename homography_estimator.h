@@ -1,10 +1,16 @@
 #pragma once
 
+#include "inlier_scorer.h"
+#include "point_sampler.h"
+#include "thread_pool.h"
 #include "Eigen/Dense"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
 #include <random>
 
-using PointSelection = std::vector<Eigen::Index>;
-
 struct HomographyEstimate
 {
   Eigen::Matrix3f homography;
@@ -20,40 +26,138 @@ public:
   /// \param p The desired probability of getting a good sample.
   /// \param distance_threshold The maximum error a good sample can have as defined by the two-sided reprojection error.
   /// \param max_iterations The absolute maximum iterations allowed, ignoring p if necessary.
-  explicit HomographyEstimator(float p = 0.99f, float distance_threshold = 3.f, int max_iterations = 10000);
+  /// \param num_threads The number of threads generating and scoring hypotheses in parallel.
+  /// \param seed Seed for the random sampling, drawn from std::random_device if not set.
+  ///             The estimates are reproducible for a given seed and number of threads.
+  /// \param sampler Draws the minimal samples, uniformly from all correspondences if not set.
+  /// \param refine If true, the normalized DLT estimate from the inliers is refined with Levenberg-Marquardt.
+  /// \param sprt If true, each hypothesis is verified with the SPRT, which stops scoring bad hypotheses after a few points.
+  ///             The test adapts to the inlier ratio of the best hypothesis and to how consistent the rejected ones are.
+  explicit HomographyEstimator(float p = 0.99f, float distance_threshold = 3.f, int max_iterations = 10000,
+                               int num_threads = 1, std::optional<std::uint32_t> seed = std::nullopt,
+                               std::unique_ptr<PointSampler> sampler = nullptr, bool refine = false,
+                               bool sprt = false);
 
   /// \brief Estimate a homography from point correspondences.
+  /// When using ProsacSampler, the correspondences must be ordered by decreasing match quality.
   /// \param pts1 Set of corresponding points from image 1.
   /// \param pts2 Set of corresponding points from image 2.
   /// \return The estimated homography.
-  HomographyEstimate estimate(const Eigen::Matrix2Xf& pts1, const Eigen::Matrix2Xf& pts2);
+  HomographyEstimate estimate(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                              const Eigen::Ref<const Eigen::Matrix2Xf>& pts2);
 
-private:
-  /// \brief Finds a set of inliers for estimating a homography.
-  PointSelection ransacEstimator(const Eigen::Matrix2Xf& pts1, const Eigen::Matrix2Xf& pts2);
+  /// \brief Estimate a homography from point correspondences into an existing estimate.
+  ///
+  /// The inlier indices are written into the memory of the estimate, and the estimator keeps its buffers between calls,
+  /// so repeated estimates do not allocate memory once the buffers have grown to the largest set of points.
+  /// \param pts1 Set of corresponding points from image 1.
+  /// \param pts2 Set of corresponding points from image 2.
+  /// \param[out] result The estimated homography and its inliers. If no homography was found, it has no inliers.
+  void estimate(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1, const Eigen::Ref<const Eigen::Matrix2Xf>& pts2,
+                HomographyEstimate& result);
+
+  /// \brief Estimate a homography from point correspondences into an existing estimate, within a time budget.
+  ///
+  /// RANSAC stops when the budget is spent, and continues with the best hypothesis so far,
+  /// although each thread tests a few hypotheses even if the budget is spent already.
+  /// The estimates are not reproducible when RANSAC is stopped by the budget.
+  /// \param pts1 Set of corresponding points from image 1.
+  /// \param pts2 Set of corresponding points from image 2.
+  /// \param[out] result The estimated homography and its inliers. If no homography was found, it has no inliers.
+  /// \param time_budget The time RANSAC may spend, which does not include the final fit to the inliers.
+  /// \return False if RANSAC was stopped by the budget before it had tested enough hypotheses.
+  bool estimate(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1, const Eigen::Ref<const Eigen::Matrix2Xf>& pts2,
+                HomographyEstimate& result, std::chrono::duration<double, std::milli> time_budget);
+
+  /// \brief Computes the two-sided reprojection error for a given homography.
+  /// \param pt1 Point in image 1.
+  /// \param pt2 Corresponding point in image 2.
+  /// \param H The homography mapping points in image 1 to image 2.
+  /// \param H_inv The inverse of H.
+  /// \return The two-sided reprojection error.
+  static float computeReprojectionError(const Eigen::Vector2f& pt1, const Eigen::Vector2f& pt2,
+                                        const Eigen::Matrix3f& H, const Eigen::Matrix3f& H_inv);
 
   /// \brief Estimates a homography from point correspondences using DLT.
-  Eigen::Matrix3f dltEstimator(const Eigen::Matrix2Xf& pts1, const Eigen::Matrix2Xf& pts2) const;
+  /// The equations are accumulated into fixed-size normal equations, so no memory is allocated.
+  /// \param pts1 At least four points from image 1.
+  /// \param pts2 The corresponding points from image 2.
+  static Eigen::Matrix3f dltEstimator(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                      const Eigen::Ref<const Eigen::Matrix2Xf>& pts2);
 
   /// \brief Estimates a homography from point correspondences using the normalized DLT.
-  Eigen::Matrix3f normalizedDltEstimator(const Eigen::Matrix2Xf& pts1, const Eigen::Matrix2Xf& pts2) const;
+  /// The points are normalized while the equations are accumulated, so no memory is allocated.
+  /// \param pts1 At least four points from image 1.
+  /// \param pts2 The corresponding points from image 2.
+  static Eigen::Matrix3f normalizedDltEstimator(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                                const Eigen::Ref<const Eigen::Matrix2Xf>& pts2);
 
-  /// \brief Finds a normalizing similarity transform for a set of points.
-  Eigen::Matrix3f findNormalizingSimilarity(const Eigen::Matrix2Xf& pts) const;
+private:
+  /// \brief A hypothesis with more inliers than all hypotheses tested before it by the same worker.
+  struct Improvement
+  {
+    int iteration;
+    Eigen::Index num_inliers;
+    int iteration_bound;
+    Eigen::Matrix3f homography;
+  };
 
-  /// \brief Computes the two-sided reprojection error for a given homography.
-  float computeReprojectionError(const Eigen::Vector2f& pt1, const Eigen::Vector2f& pt2,
-                                 const Eigen::Matrix3f& H, const Eigen::Matrix3f& H_inv) const;
+  /// \brief Finds a set of inliers for estimating a homography.
+  void ransacEstimator(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1, const Eigen::Ref<const Eigen::Matrix2Xf>& pts2,
+                       PointSelection& inliers);
+
+  /// \brief Tests the hypotheses worker, worker + num_threads, worker + 2*num_threads, ...
+  /// until the shared iteration bound is reached.
+  void ransacWorker(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1, const Eigen::Ref<const Eigen::Matrix2Xf>& pts2,
+                    int worker, std::atomic<int>& iteration_bound);
+
+  /// \brief Computes the number of iterations needed after finding a hypothesis with the given number of inliers.
+  /// \param rejection_probability The probability that a good hypothesis is rejected by the SPRT.
+  int iterationBound(int iteration, Eigen::Index num_inliers, Eigen::Index num_points,
+                     float rejection_probability = 0.f) const;
+
+  /// \brief Checks if the support for a hypothesis among the first num_points correspondences is unlikely to be random.
+  bool isNonRandom(Eigen::Index num_inliers, Eigen::Index num_points) const;
+
+  /// \brief Minimal sample of four points, stored as columns.
+  using MinimalSample = Eigen::Matrix<float, 2, 4>;
 
-  /// \brief Exracts points from a point set.
-  Eigen::Matrix2Xf extractPoints(const Eigen::Matrix2Xf& pts, const PointSelection& selection) const;
+  /// \brief Estimates a homography from a minimal sample of four point correspondences.
+  /// \return False if the sample is degenerate, in which case H is left untouched.
+  bool minimalEstimator(const MinimalSample& pts1, const MinimalSample& pts2, Eigen::Matrix3f& H) const;
 
-  /// \brief Computes a random point selection.
-  PointSelection randomlySelectPoints(Eigen::Index total_size, int sample_size);
+  /// \brief Checks if three of the points in a sample are collinear, or if the samples have inconsistent orientation.
+  bool isDegenerate(const MinimalSample& pts1, const MinimalSample& pts2) const;
+
+  /// \brief Finds a normalizing similarity transform for a set of points.
+  static Eigen::Matrix3f findNormalizingSimilarity(const Eigen::Ref<const Eigen::Matrix2Xf>& pts);
+
+  /// \brief Estimates a homography with DLT from points transformed by a similarity in each image.
+  static Eigen::Matrix3f solveDlt(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                  const Eigen::Ref<const Eigen::Matrix2Xf>& pts2,
+                                  const Eigen::Matrix3f& S1, const Eigen::Matrix3f& S2);
+
+  /// \brief Copies the inlier points into the inlier buffers, which only grow.
+  void extractInlierPoints(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                           const Eigen::Ref<const Eigen::Matrix2Xf>& pts2, const PointSelection& inliers);
 
   float p_;
   float distance_threshold_;
   int max_iterations_;
-  std::random_device rd_;
-  std::mt19937 generator_;
+  std::uint32_t seed_;
+  std::uint32_t num_estimates_;
+  std::unique_ptr<ThreadPool> thread_pool_;
+  std::vector<std::vector<Improvement>> improvements_;
+  std::unique_ptr<PointSampler> sampler_;
+  InlierScorer scorer_;
+  bool refine_;
+  bool sprt_;
+
+  /// \brief The time when the workers stop testing hypotheses for the current estimate.
+  std::chrono::steady_clock::time_point deadline_;
+  std::atomic<bool> deadline_reached_;
+
+  /// \brief The inlier points for the final fit, where only the first columns are used.
+  Eigen::Matrix2Xf inlier_pts1_;
+  Eigen::Matrix2Xf inlier_pts2_;
 };
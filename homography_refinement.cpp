@@ -0,0 +1,408 @@
+#include "homography_refinement.h"
+
+#include "Eigen/SparseCholesky"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace
+{
+using Vector8d = Eigen::Matrix<double, 8, 1>;
+using Matrix8d = Eigen::Matrix<double, 8, 8>;
+using Matrix28d = Eigen::Matrix<double, 2, 8>;
+
+constexpr double initial_damping = 1e-3;
+constexpr double max_damping = 1e8;
+constexpr double min_relative_decrease = 1e-8;
+
+/// \brief Scales a homography so that its last element is one.
+Eigen::Matrix3d normalized(const Eigen::Matrix3d& H)
+{
+  return std::abs(H(2, 2)) > 1e-12 ? Eigen::Matrix3d{H / H(2, 2)} : H;
+}
+
+/// \brief Updates the first eight elements of a homography, in row-major order.
+Eigen::Matrix3d updated(const Eigen::Matrix3d& H, const Vector8d& delta)
+{
+  Eigen::Matrix3d H_new = H;
+  for (int k = 0; k < 8; ++k)
+  {
+    H_new(k / 3, k % 3) += delta(k);
+  }
+  return H_new;
+}
+
+/// \brief Maps a point from frame a to frame b through the mosaic, and computes the distance to the corresponding point.
+///
+/// The residual is pi(H_b_inv*H_a*pt_a) - pt_b, where H_a and H_b map the frames to the mosaic.
+/// Measuring the distance in a frame rather than in the mosaic prevents the homographies from shrinking the mosaic.
+/// The derivatives are with respect to the first eight elements of H_a and H_b, where dH_b_inv = -H_b_inv*dH_b*H_b_inv.
+/// \return False if the point is mapped to infinity.
+bool transferResidual(const Eigen::Matrix3d& H_a, const Eigen::Matrix3d& H_b_inv,
+                      const Eigen::Vector3d& pt_a, const Eigen::Vector3d& pt_b,
+                      Eigen::Vector2d& residual, Matrix28d* J_a, Matrix28d* J_b)
+{
+  const Eigen::Vector3d u = H_b_inv * (H_a * pt_a);
+  if (std::abs(u.z()) < 1e-12)
+  { return false; }
+
+  const double w = 1. / u.z();
+  const Eigen::Vector2d projected = u.head<2>() * w;
+  residual = projected - pt_b.head<2>();
+
+  if (J_a || J_b)
+  {
+    Eigen::Matrix<double, 2, 3> D;
+    D << w, 0., -projected.x() * w,
+         0., w, -projected.y() * w;
+
+    // Element (i, j) of a homography moves u along column i of H_b_inv.
+    const Eigen::Matrix<double, 2, 3> D_H_b_inv = D * H_b_inv;
+    for (int k = 0; k < 8; ++k)
+    {
+      if (J_a)
+      { J_a->col(k) = D_H_b_inv.col(k / 3) * pt_a(k % 3); }
+      if (J_b)
+      { J_b->col(k) = -D_H_b_inv.col(k / 3) * u(k % 3); }
+    }
+  }
+
+  return true;
+}
+
+/// \brief Computes the cost and optionally the normal equations of the two-sided transfer error.
+///
+/// This is the transfer residual in both directions between image 1, which is mapped to image 2 by H,
+/// and image 2, which is taken as the mosaic.
+double twoSidedCost(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1, const Eigen::Ref<const Eigen::Matrix2Xf>& pts2,
+                    const Eigen::Matrix3d& H, Matrix8d* JtJ, Vector8d* Jtr)
+{
+  const Eigen::Matrix3d I = Eigen::Matrix3d::Identity();
+  const Eigen::Matrix3d H_inv = H.inverse();
+  if (JtJ)
+  {
+    JtJ->setZero();
+    Jtr->setZero();
+  }
+
+  double cost = 0.;
+  Eigen::Vector2d r_forward;
+  Eigen::Vector2d r_backward;
+  Matrix28d J_forward;
+  Matrix28d J_backward;
+  for (Eigen::Index i = 0; i < pts1.cols(); ++i)
+  {
+    const Eigen::Vector3d pt1 = pts1.col(i).cast<double>().homogeneous();
+    const Eigen::Vector3d pt2 = pts2.col(i).cast<double>().homogeneous();
+    if (!transferResidual(H, I, pt1, pt2, r_forward, JtJ ? &J_forward : nullptr, nullptr) ||
+        !transferResidual(I, H_inv, pt2, pt1, r_backward, nullptr, JtJ ? &J_backward : nullptr))
+    { continue; }
+
+    cost += r_forward.squaredNorm() + r_backward.squaredNorm();
+
+    if (JtJ)
+    {
+      JtJ->noalias() += J_forward.transpose() * J_forward + J_backward.transpose() * J_backward;
+      Jtr->noalias() += J_forward.transpose() * r_forward + J_backward.transpose() * r_backward;
+    }
+  }
+
+  return cost;
+}
+}
+
+Eigen::Matrix3f refineHomography(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                 const Eigen::Ref<const Eigen::Matrix2Xf>& pts2, const Eigen::Matrix3f& H,
+                                 int max_iterations)
+{
+  if (pts1.cols() != pts2.cols())
+  {
+    throw std::invalid_argument("Point correspondence matrices did not have same size");
+  }
+
+  Eigen::Matrix3d H_current = normalized(H.cast<double>());
+  if (pts1.cols() < 4 || std::abs(H_current(2, 2) - 1.) > 1e-9)
+  { return H; }
+
+  Matrix8d JtJ;
+  Vector8d Jtr;
+  double cost = twoSidedCost(pts1, pts2, H_current, &JtJ, &Jtr);
+  double damping = initial_damping;
+
+  for (int iteration = 0; iteration < max_iterations && damping < max_damping; ++iteration)
+  {
+    // Damp each parameter relative to its curvature, since the elements of H have very different scales.
+    Matrix8d A = JtJ;
+    A.diagonal() *= 1. + damping;
+    const Vector8d delta = A.ldlt().solve(-Jtr);
+
+    const Eigen::Matrix3d H_new = updated(H_current, delta);
+    const double new_cost = twoSidedCost(pts1, pts2, H_new, nullptr, nullptr);
+
+    if (!(new_cost < cost))
+    {
+      damping *= 10.;
+      continue;
+    }
+
+    const bool converged = cost - new_cost < min_relative_decrease * cost;
+    H_current = H_new;
+    cost = twoSidedCost(pts1, pts2, H_current, &JtJ, &Jtr);
+    damping /= 10.;
+
+    if (converged)
+    { break; }
+  }
+
+  return H_current.cast<float>();
+}
+
+MosaicOptimizer::MosaicOptimizer(int max_points_per_pair)
+    : max_points_per_pair_{max_points_per_pair}
+{ }
+
+int MosaicOptimizer::addFrame(const Eigen::Matrix3f& to_mosaic, bool fixed)
+{
+  homographies_.push_back(normalized(to_mosaic.cast<double>()));
+  fixed_.push_back(fixed);
+  return static_cast<int>(homographies_.size()) - 1;
+}
+
+void MosaicOptimizer::addCorrespondences(int frame_a, int frame_b, const Eigen::Ref<const Eigen::Matrix2Xf>& pts_a,
+                                         const Eigen::Ref<const Eigen::Matrix2Xf>& pts_b)
+{
+  if (frame_a < 0 || frame_a >= numFrames() || frame_b < 0 || frame_b >= numFrames() || frame_a == frame_b)
+  {
+    throw std::invalid_argument("Invalid frame pair");
+  }
+  if (pts_a.cols() != pts_b.cols())
+  {
+    throw std::invalid_argument("Point correspondence matrices did not have same size");
+  }
+  if (pts_a.cols() == 0)
+  { return; }
+
+  // Keep evenly spaced correspondences, which are enough to constrain the pair.
+  const Eigen::Index num_points = std::min<Eigen::Index>(pts_a.cols(), max_points_per_pair_);
+  FramePair pair{frame_a, frame_b, Eigen::Matrix3Xd(3, num_points), Eigen::Matrix3Xd(3, num_points)};
+  for (Eigen::Index i = 0; i < num_points; ++i)
+  {
+    const Eigen::Index col = i * pts_a.cols() / num_points;
+    pair.pts_a.col(i) = pts_a.col(col).cast<double>().homogeneous();
+    pair.pts_b.col(i) = pts_b.col(col).cast<double>().homogeneous();
+  }
+
+  pairs_.push_back(std::move(pair));
+}
+
+int MosaicOptimizer::numFrames() const
+{
+  return static_cast<int>(homographies_.size());
+}
+
+int MosaicOptimizer::numPairs() const
+{
+  return static_cast<int>(pairs_.size());
+}
+
+double MosaicOptimizer::optimize(int max_iterations)
+{
+  if (pairs_.empty())
+  { return 0.; }
+
+  // Only optimize frames that are not fixed, and take part in at least one pair.
+  std::vector<bool> in_pair(homographies_.size(), false);
+  for (const auto& pair : pairs_)
+  {
+    in_pair[pair.frame_a] = true;
+    in_pair[pair.frame_b] = true;
+  }
+
+  const bool any_fixed = std::find(fixed_.begin(), fixed_.end(), true) != fixed_.end();
+  parameter_offsets_.assign(homographies_.size(), -1);
+  int num_parameters = 0;
+  for (size_t frame = 0; frame < homographies_.size(); ++frame)
+  {
+    const bool is_fixed = fixed_[frame] || (!any_fixed && frame == 0);
+    if (in_pair[frame] && !is_fixed)
+    {
+      parameter_offsets_[frame] = num_parameters;
+      num_parameters += 8;
+    }
+  }
+  if (num_parameters == 0)
+  { return rmsError(); }
+
+  Eigen::SparseMatrix<double> JtJ;
+  Eigen::VectorXd Jtr;
+  buildNormalEquations(JtJ, Jtr);
+  double cost = computeCost(homographies_);
+  double damping = initial_damping;
+
+  // The sparsity pattern is the same in every iteration.
+  Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> solver;
+  solver.analyzePattern(JtJ);
+
+  std::vector<Eigen::Matrix3d> new_homographies(homographies_.size());
+  for (int iteration = 0; iteration < max_iterations && damping < max_damping; ++iteration)
+  {
+    Eigen::SparseMatrix<double> A = JtJ;
+    for (int i = 0; i < A.rows(); ++i)
+    {
+      A.coeffRef(i, i) *= 1. + damping;
+    }
+
+    solver.factorize(A);
+    if (solver.info() != Eigen::Success)
+    {
+      damping *= 10.;
+      continue;
+    }
+    const Eigen::VectorXd delta = solver.solve(-Jtr);
+
+    for (size_t frame = 0; frame < homographies_.size(); ++frame)
+    {
+      const int offset = parameter_offsets_[frame];
+      new_homographies[frame] = offset < 0 ? homographies_[frame]
+                                           : updated(homographies_[frame], delta.segment<8>(offset));
+    }
+
+    const double new_cost = computeCost(new_homographies);
+    if (!(new_cost < cost))
+    {
+      damping *= 10.;
+      continue;
+    }
+
+    const bool converged = cost - new_cost < min_relative_decrease * cost;
+    homographies_.swap(new_homographies);
+    cost = new_cost;
+    buildNormalEquations(JtJ, Jtr);
+    damping /= 10.;
+
+    if (converged)
+    { break; }
+  }
+
+  return rmsError();
+}
+
+double MosaicOptimizer::rmsError() const
+{
+  Eigen::Index num_points = 0;
+  for (const auto& pair : pairs_)
+  {
+    num_points += pair.pts_a.cols();
+  }
+
+  // Each correspondence has a residual in both frames.
+  return num_points > 0 ? std::sqrt(computeCost(homographies_) / static_cast<double>(2 * num_points)) : 0.;
+}
+
+Eigen::Matrix3f MosaicOptimizer::toMosaic(int frame) const
+{
+  return homographies_.at(frame).cast<float>();
+}
+
+double MosaicOptimizer::computeCost(const std::vector<Eigen::Matrix3d>& homographies) const
+{
+  double cost = 0.;
+  Eigen::Vector2d r_ab;
+  Eigen::Vector2d r_ba;
+  for (const auto& pair : pairs_)
+  {
+    const Eigen::Matrix3d& H_a = homographies[pair.frame_a];
+    const Eigen::Matrix3d& H_b = homographies[pair.frame_b];
+    const Eigen::Matrix3d H_a_inv = H_a.inverse();
+    const Eigen::Matrix3d H_b_inv = H_b.inverse();
+
+    for (Eigen::Index i = 0; i < pair.pts_a.cols(); ++i)
+    {
+      if (transferResidual(H_a, H_b_inv, pair.pts_a.col(i), pair.pts_b.col(i), r_ab, nullptr, nullptr) &&
+          transferResidual(H_b, H_a_inv, pair.pts_b.col(i), pair.pts_a.col(i), r_ba, nullptr, nullptr))
+      {
+        cost += r_ab.squaredNorm() + r_ba.squaredNorm();
+      }
+    }
+  }
+
+  return cost;
+}
+
+void MosaicOptimizer::buildNormalEquations(Eigen::SparseMatrix<double>& JtJ, Eigen::VectorXd& Jtr) const
+{
+  const int num_parameters = *std::max_element(parameter_offsets_.begin(), parameter_offsets_.end()) + 8;
+  Jtr.setZero(num_parameters);
+
+  std::vector<Eigen::Triplet<double>> triplets;
+  triplets.reserve(pairs_.size() * 4 * 64);
+  const auto addBlock = [&triplets](int row_offset, int col_offset, const Block& block)
+  {
+    for (int col = 0; col < 8; ++col)
+    {
+      for (int row = 0; row < 8; ++row)
+      {
+        triplets.emplace_back(row_offset + row, col_offset + col, block(row, col));
+      }
+    }
+  };
+
+  // Accumulate the blocks for each pair before adding them to the sparse matrix.
+  Eigen::Vector2d r_ab;
+  Eigen::Vector2d r_ba;
+  Matrix28d J_ab_a;
+  Matrix28d J_ab_b;
+  Matrix28d J_ba_a;
+  Matrix28d J_ba_b;
+  for (const auto& pair : pairs_)
+  {
+    const int offset_a = parameter_offsets_[pair.frame_a];
+    const int offset_b = parameter_offsets_[pair.frame_b];
+    if (offset_a < 0 && offset_b < 0)
+    { continue; }
+
+    const Eigen::Matrix3d& H_a = homographies_[pair.frame_a];
+    const Eigen::Matrix3d& H_b = homographies_[pair.frame_b];
+    const Eigen::Matrix3d H_a_inv = H_a.inverse();
+    const Eigen::Matrix3d H_b_inv = H_b.inverse();
+
+    Block block_aa = Block::Zero();
+    Block block_ab = Block::Zero();
+    Block block_bb = Block::Zero();
+    BlockVector g_a = BlockVector::Zero();
+    BlockVector g_b = BlockVector::Zero();
+
+    for (Eigen::Index i = 0; i < pair.pts_a.cols(); ++i)
+    {
+      if (!transferResidual(H_a, H_b_inv, pair.pts_a.col(i), pair.pts_b.col(i), r_ab, &J_ab_a, &J_ab_b) ||
+          !transferResidual(H_b, H_a_inv, pair.pts_b.col(i), pair.pts_a.col(i), r_ba, &J_ba_b, &J_ba_a))
+      { continue; }
+
+      block_aa.noalias() += J_ab_a.transpose() * J_ab_a + J_ba_a.transpose() * J_ba_a;
+      block_ab.noalias() += J_ab_a.transpose() * J_ab_b + J_ba_a.transpose() * J_ba_b;
+      block_bb.noalias() += J_ab_b.transpose() * J_ab_b + J_ba_b.transpose() * J_ba_b;
+      g_a.noalias() += J_ab_a.transpose() * r_ab + J_ba_a.transpose() * r_ba;
+      g_b.noalias() += J_ab_b.transpose() * r_ab + J_ba_b.transpose() * r_ba;
+    }
+
+    if (offset_a >= 0)
+    {
+      addBlock(offset_a, offset_a, block_aa);
+      Jtr.segment<8>(offset_a) += g_a;
+    }
+    if (offset_b >= 0)
+    {
+      addBlock(offset_b, offset_b, block_bb);
+      Jtr.segment<8>(offset_b) += g_b;
+    }
+    if (offset_a >= 0 && offset_b >= 0)
+    {
+      addBlock(offset_a, offset_b, block_ab);
+      addBlock(offset_b, offset_a, block_ab.transpose());
+    }
+  }
+
+  JtJ.resize(num_parameters, num_parameters);
+  JtJ.setFromTriplets(triplets.begin(), triplets.end());
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "Eigen/Dense"
+#include "Eigen/SparseCore"
+
+#include <vector>
+
+/// \brief Refines a homography with Levenberg-Marquardt.
+///
+/// Minimizes the sum of squared transfer errors in both images, the squared counterpart of the two-sided
+/// reprojection error in HomographyEstimator::computeReprojectionError().
+/// The homography is parameterized by its first eight elements, with the last element fixed to one.
+/// \param pts1 Inlier points from image 1.
+/// \param pts2 The corresponding points from image 2.
+/// \param H Initial homography mapping points in image 1 to image 2, such as the normalized DLT estimate.
+/// \param max_iterations The maximum number of iterations.
+/// \return The refined homography, or H if it could not be improved.
+///         No memory is allocated, since the normal equations have a fixed size.
+Eigen::Matrix3f refineHomography(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                 const Eigen::Ref<const Eigen::Matrix2Xf>& pts2, const Eigen::Matrix3f& H,
+                                 int max_iterations = 10);
+
+/// \brief Jointly optimizes the homographies from many frames to the mosaic.
+///
+/// Each pair of overlapping frames contributes point correspondences.
+/// Each point is mapped through the mosaic into the other frame of its pair,
+/// and the distances to the corresponding points are minimized with Levenberg-Marquardt.
+/// This distributes the drift from chaining homographies over all frames, and closes loops when a frame overlaps
+/// with frames from much earlier in the sequence.
+///
+/// A residual only depends on the two frames in its pair, so the normal equations consist of 8x8 blocks,
+/// with a nonzero off-diagonal block for each pair. They are solved with a sparse Cholesky factorization.
+class MosaicOptimizer
+{
+public:
+  /// \brief Constructs the optimizer.
+  /// \param max_points_per_pair The correspondences for each pair are subsampled to at most this many points.
+  explicit MosaicOptimizer(int max_points_per_pair = 50);
+
+  /// \brief Adds a frame.
+  /// \param to_mosaic The initial homography from the frame to the mosaic.
+  /// \param fixed If true, the homography is not changed, which fixes the mosaic coordinate system.
+  ///              If no frames are fixed, the first frame is.
+  /// \return The index of the frame.
+  int addFrame(const Eigen::Matrix3f& to_mosaic, bool fixed = false);
+
+  /// \brief Adds corresponding points between two frames.
+  /// \param frame_a Index of the first frame.
+  /// \param frame_b Index of the second frame.
+  /// \param pts_a Points in the first frame.
+  /// \param pts_b The corresponding points in the second frame.
+  void addCorrespondences(int frame_a, int frame_b, const Eigen::Ref<const Eigen::Matrix2Xf>& pts_a,
+                          const Eigen::Ref<const Eigen::Matrix2Xf>& pts_b);
+
+  /// \return The number of frames.
+  int numFrames() const;
+
+  /// \return The number of frame pairs with correspondences.
+  int numPairs() const;
+
+  /// \brief Optimizes the homographies.
+  /// \param max_iterations The maximum number of Levenberg-Marquardt iterations.
+  /// \return The root mean square transfer error in pixels, after optimization.
+  double optimize(int max_iterations = 20);
+
+  /// \return The root mean square transfer error in pixels.
+  double rmsError() const;
+
+  /// \return The current homography from a frame to the mosaic.
+  Eigen::Matrix3f toMosaic(int frame) const;
+
+private:
+  struct FramePair
+  {
+    int frame_a;
+    int frame_b;
+    Eigen::Matrix3Xd pts_a;
+    Eigen::Matrix3Xd pts_b;
+  };
+
+  using Block = Eigen::Matrix<double, 8, 8>;
+  using BlockVector = Eigen::Matrix<double, 8, 1>;
+
+  /// \brief Computes the sum of squared residuals for the given homographies.
+  double computeCost(const std::vector<Eigen::Matrix3d>& homographies) const;
+
+  /// \brief Computes the normal equations J^T*J and J^T*r in the free parameters.
+  void buildNormalEquations(Eigen::SparseMatrix<double>& JtJ, Eigen::VectorXd& Jtr) const;
+
+  int max_points_per_pair_;
+  std::vector<Eigen::Matrix3d> homographies_;
+  std::vector<bool> fixed_;
+  std::vector<FramePair> pairs_;
+
+  /// \brief The index of the first parameter for each frame, or -1 if the frame is not optimized.
+  std::vector<int> parameter_offsets_;
+};
@@ -0,0 +1,155 @@
+#include "inlier_scorer.h"
+
+#include <cmath>
+
+SprtTest SprtTest::design(float epsilon, float delta, float hypothesis_cost)
+{
+  SprtTest test;
+  test.epsilon = epsilon;
+  test.delta = delta;
+  if (!(epsilon > delta && delta > 0.f && epsilon < 1.f))
+  {
+    return test;
+  }
+
+  test.log_inlier_factor = std::log(delta / epsilon);
+  test.log_outlier_factor = std::log((1.f - delta) / (1.f - epsilon));
+
+  // The expected increase of the log likelihood ratio per verified correspondence for a bad hypothesis.
+  const float C = (1.f - delta) * test.log_outlier_factor + delta * -test.log_inlier_factor;
+
+  // The threshold that minimizes the expected time to find a good hypothesis satisfies A = cost/C + 1 + log(A),
+  // which is solved by iterating from A = cost/C + 1 (Chum and Matas, Optimal randomized RANSAC, 2008).
+  float A = hypothesis_cost / C + 1.f;
+  for (int i = 0; i < 10; ++i)
+  {
+    A = hypothesis_cost / C + 1.f + std::log(A);
+  }
+  test.log_threshold = std::log(A);
+
+  return test;
+}
+
+bool SprtTest::active() const
+{
+  return std::isfinite(log_threshold);
+}
+
+float SprtTest::rejectionProbability() const
+{
+  return std::exp(-log_threshold);
+}
+
+void InlierScorer::setPoints(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                             const Eigen::Ref<const Eigen::Matrix2Xf>& pts2)
+{
+  num_points_ = pts1.cols();
+  if (x1_.size() < num_points_)
+  {
+    x1_.resize(num_points_);
+    y1_.resize(num_points_);
+    x2_.resize(num_points_);
+    y2_.resize(num_points_);
+  }
+
+  x1_.head(num_points_) = pts1.row(0).transpose();
+  y1_.head(num_points_) = pts1.row(1).transpose();
+  x2_.head(num_points_) = pts2.row(0).transpose();
+  y2_.head(num_points_) = pts2.row(1).transpose();
+}
+
+Eigen::Index InlierScorer::numPoints() const
+{
+  return num_points_;
+}
+
+Eigen::Index InlierScorer::countInliers(const Eigen::Matrix3f& H, const Eigen::Matrix3f& H_inv,
+                                        float distance_threshold, Eigen::Index num_points) const
+{
+  if (num_points < 0 || num_points > numPoints())
+  {
+    num_points = numPoints();
+  }
+
+  Eigen::Index num_inliers{0};
+  Block errors;
+
+  for (Eigen::Index start = 0; start < num_points; start += block_size)
+  {
+    const Eigen::Index size = std::min(block_size, num_points - start);
+    computeErrors(H, H_inv, start, size, errors);
+    num_inliers += (errors < distance_threshold).count();
+  }
+
+  return num_inliers;
+}
+
+bool InlierScorer::verifyInliers(const Eigen::Matrix3f& H, const Eigen::Matrix3f& H_inv, float distance_threshold,
+                                 const SprtTest& test, Eigen::Index& num_inliers, Eigen::Index& num_verified) const
+{
+  num_inliers = 0;
+  num_verified = 0;
+  float log_ratio = 0.f;
+  Block errors;
+
+  for (Eigen::Index start = 0; start < numPoints(); start += sprt_block_size)
+  {
+    const Eigen::Index size = std::min(sprt_block_size, numPoints() - start);
+    computeErrors(H, H_inv, start, size, errors);
+    const Eigen::Index block_inliers = (errors < distance_threshold).count();
+    num_inliers += block_inliers;
+    num_verified += size;
+
+    log_ratio += static_cast<float>(block_inliers) * test.log_inlier_factor +
+                 static_cast<float>(size - block_inliers) * test.log_outlier_factor;
+    if (log_ratio > test.log_threshold)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void InlierScorer::extractInliers(const Eigen::Matrix3f& H, const Eigen::Matrix3f& H_inv, float distance_threshold,
+                                  PointSelection& inliers) const
+{
+  inliers.clear();
+  Block errors;
+
+  for (Eigen::Index start = 0; start < numPoints(); start += block_size)
+  {
+    const Eigen::Index size = std::min(block_size, numPoints() - start);
+    computeErrors(H, H_inv, start, size, errors);
+
+    for (Eigen::Index i = 0; i < size; ++i)
+    {
+      if (errors(i) < distance_threshold)
+      {
+        inliers.push_back(start + i);
+      }
+    }
+  }
+}
+
+void InlierScorer::computeErrors(const Eigen::Matrix3f& H, const Eigen::Matrix3f& H_inv,
+                                 Eigen::Index start, Eigen::Index size, Block& errors) const
+{
+  const auto x1 = x1_.segment(start, size);
+  const auto y1 = y1_.segment(start, size);
+  const auto x2 = x2_.segment(start, size);
+  const auto y2 = y2_.segment(start, size);
+
+  // Map points in image 1 to image 2, and compute the distance to the corresponding points.
+  const Block w_1_in_2 = (H(2, 0)*x1 + H(2, 1)*y1 + H(2, 2)).inverse();
+  const Block dx_1_in_2 = (H(0, 0)*x1 + H(0, 1)*y1 + H(0, 2))*w_1_in_2 - x2;
+  const Block dy_1_in_2 = (H(1, 0)*x1 + H(1, 1)*y1 + H(1, 2))*w_1_in_2 - y2;
+
+  // Map points in image 2 to image 1, and compute the distance to the corresponding points.
+  const Block w_2_in_1 = (H_inv(2, 0)*x2 + H_inv(2, 1)*y2 + H_inv(2, 2)).inverse();
+  const Block dx_2_in_1 = (H_inv(0, 0)*x2 + H_inv(0, 1)*y2 + H_inv(0, 2))*w_2_in_1 - x1;
+  const Block dy_2_in_1 = (H_inv(1, 0)*x2 + H_inv(1, 1)*y2 + H_inv(1, 2))*w_2_in_1 - y1;
+
+  // The two-sided reprojection error.
+  errors = (dx_1_in_2.square() + dy_1_in_2.square()).sqrt() + (dx_2_in_1.square() + dy_2_in_1.square()).sqrt();
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "Eigen/Dense"
+#include <limits>
+#include <vector>
+
+using PointSelection = std::vector<Eigen::Index>;
+
+/// \brief Wald's sequential probability ratio test (SPRT) for rejecting bad hypotheses after verifying a few points.
+///
+/// Each verified correspondence multiplies the likelihood ratio of the hypothesis being bad versus good
+/// by delta/epsilon if it is an inlier, and by (1 - delta)/(1 - epsilon) if it is not.
+/// The hypothesis is rejected as soon as the ratio exceeds the threshold A,
+/// so a good hypothesis is rejected with a probability of at most 1/A.
+struct SprtTest
+{
+  /// \brief The probability that a correspondence is an inlier for a good hypothesis.
+  float epsilon{0.f};
+
+  /// \brief The probability that a correspondence is consistent with a bad hypothesis.
+  float delta{0.f};
+
+  /// \brief The logarithm of the decision threshold A, which is infinite for a test that never rejects anything.
+  float log_threshold{std::numeric_limits<float>::infinity()};
+
+  /// \brief The logarithm of the factor for an inlier, which is negative.
+  float log_inlier_factor{0.f};
+
+  /// \brief The logarithm of the factor for an outlier, which is positive.
+  float log_outlier_factor{0.f};
+
+  /// \brief Designs the test with the optimal threshold for given probabilities.
+  /// \param epsilon The probability that a correspondence is an inlier for a good hypothesis.
+  /// \param delta The probability that a correspondence is consistent with a bad hypothesis.
+  /// \param hypothesis_cost The time to generate a hypothesis, in units of the time to verify one correspondence.
+  /// \return The test, which never rejects anything if epsilon is not larger than delta.
+  static SprtTest design(float epsilon, float delta, float hypothesis_cost);
+
+  /// \return False if the test never rejects anything.
+  bool active() const;
+
+  /// \return An upper bound on the probability that a good hypothesis is rejected, which is 1/A.
+  float rejectionProbability() const;
+};
+
+/// \brief Scores homography hypotheses against a fixed set of point correspondences.
+///
+/// The correspondences are stored once in a structure-of-arrays layout,
+/// so that the two-sided reprojection error for all points can be computed with vectorized array expressions.
+/// Scoring a hypothesis does not allocate any memory,
+/// and the arrays are only reallocated when a larger set of points than before is stored.
+class InlierScorer
+{
+public:
+  /// \brief Stores the point correspondences to score against.
+  /// \param pts1 Set of corresponding points from image 1.
+  /// \param pts2 Set of corresponding points from image 2.
+  void setPoints(const Eigen::Ref<const Eigen::Matrix2Xf>& pts1, const Eigen::Ref<const Eigen::Matrix2Xf>& pts2);
+
+  /// \return The number of stored point correspondences.
+  Eigen::Index numPoints() const;
+
+  /// \brief Counts the correspondences that are inliers for a homography.
+  /// \param H The homography mapping points in image 1 to image 2.
+  /// \param H_inv The inverse of H.
+  /// \param distance_threshold The maximum two-sided reprojection error for an inlier.
+  /// \param num_points Only score the first num_points correspondences, or all if negative.
+  /// \return The number of inliers.
+  Eigen::Index countInliers(const Eigen::Matrix3f& H, const Eigen::Matrix3f& H_inv, float distance_threshold,
+                            Eigen::Index num_points = -1) const;
+
+  /// \brief Counts the inliers for a homography, but stops as soon as the SPRT rejects it.
+  /// The correspondences are verified in small blocks, and the test is applied after each block.
+  /// \param H The homography mapping points in image 1 to image 2.
+  /// \param H_inv The inverse of H.
+  /// \param distance_threshold The maximum two-sided reprojection error for an inlier.
+  /// \param test The test to apply.
+  /// \param[out] num_inliers The number of inliers among the verified correspondences.
+  /// \param[out] num_verified The number of verified correspondences.
+  /// \return True if the homography was accepted, in which case all correspondences have been verified.
+  bool verifyInliers(const Eigen::Matrix3f& H, const Eigen::Matrix3f& H_inv, float distance_threshold,
+                     const SprtTest& test, Eigen::Index& num_inliers, Eigen::Index& num_verified) const;
+
+  /// \brief Extracts the indices of the correspondences that are inliers for a homography.
+  /// \param H The homography mapping points in image 1 to image 2.
+  /// \param H_inv The inverse of H.
+  /// \param distance_threshold The maximum two-sided reprojection error for an inlier.
+  /// \param[out] inliers The indices of the inliers.
+  void extractInliers(const Eigen::Matrix3f& H, const Eigen::Matrix3f& H_inv, float distance_threshold,
+                      PointSelection& inliers) const;
+
+private:
+  /// \brief Points are processed in blocks of this size, which lets the intermediate results live on the stack.
+  static constexpr Eigen::Index block_size = 128;
+  using Block = Eigen::Array<float, Eigen::Dynamic, 1, Eigen::ColMajor, block_size, 1>;
+
+  /// \brief Points are verified in smaller blocks with the SPRT, so that bad hypotheses are rejected sooner.
+  static constexpr Eigen::Index sprt_block_size = 32;
+
+  /// \brief Computes the two-sided reprojection error for a block of points.
+  void computeErrors(const Eigen::Matrix3f& H, const Eigen::Matrix3f& H_inv,
+                     Eigen::Index start, Eigen::Index size, Block& errors) const;
+
+  Eigen::ArrayXf x1_;
+  Eigen::ArrayXf y1_;
+  Eigen::ArrayXf x2_;
+  Eigen::ArrayXf y2_;
+  Eigen::Index num_points_{0};
+};
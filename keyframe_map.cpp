@@ -0,0 +1,210 @@
+#include "keyframe_map.h"
+
+#include "opencv2/core/hal/hal.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+KeyframeMap::KeyframeMap(int num_tables, int key_bits, std::uint32_t seed)
+    : num_tables_{num_tables}
+    , key_bits_{key_bits}
+    , seed_{seed}
+    , descriptor_bytes_{0}
+    , visit_stamp_{0}
+{
+  if (num_tables_ < 1 || key_bits_ < 1 || key_bits_ > 24)
+  {
+    throw std::invalid_argument("Invalid LSH parameters");
+  }
+}
+
+void KeyframeMap::clear()
+{
+  keyframes_.clear();
+  descriptors_.clear();
+  owners_.clear();
+  for (auto& table : tables_)
+  {
+    for (auto& bucket : table)
+    {
+      bucket.clear();
+    }
+  }
+}
+
+size_t KeyframeMap::size() const
+{
+  return keyframes_.size();
+}
+
+bool KeyframeMap::empty() const
+{
+  return keyframes_.empty();
+}
+
+std::shared_ptr<const Reference> KeyframeMap::addKeyframe(std::shared_ptr<Reference> keyframe)
+{
+  // Only binary descriptors are indexed.
+  const bool indexed = !keyframe->descriptors.empty() && keyframe->descriptors.type() == CV_8UC1;
+  if (indexed)
+  {
+    if (!keyframe->descriptors.isContinuous())
+    {
+      keyframe->descriptors = keyframe->descriptors.clone();
+    }
+
+    if (tables_.empty())
+    {
+      createTables(keyframe->descriptors.cols);
+    }
+    else if (keyframe->descriptors.cols != descriptor_bytes_)
+    {
+      throw std::invalid_argument("All keyframes must have descriptors of the same size");
+    }
+  }
+
+  keyframe->id = static_cast<int>(keyframes_.size());
+  keyframes_.push_back(keyframe);
+
+  // Index the descriptors.
+  for (int row = 0; indexed && row < keyframe->descriptors.rows; ++row)
+  {
+    const auto index = static_cast<std::uint32_t>(descriptors_.size());
+    const uchar* descriptor = keyframe->descriptors.ptr<uchar>(row);
+    descriptors_.push_back(descriptor);
+    owners_.push_back(keyframe->id);
+
+    for (int table = 0; table < num_tables_; ++table)
+    {
+      tables_[table][hashKey(descriptor, table)].push_back(index);
+    }
+  }
+
+  return keyframes_.back();
+}
+
+const std::shared_ptr<const Reference>& KeyframeMap::keyframe(int id) const
+{
+  return keyframes_.at(id);
+}
+
+std::shared_ptr<const Reference> KeyframeMap::findNearest(const cv::Mat& descriptors, int max_distance)
+{
+  if (keyframes_.empty() || descriptors.empty())
+  {
+    return nullptr;
+  }
+
+  // Float descriptors are not indexed, so the most recent keyframe is the best guess.
+  if (descriptors.depth() != CV_8U)
+  {
+    return keyframes_.back();
+  }
+
+  if (tables_.empty())
+  {
+    return nullptr;
+  }
+
+  if (descriptors.type() != CV_8UC1 || descriptors.cols != descriptor_bytes_)
+  {
+    throw std::invalid_argument("Query descriptors do not match the indexed descriptors");
+  }
+
+  visited_.resize(descriptors_.size(), visit_stamp_);
+  votes_.assign(keyframes_.size(), 0);
+
+  for (int row = 0; row < descriptors.rows; ++row)
+  {
+    const uchar* query = descriptors.ptr<uchar>(row);
+
+    // Mark the descriptors compared against this query, without having to clear the marks afterwards.
+    if (++visit_stamp_ == 0)
+    {
+      std::fill(visited_.begin(), visited_.end(), 0);
+      visit_stamp_ = 1;
+    }
+
+    int best_distance = max_distance + 1;
+    int best_owner = -1;
+
+    for (int table = 0; table < num_tables_; ++table)
+    {
+      const std::uint32_t key = hashKey(query, table);
+
+      // Probe the bucket with the same key, and the buckets with keys that differ in one bit.
+      for (int probe = -1; probe < key_bits_; ++probe)
+      {
+        const std::uint32_t probe_key = probe < 0 ? key : (key ^ (1u << probe));
+
+        for (const std::uint32_t index : tables_[table][probe_key])
+        {
+          if (visited_[index] == visit_stamp_)
+          { continue; }
+          visited_[index] = visit_stamp_;
+
+          const int distance = cv::hal::normHamming(query, descriptors_[index], descriptor_bytes_);
+          if (distance < best_distance)
+          {
+            best_distance = distance;
+            best_owner = owners_[index];
+          }
+        }
+      }
+    }
+
+    if (best_owner >= 0)
+    {
+      ++votes_[best_owner];
+    }
+  }
+
+  // Choose the keyframe with most votes, preferring the most recent one.
+  int nearest = -1;
+  for (int id = 0; id < static_cast<int>(votes_.size()); ++id)
+  {
+    if (votes_[id] > 0 && (nearest < 0 || votes_[id] >= votes_[nearest]))
+    {
+      nearest = id;
+    }
+  }
+
+  return nearest < 0 ? nullptr : keyframes_[nearest];
+}
+
+void KeyframeMap::createTables(int descriptor_bytes)
+{
+  descriptor_bytes_ = descriptor_bytes;
+  const int descriptor_bits = 8 * descriptor_bytes_;
+  if (descriptor_bits < key_bits_)
+  {
+    throw std::invalid_argument("Descriptors are too short for the LSH key size");
+  }
+
+  // Each table uses a different random subset of the descriptor bits.
+  std::mt19937 generator{seed_};
+  std::vector<int> bits(descriptor_bits);
+  std::iota(bits.begin(), bits.end(), 0);
+
+  key_bit_positions_.resize(num_tables_);
+  tables_.resize(num_tables_);
+  for (int table = 0; table < num_tables_; ++table)
+  {
+    std::shuffle(bits.begin(), bits.end(), generator);
+    key_bit_positions_[table].assign(bits.begin(), bits.begin() + key_bits_);
+    tables_[table].resize(size_t{1} << key_bits_);
+  }
+}
+
+std::uint32_t KeyframeMap::hashKey(const uchar* descriptor, int table) const
+{
+  std::uint32_t key = 0;
+  for (const int bit : key_bit_positions_[table])
+  {
+    key = (key << 1) | ((descriptor[bit / 8] >> (bit % 8)) & 1u);
+  }
+
+  return key;
+}
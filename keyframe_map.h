@@ -0,0 +1,99 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+#include "opencv2/features2d.hpp"
+#include "Eigen/Dense"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/// \brief A registered image that frames are matched against.
+struct Reference
+{
+  /// \brief The id of the keyframe in its map.
+  int id{0};
+
+  /// \brief The id of the frame the keyframe was made from.
+  int frame_id{0};
+
+  cv::Mat image;
+
+  /// \brief The gray image at full resolution, for refining coarse-to-fine registrations.
+  cv::Mat gray_image;
+  std::vector<cv::KeyPoint> keypoints;
+  cv::Mat descriptors;
+
+  /// \brief Homography mapping pixels in this image to the mosaic frame.
+  Eigen::Matrix3f to_mosaic{Eigen::Matrix3f::Identity()};
+};
+
+/// \brief A collection of keyframes, with an index over their binary descriptors.
+///
+/// The descriptors are indexed with multi-probe locality sensitive hashing (LSH).
+/// Each hash table uses a random subset of the descriptor bits as key,
+/// and a query probes the bucket with the same key as well as the buckets with keys that differ in one bit.
+/// This finds the keyframe most similar to a query image without comparing it against every keyframe.
+/// Keyframes with float descriptors, such as SIFT, are kept but not indexed.
+class KeyframeMap
+{
+public:
+  /// \brief Constructs an empty map.
+  /// \param num_tables Number of hash tables.
+  /// \param key_bits Number of descriptor bits in each hash key.
+  /// \param seed Seed for choosing the key bits.
+  explicit KeyframeMap(int num_tables = 6, int key_bits = 14, std::uint32_t seed = 5030);
+
+  /// \brief Removes all keyframes.
+  void clear();
+
+  /// \return The number of keyframes.
+  size_t size() const;
+
+  /// \return True if there are no keyframes.
+  bool empty() const;
+
+  /// \brief Adds a keyframe, and indexes its descriptors.
+  /// \param keyframe The keyframe. Its descriptors are indexed if they are binary. Its id is set by the map.
+  /// \return The added keyframe.
+  std::shared_ptr<const Reference> addKeyframe(std::shared_ptr<Reference> keyframe);
+
+  /// \return The keyframe with the given id.
+  const std::shared_ptr<const Reference>& keyframe(int id) const;
+
+  /// \brief Finds the keyframe with most descriptors similar to the query descriptors, through the index.
+  /// \param descriptors Query descriptors, one per row.
+  /// \param max_distance Maximum Hamming distance for a descriptor to vote for a keyframe.
+  /// \return The nearest keyframe, or nullptr if no keyframe got any votes.
+  ///         For float descriptors, which are not indexed, the most recent keyframe is returned.
+  std::shared_ptr<const Reference> findNearest(const cv::Mat& descriptors, int max_distance = 50);
+
+private:
+  /// \brief Chooses the key bits, once the descriptor size is known.
+  void createTables(int descriptor_bytes);
+
+  /// \brief Computes the hash key for a descriptor in a table.
+  std::uint32_t hashKey(const uchar* descriptor, int table) const;
+
+  int num_tables_;
+  int key_bits_;
+  std::uint32_t seed_;
+  int descriptor_bytes_;
+
+  std::vector<std::shared_ptr<const Reference>> keyframes_;
+
+  /// \brief The descriptor bits used as key in each table.
+  std::vector<std::vector<int>> key_bit_positions_;
+
+  /// \brief For each table, the indices of the descriptors in each bucket.
+  std::vector<std::vector<std::vector<std::uint32_t>>> tables_;
+
+  /// \brief All indexed descriptors, and the keyframe each of them belongs to.
+  std::vector<const uchar*> descriptors_;
+  std::vector<int> owners_;
+
+  /// \brief Scratch space for queries, so that each descriptor is only compared once per query descriptor.
+  std::vector<std::uint32_t> visited_;
+  std::uint32_t visit_stamp_;
+  std::vector<int> votes_;
+};
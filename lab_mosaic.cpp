@@ -1,7 +1,8 @@
 #include "lab_mosaic.h"
 
-#include "homography_estimator.h"
-#include "feature_utils.h"
+#include "metrics.h"
+#include "mosaic_canvas.h"
+#include "mosaic_pipeline.h"
 
 #include "opencv2/highgui.hpp"
 #include "opencv2/imgproc.hpp"
@@ -11,10 +12,7 @@
 
 #include <chrono>
 #include <iomanip>
-
-// Make shorthand aliases for timing tools.
-using Clock = std::chrono::high_resolution_clock;
-using DurationInMs = std::chrono::duration<double, std::milli>;
+#include <iostream>
 
 // Forward declarations of ugly drawing functions.
 void drawKeypointDetections(cv::Mat& vis_img,
@@ -33,24 +31,49 @@ void drawKeypointMatches(cv::Mat& vis_img,
 
 void drawEstimationDetails(cv::Mat& vis_img, DurationInMs est_duration, size_t num_inliers);
 
+void drawPipelineDetails(cv::Mat& vis_img, MosaicPipeline& pipeline, DurationInMs frame_latency, FramePath path);
+
+
+PipelineSettings liveSettings(const FeatureSettings& features, DurationInMs frame_budget, bool refine_homographies,
+                              bool sprt)
+{
+  // The camera is a live source, so frames are dropped if the pipeline falls behind.
+  // Consecutive frames are similar, so most frames are registered by tracking the previous inliers.
+  // When keypoints are detected, they are spread over the image with a grid.
+  // High resolution frames are registered coarse-to-fine, so that the latency stays close to that of 640x480 frames.
+  // With a frame budget, the pipeline limits RANSAC and the number of keypoints to keep each frame within it.
+  PipelineSettings settings;
+  settings.live_source = true;
+  settings.tracking = true;
+  settings.features = features;
+  settings.detection = DetectionStrategy::grid;
+  settings.coarse_width = 640;
+  settings.frame_budget = frame_budget;
+  settings.refine_homographies = refine_homographies;
+  settings.sprt = sprt;
+  return settings;
+}
 
-void runLabMosaic()
+void runLabMosaic(const FeatureSettings& features, cv::Size frame_size, RecordingWriter* recording,
+                  TileExporter* tiles, DurationInMs frame_budget, bool refine_homographies, bool sprt)
 {
   // Open video stream from camera.
   const int camera_id = 0; // Should be 0 or 1 on the lab PCs.
   cv::VideoCapture cap(camera_id);
 
   // Set frame size.
-  const int frame_cols = 640;
-  const int frame_rows = 480;
-  cap.set(cv::CAP_PROP_FRAME_WIDTH, frame_cols);
-  cap.set(cv::CAP_PROP_FRAME_HEIGHT, frame_rows);
+  cap.set(cv::CAP_PROP_FRAME_WIDTH, frame_size.width);
+  cap.set(cv::CAP_PROP_FRAME_HEIGHT, frame_size.height);
 
   if (!cap.isOpened())
   {
     throw std::runtime_error("Could not open camera " + std::to_string(camera_id));
   }
 
+  // The camera may not support the requested size.
+  const int frame_cols = static_cast<int>(cap.get(cv::CAP_PROP_FRAME_WIDTH));
+  const int frame_rows = static_cast<int>(cap.get(cv::CAP_PROP_FRAME_HEIGHT));
+
   // Set up windows.
   const std::string match_win = "Feature detection and matching";
   cv::namedWindow(match_win);
@@ -64,131 +87,193 @@ void runLabMosaic()
       0.0f, 0.5f, 0.25f * static_cast<float>(frame_rows),
       0.0f, 0.0f, 1.0f};
 
-  // Todo 1: Experiment with blob and corner feature detectors.
-  // Todo 3: Experiment with feature matching
-  // Set up objects for detection, description and matching.
-  cv::Ptr<cv::Feature2D> detector = cv::ORB::create(1000);
-  cv::Ptr<cv::Feature2D> desc_extractor = cv::ORB::create();
-  cv::BFMatcher matcher{desc_extractor->defaultNorm()};
-
-  // Create homography estimator.
-  HomographyEstimator estimator;
-
-  // Reference image for mosaic.
-  cv::Mat ref_image;
-  std::vector<cv::KeyPoint> ref_keypoints;
-  cv::Mat ref_descriptors;
-
-  while (true)
+  // Run capture, feature extraction and matching/estimation on separate threads.
+  MosaicPipeline pipeline([&cap](cv::Mat& frame) { return cap.read(frame); },
+                          liveSettings(features, frame_budget, refine_homographies, sprt));
+  pipeline.start();
+  StageStats& compositing_stats = pipeline.stats(PipelineStage::compositing);
+
+  // The mosaic is built up in a tiled canvas, and the displayed image is only updated where the canvas changes.
+  // New frames are feathered into the mosaic, which hides most seams and is fast enough for live video.
+  MosaicCanvas canvas{256, CV_8UC3, BlendMode::feather};
+  cv::Mat mosaic;
+  cv::Rect mosaic_region;
+  std::uint64_t mosaic_version{0};
+
+#ifdef LAB_MOSAIC_ENABLE_METRICS
+  // Print rolling latency statistics for each event regularly.
+  constexpr std::chrono::seconds metrics_interval{5};
+  auto last_metrics_time = Clock::now();
+#endif
+
+  // Starts a new, empty mosaic.
+  const auto clear_mosaic = [&]()
   {
-    // Read a frame from the camera.
-    cv::Mat frame;
-    cap >> frame;
-
-    if (frame.empty())
-    { break; }
-
-    // Convert frame to gray scale image.
-    cv::Mat gray_frame;
-    cv::cvtColor(frame, gray_frame, cv::COLOR_BGR2GRAY);
-
-    // Detect keypoints.
-    // Measure how long the processing takes.
-    auto start = Clock::now();
-    std::vector<cv::KeyPoint> frame_keypoints;
-    detector->detect(gray_frame, frame_keypoints);
-    cv::KeyPointsFilter::retainBest(frame_keypoints, 1000);
-    auto end = Clock::now();
-    DurationInMs feature_detection_duration = end - start;
+    canvas.clear();
+    mosaic = cv::Mat{};
+    if (tiles)
+    { tiles->clear(); }
+  };
+
+  // Composite and show the processed frames on this thread.
+  // The visualization image is reused between frames.
+  // A space pressed while waiting for a frame is kept until the next frame, since setting the reference needs a frame.
+  FramePtr data;
+  cv::Mat vis_img;
+  int pending_key = -1;
+  while (!pipeline.finished())
+  {
+    if (!pipeline.tryPopResult(data))
+    {
+      // Keep the windows responsive while waiting for the next frame.
+      // Resetting and quitting do not need a frame, so they are handled at once, also when the camera stalls.
+      const int key = cv::waitKey(1);
+      if (key == ' ')
+      { pending_key = key; }
+      else if (key == 'r')
+      {
+        pipeline.clearReference();
+        clear_mosaic();
+        pending_key = -1;
+      }
+      else if (key > 0)
+      { break; }
+      continue;
+    }
 
-    // Create image for visualization.
-    cv::Mat vis_img;
+    const auto start = Clock::now();
+    bool skipped = false;
 
-    if (ref_descriptors.empty())
+    if (!data->reference)
     {
       // No reference image, draw keypoints.
       // (Press space to create a reference image).
-      drawKeypointDetections(vis_img, frame, frame_keypoints, feature_detection_duration);
+      drawKeypointDetections(vis_img, data->frame, data->keypoints, data->detection_duration);
     }
     else
     {
-      // We have a reference, try to match features!
-      cv::Mat frame_descriptors;
-      std::vector<std::vector<cv::DMatch>> matches;
-
-      // Match descriptors with ratio test.
-      // Measure how long the processing takes.
-      start = Clock::now();
-      desc_extractor->compute(gray_frame, frame_keypoints, frame_descriptors);
-      matcher.knnMatch(frame_descriptors, ref_descriptors, matches, 2);
-      std::vector<cv::DMatch> good_matches = extractGoodRatioMatches(matches, 0.8f);
-      end = Clock::now();
-      DurationInMs feature_matching_duration = end - start;
-
       // Draw matching results.
-      drawKeypointMatches(vis_img, frame, ref_image, frame_keypoints, ref_keypoints, good_matches, feature_detection_duration, feature_matching_duration);
+      drawKeypointMatches(vis_img, data->frame, data->reference->image, data->keypoints, data->reference->keypoints,
+                          data->good_matches, data->detection_duration,
+                          data->description_duration + data->matching_duration);
 
-      if (good_matches.size() >= 10)
+      if (data->estimated)
       {
-        // Extract pixel coordinates for corresponding points.
-        Eigen::Matrix2Xf matching_pts1;
-        Eigen::Matrix2Xf matching_pts2;
-        extractMatchingPoints(frame_keypoints, ref_keypoints, good_matches, matching_pts1, matching_pts2);
-
-        // Estimate homography.
-        // Measure how long the processing takes.
-        start = Clock::now();
-        HomographyEstimate estimate = estimator.estimate(matching_pts1, matching_pts2);
-        end = Clock::now();
-        DurationInMs estimation_duration = end - start;
-
-        // Convert the homography estimate to OpenCV matrix.
-        cv::Matx33f H_cv;
-        cv::eigen2cv(estimate.homography, H_cv);
-
-        // Todo 7: Transform the reference image according to the similarity S, and insert into the mosaic.
-        cv::Mat mosaic;
-
-        // Todo 8: Transform the current frame according to S and the computed homography.
-        cv::Mat frame_warp;
-
-        // Todo 9: Compute a mask for the transformed current frame.
-        cv::Mat mask = cv::Mat::ones(frame.size(), CV_8UC1);
-        cv::Mat mask_warp;
-
-        //Todo 10: Insert the current frame into the mosaic.
+        // Insert the current frame into the mosaic, transformed according to S and the homography to the mosaic.
+        // Frames matched against an older reference do not belong in the current mosaic.
+        // Frames that would miss their deadline are skipped, while the pipeline keeps tracking the following frames.
+        const bool in_mosaic = data->registered && data->map_generation == pipeline.mapGeneration();
+        skipped = in_mosaic &&
+            !pipeline.meetsDeadline(*data, DurationInMs{compositing_stats.latency_ms.load(std::memory_order_relaxed)});
+        if (in_mosaic && !skipped)
+        {
+          LAB_MOSAIC_SCOPED_TIMER(TimedEvent::compositing);
+
+          // Convert the homography to OpenCV matrix.
+          cv::Matx33f H_cv;
+          cv::eigen2cv(data->to_mosaic, H_cv);
+
+          canvas.insert(data->frame, S_cv * H_cv);
+        }
+        else
+        {
+          compositing_stats.num_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
 
         // Draw estimation duration.
-        drawEstimationDetails(vis_img, estimation_duration, estimate.num_inliers);
+        drawEstimationDetails(vis_img, data->estimation_duration, data->estimate.num_inliers);
+
+        // Update the mosaic image with the tiles that have changed, and show it.
+        if (mosaic_region != canvas.bounds())
+        {
+          mosaic_region = canvas.bounds();
+          mosaic = cv::Mat{};
+        }
+        canvas.render(mosaic_region, mosaic, mosaic_version);
+        mosaic_version = canvas.version();
 
-        // Show mosaicking result.
         if (!mosaic.empty())
         { cv::imshow(mosaic_win, mosaic); }
+
+        // Export the changed tiles, unless the previous export is still being written.
+        if (tiles)
+        { tiles->exportChanges(canvas); }
       }
     }
 
-    // Show feature matching visualization.
+    compositing_stats.record(Clock::now() - start);
+    pipeline.recordDeadline(*data, skipped);
+
+#ifdef LAB_MOSAIC_ENABLE_METRICS
+    if (Clock::now() - last_metrics_time > metrics_interval)
+    {
+      last_metrics_time = Clock::now();
+      writeSummariesCsv(std::cout, Metrics::instance().drainSummaries());
+    }
+#endif
+
+    // Draw stage latencies and queue depths, and show feature matching visualization.
+    drawPipelineDetails(vis_img, pipeline, Clock::now() - data->capture_time, data->path);
     cv::imshow(match_win, vis_img);
 
     // Draw figures and receive key presses.
-    int key = cv::waitKey(30);
+    // The pipeline runs in parallel, so we do not need to wait here.
+    // A space pressed while waiting for this frame is handled now, unless another key has been pressed since.
+    int key = cv::waitKey(1);
+    if (key <= 0)
+    { key = pending_key; }
+    pending_key = -1;
+
     if (key == ' ')
     {
-      // Set reference image for mosaic
-      // and compute descriptors.
-      ref_image = frame.clone();
-      ref_keypoints = frame_keypoints;
-      desc_extractor->compute(gray_frame, ref_keypoints, ref_descriptors);
+      // Set reference image for mosaic.
+      // The descriptors of a detected frame have already been computed, while a tracked frame is detected now.
+      // A frame without keypoints cannot be the reference, so the current mosaic is kept.
+      if (pipeline.setReference(*data))
+      {
+        // Start a new mosaic, with the reference image transformed according to the similarity S.
+        clear_mosaic();
+        canvas.insert(data->frame, S_cv);
+      }
     }
     else if (key == 'r')
     {
       // Reset.
       // Make all reference data empty.
-      ref_image = cv::Mat{};
-      ref_keypoints.clear();
-      ref_descriptors = cv::Mat{};
+      pipeline.clearReference();
+      clear_mosaic();
+    }
+
+    // Record the frame after it may have become the reference,
+    // so that the keypoints and descriptors detected for a tracked reference are in the recording.
+    if (recording)
+    {
+      recording->append(*data);
     }
-    else if (key > 0) break;
+
+    if (key > 0 && key != ' ' && key != 'r')
+    { break; }
+
+    // Return the frame to the pipeline, so that its buffers are reused for the next frames.
+    pipeline.recycle(data);
+  }
+
+  pipeline.stop();
+
+  if (frame_budget > DurationInMs{0})
+  {
+    const DeadlineStats& deadlines = pipeline.deadlineStats();
+    std::cout << "Frames within the " << frame_budget.count() << "ms budget: " << deadlines.num_met.load()
+              << ", late: " << deadlines.num_missed.load()
+              << ", skipped to keep the budget: " << deadlines.num_skipped.load()
+              << ", RANSAC stopped by the budget: " << deadlines.num_ransac_stopped.load() << std::endl;
+  }
+
+  // Write the final changes.
+  if (tiles)
+  {
+    tiles->exportChanges(canvas, true);
+    tiles->flush();
   }
 }
 
@@ -252,3 +337,41 @@ void drawEstimationDetails(cv::Mat& vis_img, DurationInMs est_duration, size_t n
   cv::putText(vis_img, inlier_info.str(), {10, 80}, font::face, font::scale, color::red);
 
 }
+
+void drawPipelineDetails(cv::Mat& vis_img, MosaicPipeline& pipeline, DurationInMs frame_latency, FramePath path)
+{
+  int y = 100;
+  for (const auto stage : {PipelineStage::capture, PipelineStage::features, PipelineStage::matching, PipelineStage::compositing})
+  {
+    const StageStats& stats = pipeline.stats(stage);
+
+    std::stringstream stage_info;
+    stage_info << std::fixed << std::setprecision(1);
+    stage_info << stageName(stage) << ": " << stats.latency_ms.load() << "ms"
+               << ", queue " << pipeline.queueSize(stage)
+               << ", dropped " << stats.num_dropped.load();
+    cv::putText(vis_img, stage_info.str(), {10, y}, font::face, font::scale, color::red);
+    y += 20;
+  }
+
+  std::stringstream latency_info;
+  latency_info << std::fixed << std::setprecision(0);
+  latency_info << "Latency: " << frame_latency.count() << "ms";
+  cv::putText(vis_img, latency_info.str(), {10, y}, font::face, font::scale, color::red);
+  y += 20;
+
+  std::stringstream path_info;
+  path_info << "Path: " << pathName(path);
+  cv::putText(vis_img, path_info.str(), {10, y}, font::face, font::scale, color::red);
+
+  // Deadlines are only counted when there is a frame budget.
+  const DeadlineStats& deadlines = pipeline.deadlineStats();
+  if (deadlines.num_met.load() + deadlines.num_missed.load() + deadlines.num_skipped.load() > 0)
+  {
+    y += 20;
+    std::stringstream deadline_info;
+    deadline_info << "Deadline: met " << deadlines.num_met.load() << ", missed " << deadlines.num_missed.load()
+                  << ", skipped " << deadlines.num_skipped.load() << ", keypoints " << pipeline.keypointBudget();
+    cv::putText(vis_img, deadline_info.str(), {10, y}, font::face, font::scale, color::red);
+  }
+}
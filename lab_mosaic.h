@@ -1,3 +1,29 @@
 #pragma once
 
-void runLabMosaic();
+#include "feature_config.h"
+#include "mosaic_pipeline.h"
+#include "recording.h"
+#include "tile_exporter.h"
+
+/// \brief Makes the pipeline settings for the interactive mosaic.
+/// Replays of its recordings use them as well, so that the frames are processed the same way.
+/// \param features The keypoint detector, descriptor extractor and matcher.
+/// \param frame_budget If positive, each frame should be shown within this time from when it was captured.
+/// \param refine_homographies If true, homographies are refined after RANSAC, see PipelineSettings::refine_homographies.
+/// \param sprt If true, RANSAC rejects bad hypotheses early with the SPRT, see PipelineSettings::sprt.
+PipelineSettings liveSettings(const FeatureSettings& features = FeatureSettings{},
+                              DurationInMs frame_budget = DurationInMs{0}, bool refine_homographies = true,
+                              bool sprt = true);
+
+/// \brief Runs the interactive mosaic from the camera.
+/// \param features The keypoint detector, descriptor extractor and matcher.
+/// \param frame_size The frame size to request from the camera.
+/// \param recording If set, the processed frames are recorded to it.
+/// \param tiles If set, the mosaic is exported to it as a tile pyramid while it is built.
+/// \param frame_budget If positive, each frame should be shown within this time from when it was captured.
+///                     Frames that would be late are not composited, but are still tracked.
+/// \param refine_homographies If true, homographies are refined after RANSAC, see PipelineSettings::refine_homographies.
+/// \param sprt If true, RANSAC rejects bad hypotheses early with the SPRT, see PipelineSettings::sprt.
+void runLabMosaic(const FeatureSettings& features = FeatureSettings{}, cv::Size frame_size = cv::Size{640, 480},
+                  RecordingWriter* recording = nullptr, TileExporter* tiles = nullptr,
+                  DurationInMs frame_budget = DurationInMs{0}, bool refine_homographies = true, bool sprt = true);
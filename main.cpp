@@ -1,20 +1,173 @@
+#include "batch_mosaic.h"
+#include "feature_tuning.h"
 #include "lab_mosaic.h"
+#include "recording.h"
+#include "replay.h"
+#include "tile_exporter.h"
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
-int main()
+namespace
+{
+void printUsage(const char* program)
+{
+  std::cerr << "Usage:" << std::endl
+            << "  " << program << "                                 Live mosaic from the camera" << std::endl
+            << "  " << program << " --batch <input> <output_dir>    Stitch a video file or image directory" << std::endl
+            << "      [--optimize]                                Jointly optimize all homographies before compositing" << std::endl
+            << "  " << program << " --tune <input> [<output_csv>]   Measure latency and inliers for feature configurations" << std::endl
+            << "  " << program << " --replay <recording> [<stage>]  Profile the stages from detection, matching (default)" << std::endl
+            << "                                                  or estimation on recorded data" << std::endl
+            << "Options:" << std::endl
+            << "  --features <file>                               Read the feature configuration from a YAML or JSON file" << std::endl
+            << "  --record <file.lmrec>                           Record the features, matches and homographies (live and batch)" << std::endl
+            << "  --record-frames                                 Record the raw frames as well" << std::endl
+            << "  --frame-size <width>x<height>                   The camera frame size in live mode (default 640x480)" << std::endl
+            << "  --tiles <dir>                                   Export the mosaic as a tile pyramid while it is built (live and batch)" << std::endl
+            << "  --no-refine                                     Do not refine the homographies after RANSAC (live, batch and replay)" << std::endl
+            << "  --no-sprt                                       Score every RANSAC hypothesis on all points (live, batch and replay)" << std::endl
+            << "  --budget <ms>                                   Show each frame within this time from capture, or skip it (live)" << std::endl
+            << "The input for --batch and --tune may also be a recording with frames." << std::endl;
+}
+
+/// \brief Parses a frame size such as "1920x1080". Throws std::invalid_argument if it is not a valid size.
+cv::Size parseFrameSize(const std::string& text)
+{
+  int width = 0;
+  int height = 0;
+  char separator = 0;
+  std::istringstream stream{text};
+  if (!(stream >> width >> separator >> height) || separator != 'x' || width <= 0 || height <= 0 || !stream.eof())
+  {
+    throw std::invalid_argument("Invalid frame size \"" + text + "\", expected <width>x<height>");
+  }
+
+  return {width, height};
+}
+
+/// \brief Parses a frame budget in milliseconds. Throws std::invalid_argument if it is not a positive number.
+DurationInMs parseFrameBudget(const std::string& text)
+{
+  double milliseconds = 0.;
+  std::istringstream stream{text};
+  if (!(stream >> milliseconds) || milliseconds <= 0. || !stream.eof())
+  {
+    throw std::invalid_argument("Invalid frame budget \"" + text + "\", expected a positive number of milliseconds");
+  }
+
+  return DurationInMs{milliseconds};
+}
+}
+
+int main(int argc, char** argv)
 {
   try
   {
-    runLabMosaic();
+    // Pick out the options, and leave the mode and its arguments.
+    FeatureSettings features;
+    bool optimize = false;
+    std::string record_path;
+    bool record_frames = false;
+    cv::Size frame_size{640, 480};
+    std::string tiles_dir;
+    DurationInMs frame_budget{0};
+    bool refine_homographies = true;
+    bool sprt = true;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i)
+    {
+      const std::string arg = argv[i];
+      if (arg == "--features" && i + 1 < argc)
+      {
+        features = readFeatureSettings(argv[++i]);
+      }
+      else if (arg == "--optimize")
+      {
+        optimize = true;
+      }
+      else if (arg == "--record" && i + 1 < argc)
+      {
+        record_path = argv[++i];
+      }
+      else if (arg == "--record-frames")
+      {
+        record_frames = true;
+      }
+      else if (arg == "--frame-size" && i + 1 < argc)
+      {
+        frame_size = parseFrameSize(argv[++i]);
+      }
+      else if (arg == "--tiles" && i + 1 < argc)
+      {
+        tiles_dir = argv[++i];
+      }
+      else if (arg == "--no-refine")
+      {
+        refine_homographies = false;
+      }
+      else if (arg == "--no-sprt")
+      {
+        sprt = false;
+      }
+      else if (arg == "--budget" && i + 1 < argc)
+      {
+        frame_budget = parseFrameBudget(argv[++i]);
+      }
+      else
+      {
+        args.push_back(arg);
+      }
+    }
+
+    // Only the live and batch modes are recorded and exported, and the frame budget only applies to the live mode.
+    const bool recordable = args.empty() || args[0] == "--batch";
+    if (((!record_path.empty() || !tiles_dir.empty()) && !recordable) || (record_frames && record_path.empty()) ||
+        (frame_budget > DurationInMs{0} && !args.empty()))
+    {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    const auto recording = record_path.empty() ? nullptr : std::make_unique<RecordingWriter>(record_path, record_frames);
+    const auto tiles = tiles_dir.empty() ? nullptr : std::make_unique<TileExporter>(tiles_dir);
+
+    if (args.empty() && !optimize)
+    {
+      runLabMosaic(features, frame_size, recording.get(), tiles.get(), frame_budget, refine_homographies, sprt);
+    }
+    else if (args.size() == 3 && args[0] == "--batch")
+    {
+      runBatchMosaic(args[1], args[2], optimize, features, recording.get(), tiles.get(), refine_homographies,
+                     sprt);
+    }
+    else if ((args.size() == 2 || args.size() == 3) && args[0] == "--tune" && !optimize)
+    {
+      runFeatureTuning(args[1], args.size() == 3 ? args[2] : std::string{});
+    }
+    else if ((args.size() == 2 || args.size() == 3) && args[0] == "--replay" && !optimize)
+    {
+      runReplay(args[1], args.size() == 3 ? parseReplayStage(args[2]) : ReplayStage::matching,
+                liveSettings(features, DurationInMs{0}, refine_homographies, sprt));
+    }
+    else
+    {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
   }
   catch (const std::exception& e)
   {
     std::cerr << "Caught exception:" << std::endl
               << e.what() << std::endl;
+    return EXIT_FAILURE;
   }
   catch (...)
   {
     std::cerr << "Caught unknown exception"  << std::endl;
+    return EXIT_FAILURE;
   }
 
   return EXIT_SUCCESS;
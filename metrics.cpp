@@ -0,0 +1,215 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <ostream>
+
+namespace
+{
+/// \brief Small thread numbers for the trace, in the order the threads first record an event.
+int threadNumber()
+{
+  static std::atomic<int> next_thread_number{0};
+  thread_local const int thread_number = next_thread_number.fetch_add(1, std::memory_order_relaxed);
+  return thread_number;
+}
+
+constexpr std::size_t index(TimedEvent event)
+{
+  return static_cast<std::size_t>(event);
+}
+}
+
+const char* eventName(TimedEvent event)
+{
+  switch (event)
+  {
+    case TimedEvent::capture: return "capture";
+    case TimedEvent::conversion: return "conversion";
+    case TimedEvent::detection: return "detection";
+    case TimedEvent::description: return "description";
+    case TimedEvent::matching: return "matching";
+    case TimedEvent::tracking: return "tracking";
+    case TimedEvent::ransac: return "ransac";
+    case TimedEvent::refit: return "refit";
+    case TimedEvent::compositing: return "compositing";
+  }
+
+  return "";
+}
+
+LatencyHistogram::LatencyHistogram()
+    : total_ns_{0}
+    , max_ns_{0}
+{
+  for (auto& bin : bins_)
+  {
+    bin.store(0, std::memory_order_relaxed);
+  }
+}
+
+void LatencyHistogram::record(std::chrono::nanoseconds duration)
+{
+  const auto duration_ns = static_cast<std::uint64_t>(std::max<std::int64_t>(duration.count(), 0));
+
+  bins_[binIndex(duration)].fetch_add(1, std::memory_order_relaxed);
+  total_ns_.fetch_add(duration_ns, std::memory_order_relaxed);
+
+  std::uint64_t max_ns = max_ns_.load(std::memory_order_relaxed);
+  while (duration_ns > max_ns && !max_ns_.compare_exchange_weak(max_ns, duration_ns, std::memory_order_relaxed))
+  { }
+}
+
+LatencySummary LatencyHistogram::drain()
+{
+  std::array<std::uint64_t, num_bins> counts;
+  LatencySummary summary;
+  for (int bin = 0; bin < num_bins; ++bin)
+  {
+    counts[bin] = bins_[bin].exchange(0, std::memory_order_relaxed);
+    summary.count += counts[bin];
+  }
+
+  const auto total_ns = total_ns_.exchange(0, std::memory_order_relaxed);
+  const auto max_ns = max_ns_.exchange(0, std::memory_order_relaxed);
+  if (summary.count == 0)
+  { return summary; }
+
+  // Report the upper edge of the bin containing each percentile, but never more than the maximum.
+  const double max_ms = 1e-6 * static_cast<double>(max_ns);
+  const auto percentile = [&](double p)
+  {
+    const auto rank = static_cast<std::uint64_t>(std::ceil(p * static_cast<double>(summary.count)));
+    std::uint64_t cumulative = 0;
+    for (int bin = 0; bin < num_bins; ++bin)
+    {
+      cumulative += counts[bin];
+      if (cumulative >= rank)
+      { return std::min(binUpperMs(bin), max_ms); }
+    }
+    return max_ms;
+  };
+
+  summary.mean_ms = 1e-6 * static_cast<double>(total_ns) / static_cast<double>(summary.count);
+  summary.p50_ms = percentile(0.5);
+  summary.p99_ms = percentile(0.99);
+  summary.max_ms = max_ms;
+
+  return summary;
+}
+
+int LatencyHistogram::binIndex(std::chrono::nanoseconds duration)
+{
+  const double duration_us = 1e-3 * static_cast<double>(duration.count());
+  if (duration_us <= 1.)
+  { return 0; }
+
+  const auto bin = static_cast<int>(bins_per_octave * std::log2(duration_us));
+  return std::min(bin, num_bins - 1);
+}
+
+double LatencyHistogram::binUpperMs(int bin)
+{
+  return 1e-3 * std::exp2(static_cast<double>(bin + 1) / bins_per_octave);
+}
+
+Metrics& Metrics::instance()
+{
+  static Metrics metrics;
+  return metrics;
+}
+
+Metrics::Metrics()
+    : epoch_{Clock::now()}
+    , trace_{new TraceSlot[trace_capacity]}
+    , trace_pos_{0}
+{ }
+
+void Metrics::record(TimedEvent event, Clock::time_point start, Clock::time_point end)
+{
+  const auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+  histograms_[index(event)].record(duration);
+
+  // Claim the next slot in the ring buffer, overwriting the oldest event.
+  const std::uint64_t pos = trace_pos_.fetch_add(1, std::memory_order_relaxed);
+  TraceSlot& slot = trace_[pos % trace_capacity];
+  slot.sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.event.store(static_cast<int>(event), std::memory_order_relaxed);
+  slot.thread.store(threadNumber(), std::memory_order_relaxed);
+  slot.start_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(start - epoch_).count(),
+                      std::memory_order_relaxed);
+  slot.duration_ns.store(duration.count(), std::memory_order_relaxed);
+  slot.sequence.store(pos + 1, std::memory_order_release);
+}
+
+LatencySummaries Metrics::drainSummaries()
+{
+  LatencySummaries summaries;
+  for (std::size_t i = 0; i < num_timed_events; ++i)
+  {
+    summaries[i] = histograms_[i].drain();
+  }
+
+  return summaries;
+}
+
+void Metrics::writeChromeTrace(std::ostream& stream) const
+{
+  const std::uint64_t end_pos = trace_pos_.load(std::memory_order_acquire);
+  const std::uint64_t begin_pos = end_pos > trace_capacity ? end_pos - trace_capacity : 0;
+
+  stream << "{\"traceEvents\":[";
+  bool first = true;
+  for (std::uint64_t pos = begin_pos; pos < end_pos; ++pos)
+  {
+    // Skip slots that are being written, or have been overwritten by a newer event.
+    const TraceSlot& slot = trace_[pos % trace_capacity];
+    if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+    { continue; }
+
+    const int event = slot.event.load(std::memory_order_relaxed);
+    const int thread = slot.thread.load(std::memory_order_relaxed);
+    const std::int64_t start_ns = slot.start_ns.load(std::memory_order_relaxed);
+    const std::int64_t duration_ns = slot.duration_ns.load(std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != pos + 1)
+    { continue; }
+
+    // Complete events, with timestamps in microseconds.
+    stream << (first ? "" : ",") << "\n{\"name\":\"" << eventName(static_cast<TimedEvent>(event))
+           << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << thread
+           << ",\"ts\":" << 1e-3 * static_cast<double>(start_ns)
+           << ",\"dur\":" << 1e-3 * static_cast<double>(duration_ns) << "}";
+    first = false;
+  }
+  stream << "\n]}\n";
+}
+
+void writeSummariesCsv(std::ostream& stream, const LatencySummaries& summaries)
+{
+  stream << "event,count,mean_ms,p50_ms,p99_ms,max_ms\n";
+  for (std::size_t i = 0; i < num_timed_events; ++i)
+  {
+    const LatencySummary& summary = summaries[i];
+    stream << eventName(static_cast<TimedEvent>(i)) << "," << summary.count << "," << summary.mean_ms << ","
+           << summary.p50_ms << "," << summary.p99_ms << "," << summary.max_ms << "\n";
+  }
+}
+
+void writeSummariesJson(std::ostream& stream, const LatencySummaries& summaries)
+{
+  stream << "{";
+  for (std::size_t i = 0; i < num_timed_events; ++i)
+  {
+    const LatencySummary& summary = summaries[i];
+    stream << (i == 0 ? "" : ",") << "\n  \"" << eventName(static_cast<TimedEvent>(i)) << "\": {"
+           << "\"count\": " << summary.count
+           << ", \"mean_ms\": " << summary.mean_ms
+           << ", \"p50_ms\": " << summary.p50_ms
+           << ", \"p99_ms\": " << summary.p99_ms
+           << ", \"max_ms\": " << summary.max_ms << "}";
+  }
+  stream << "\n}\n";
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+
+/// \brief The events that are timed by the scoped timers.
+enum class TimedEvent
+{
+  capture,
+  conversion,
+  detection,
+  description,
+  matching,
+  tracking,
+  ransac,
+  refit,
+  compositing
+};
+
+constexpr std::size_t num_timed_events = 9;
+
+/// \return The name of a timed event.
+const char* eventName(TimedEvent event);
+
+/// \brief Summary of the durations recorded for an event.
+struct LatencySummary
+{
+  std::uint64_t count{0};
+  double mean_ms{0.};
+  double p50_ms{0.};
+  double p99_ms{0.};
+  double max_ms{0.};
+};
+
+using LatencySummaries = std::array<LatencySummary, num_timed_events>;
+
+/// \brief A histogram of durations with logarithmically spaced bins.
+///
+/// Durations can be recorded from any thread without locking or allocating.
+/// The percentiles are accurate to the bin width, which is about 9%.
+class LatencyHistogram
+{
+public:
+  LatencyHistogram();
+
+  /// \brief Records a duration.
+  void record(std::chrono::nanoseconds duration);
+
+  /// \brief Summarizes the durations recorded since the last call, and empties the histogram.
+  /// This gives rolling statistics when called periodically.
+  LatencySummary drain();
+
+private:
+  static constexpr int bins_per_octave = 8;
+  static constexpr int num_octaves = 24;
+  static constexpr int num_bins = bins_per_octave * num_octaves;
+
+  /// \brief The bins start at 1 microsecond, and the last bin also counts longer durations.
+  static int binIndex(std::chrono::nanoseconds duration);
+  static double binUpperMs(int bin);
+
+  std::array<std::atomic<std::uint64_t>, num_bins> bins_;
+  std::atomic<std::uint64_t> total_ns_;
+  std::atomic<std::uint64_t> max_ns_;
+};
+
+/// \brief Collects timings from the scoped timers in all threads.
+///
+/// Each event is added to a histogram for its type, and to a fixed size ring buffer of recent events for tracing.
+/// Recording an event does not allocate memory or take a lock, so the metrics can be left on.
+class Metrics
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  /// \return The metrics for the process.
+  static Metrics& instance();
+
+  Metrics(const Metrics&) = delete;
+  Metrics& operator=(const Metrics&) = delete;
+
+  /// \brief Records an event.
+  void record(TimedEvent event, Clock::time_point start, Clock::time_point end);
+
+  /// \brief Summarizes the events recorded since the last call, and starts a new window.
+  LatencySummaries drainSummaries();
+
+  /// \brief Writes the most recent events in the Chrome trace event format, which can be opened in chrome://tracing.
+  void writeChromeTrace(std::ostream& stream) const;
+
+private:
+  Metrics();
+
+  struct TraceSlot
+  {
+    /// \brief The position in the trace plus one, which is zero while the slot has not been written.
+    std::atomic<std::uint64_t> sequence{0};
+    std::atomic<int> event{0};
+    std::atomic<int> thread{0};
+    std::atomic<std::int64_t> start_ns{0};
+    std::atomic<std::int64_t> duration_ns{0};
+  };
+
+  static constexpr std::size_t trace_capacity = std::size_t{1} << 16;
+
+  Clock::time_point epoch_;
+  std::array<LatencyHistogram, num_timed_events> histograms_;
+  std::unique_ptr<TraceSlot[]> trace_;
+  std::atomic<std::uint64_t> trace_pos_;
+};
+
+/// \brief Writes summaries as CSV, with one line per event.
+void writeSummariesCsv(std::ostream& stream, const LatencySummaries& summaries);
+
+/// \brief Writes summaries as a JSON object, with one member per event.
+void writeSummariesJson(std::ostream& stream, const LatencySummaries& summaries);
+
+/// \brief Records the time from construction to destruction as an event.
+class ScopedTimer
+{
+public:
+  explicit ScopedTimer(TimedEvent event)
+      : metrics_{Metrics::instance()}
+      , event_{event}
+      , start_{Metrics::Clock::now()}
+  { }
+
+  ~ScopedTimer()
+  {
+    metrics_.record(event_, start_, Metrics::Clock::now());
+  }
+
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+  Metrics& metrics_;
+  TimedEvent event_;
+  Metrics::Clock::time_point start_;
+};
+
+// Times the rest of the enclosing scope.
+// The timers are compiled out unless LAB_MOSAIC_ENABLE_METRICS is defined, see the LAB_MOSAIC_METRICS build option.
+#ifdef LAB_MOSAIC_ENABLE_METRICS
+#define LAB_MOSAIC_CONCAT_IMPL(a, b) a##b
+#define LAB_MOSAIC_CONCAT(a, b) LAB_MOSAIC_CONCAT_IMPL(a, b)
+#define LAB_MOSAIC_SCOPED_TIMER(event) const ScopedTimer LAB_MOSAIC_CONCAT(scoped_timer_, __LINE__){event}
+#else
+#define LAB_MOSAIC_SCOPED_TIMER(event) static_cast<void>(0)
+#endif
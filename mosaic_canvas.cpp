@@ -0,0 +1,429 @@
+#include "mosaic_canvas.h"
+#include "perspective_warp.h"
+
+#include "opencv2/imgproc.hpp"
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+namespace
+{
+/// \brief The number of bands, except the lowest, in multi-band blending.
+constexpr int num_bands = 5;
+
+/// \brief The distance in pixels over which images are faded in when feathering.
+constexpr float feather_width = 32.f;
+
+/// \brief Returns the homography that moves a point to the origin.
+cv::Matx33f translation(const cv::Point& origin)
+{
+  return {
+      1.f, 0.f, -static_cast<float>(origin.x),
+      0.f, 1.f, -static_cast<float>(origin.y),
+      0.f, 0.f, 1.f};
+}
+
+/// \brief Builds a pyramid of float images, where each level is the difference between two levels of a Gaussian pyramid.
+/// \param image The image at the first level, which is converted to float.
+/// \param num_levels The number of levels after the first. Each level has half the size of the one before.
+/// \param[out] pyramid The pyramid, where the last level is a low-pass image.
+/// \param upsampled Buffer for the upsampled levels.
+void buildLaplacianPyramid(const cv::Mat& image, int num_levels, std::vector<cv::Mat>& pyramid, cv::Mat& upsampled)
+{
+  pyramid.resize(num_levels + 1);
+  image.convertTo(pyramid[0], CV_32F);
+
+  for (int level = 0; level < num_levels; ++level)
+  {
+    cv::pyrDown(pyramid[level], pyramid[level + 1]);
+    cv::pyrUp(pyramid[level + 1], upsampled, pyramid[level].size());
+    pyramid[level] -= upsampled;
+  }
+}
+
+/// \brief Reconstructs the image at the first level of a Laplacian pyramid, in place.
+void collapseLaplacianPyramid(std::vector<cv::Mat>& pyramid, cv::Mat& upsampled)
+{
+  for (int level = static_cast<int>(pyramid.size()) - 2; level >= 0; --level)
+  {
+    cv::pyrUp(pyramid[level + 1], upsampled, pyramid[level].size());
+    pyramid[level] += upsampled;
+  }
+}
+
+/// \brief Computes the weighted mean of two float images, with one weight per pixel for all channels.
+/// Pixels where both weights are zero become zero. The result may be one of the inputs.
+void blendWeighted(const cv::Mat& a, const cv::Mat& a_weight, const cv::Mat& b, const cv::Mat& b_weight,
+                   cv::Mat& blended)
+{
+  blended.create(a.size(), a.type());
+  const int channels = a.channels();
+
+  for (int y = 0; y < a.rows; ++y)
+  {
+    const float* a_row = a.ptr<float>(y);
+    const float* b_row = b.ptr<float>(y);
+    const float* a_weight_row = a_weight.ptr<float>(y);
+    const float* b_weight_row = b_weight.ptr<float>(y);
+    float* blended_row = blended.ptr<float>(y);
+
+    for (int x = 0; x < a.cols; ++x)
+    {
+      const float weight_sum = a_weight_row[x] + b_weight_row[x];
+      const float wa = weight_sum > 1e-6f ? a_weight_row[x] / weight_sum : 0.f;
+      const float wb = weight_sum > 1e-6f ? b_weight_row[x] / weight_sum : 0.f;
+
+      for (int c = 0; c < channels; ++c)
+      {
+        const int i = x * channels + c;
+        blended_row[i] = wa * a_row[i] + wb * b_row[i];
+      }
+    }
+  }
+}
+}
+
+MosaicCanvas::MosaicCanvas(int tile_size, int type, BlendMode blend_mode)
+    : tile_size_{tile_size}
+    , type_{type}
+    , blend_mode_{blend_mode}
+    , version_{0}
+{
+  if (tile_size_ <= 0)
+  {
+    throw std::invalid_argument("Tile size must be positive");
+  }
+
+  if (CV_MAT_DEPTH(type_) != CV_8U || CV_MAT_CN(type_) > 4)
+  {
+    throw std::invalid_argument("Canvas type must be 8-bit with 1 to 4 channels");
+  }
+}
+
+cv::Rect MosaicCanvas::insert(const cv::Mat& image, const cv::Matx33f& H)
+{
+  if (image.empty())
+  {
+    return {};
+  }
+
+  if (image.type() != type_)
+  {
+    throw std::invalid_argument("Image type does not match the canvas type");
+  }
+
+  // Project the image corners into the canvas.
+  const float cols = static_cast<float>(image.cols);
+  const float rows = static_cast<float>(image.rows);
+  const cv::Vec3f corners[4] = {{0.f, 0.f, 1.f}, {cols, 0.f, 1.f}, {cols, rows, 1.f}, {0.f, rows, 1.f}};
+
+  std::vector<cv::Point2f> projected_corners;
+  for (const auto& corner : corners)
+  {
+    const cv::Vec3f projected = H * corner;
+
+    // The homography maps part of the image to infinity, or behind the camera.
+    if (projected[2] <= 0.f)
+    {
+      return {};
+    }
+
+    projected_corners.emplace_back(projected[0] / projected[2], projected[1] / projected[2]);
+  }
+
+  // Reject homographies that blow the image up to an unreasonable size.
+  // The size is checked before rounding to integer pixels in 64-bit floating point,
+  // since a near-degenerate homography may project the corners far outside the range of int.
+  const auto [min_x, max_x] = std::minmax({projected_corners[0].x, projected_corners[1].x,
+                                           projected_corners[2].x, projected_corners[3].x});
+  const auto [min_y, max_y] = std::minmax({projected_corners[0].y, projected_corners[1].y,
+                                           projected_corners[2].y, projected_corners[3].y});
+  const double width = static_cast<double>(max_x) - min_x;
+  const double height = static_cast<double>(max_y) - min_y;
+  constexpr double max_scale = 64.;
+  const double max_side = max_scale * std::max(image.cols, image.rows);
+  if (!(width * height <= max_scale * image.size().area() && width <= max_side && height <= max_side))
+  {
+    return {};
+  }
+
+  const cv::Rect bbox = cv::boundingRect(projected_corners);
+  if (bbox.empty())
+  {
+    return {};
+  }
+
+  ++version_;
+
+  if (blend_mode_ == BlendMode::overwrite)
+  {
+    overwrite(image, H, bbox, projected_corners);
+  }
+  else
+  {
+    blend(image, H, bbox);
+  }
+
+  return bbox;
+}
+
+void MosaicCanvas::overwrite(const cv::Mat& image, const cv::Matx33f& H, const cv::Rect& bbox,
+                             const std::vector<cv::Point2f>& corners)
+{
+  // Warp the image directly into each tile the image covers.
+  for (int y = tileIndex(bbox.y); y <= tileIndex(bbox.y + bbox.height - 1); ++y)
+  {
+    for (int x = tileIndex(bbox.x); x <= tileIndex(bbox.x + bbox.width - 1); ++x)
+    {
+      const cv::Point index{x, y};
+      const cv::Rect tile_rect = tileRect(index);
+      const cv::Rect roi = bbox & tile_rect;
+
+      // The bounding box may touch tiles that the image does not.
+      const std::array<cv::Point2f, 4> roi_corners{
+          roi.tl(), cv::Point2f(roi.br().x, roi.y), roi.br(), cv::Point2f(roi.x, roi.br().y)};
+      if (cv::intersectConvexConvex(corners, roi_corners, cv::noArray()) <= 0.f)
+      { continue; }
+
+      Tile& tile = allocateTile(index);
+      cv::Mat tile_roi = tile.image(roi - tile_rect.tl());
+      warpPerspectiveFused(image, translation(roi.tl()) * H, tile_roi);
+      tile.version = version_;
+    }
+  }
+}
+
+void MosaicCanvas::blend(const cv::Mat& image, const cv::Matx33f& H, const cv::Rect& bbox)
+{
+  // Multi-band blending changes the canvas some distance outside the image, and needs a region that can be halved
+  // for each band. Feathering only needs a border of zeros around the mask for the distance transform.
+  const int num_levels = blend_mode_ == BlendMode::multiband ? num_bands : 0;
+  const int margin = blend_mode_ == BlendMode::multiband ? (2 << num_bands) : 1;
+  const int alignment = 1 << num_levels;
+
+  cv::Rect region{bbox.x - margin, bbox.y - margin, bbox.width + 2 * margin, bbox.height + 2 * margin};
+  region.width = (region.width + alignment - 1) / alignment * alignment;
+  region.height = (region.height + alignment - 1) / alignment * alignment;
+
+  // Warp the image and its mask into the region.
+  // The image is replicated outside its border, so that its border does not show up in the pyramid.
+  buffers_.image_warp.create(region.size(), type_);
+  warpPerspectiveFused(image, translation(region.tl()) * H, buffers_.image_warp, buffers_.mask_warp,
+                       WarpBorder::replicate);
+  if (cv::countNonZero(buffers_.mask_warp) == 0)
+  { return; }
+
+  // The image is faded in from its border when feathering, while multi-band blending uses the mask as it is.
+  std::vector<cv::Mat>& image_weights = buffers_.image_weight_pyramid;
+  std::vector<cv::Mat>& canvas_weights = buffers_.canvas_weight_pyramid;
+  image_weights.resize(num_levels + 1);
+  canvas_weights.resize(num_levels + 1);
+
+  if (blend_mode_ == BlendMode::feather)
+  {
+    cv::distanceTransform(buffers_.mask_warp, buffers_.distance, cv::DIST_L2, cv::DIST_MASK_3);
+    cv::threshold(buffers_.distance, image_weights[0], feather_width, 1., cv::THRESH_TRUNC);
+    image_weights[0] *= 1. / feather_width;
+  }
+  else
+  {
+    buffers_.mask_warp.convertTo(image_weights[0], CV_32F);
+  }
+
+  // The canvas is weighted by how much of it is visible behind the new image.
+  readRegion(region, buffers_.canvas_image, buffers_.canvas_coverage);
+  cv::subtract(1., image_weights[0], canvas_weights[0]);
+  cv::multiply(canvas_weights[0], buffers_.canvas_coverage, canvas_weights[0]);
+  cv::add(image_weights[0], canvas_weights[0], buffers_.coverage);
+
+  // Blend each band of the image and the canvas with the weights smoothed to the same scale.
+  std::vector<cv::Mat>& image_pyramid = buffers_.image_pyramid;
+  std::vector<cv::Mat>& canvas_pyramid = buffers_.canvas_pyramid;
+  buildLaplacianPyramid(buffers_.image_warp, num_levels, image_pyramid, buffers_.upsampled);
+  buildLaplacianPyramid(buffers_.canvas_image, num_levels, canvas_pyramid, buffers_.upsampled);
+
+  for (int level = 0; level <= num_levels; ++level)
+  {
+    if (level > 0)
+    {
+      cv::pyrDown(image_weights[level - 1], image_weights[level]);
+      cv::pyrDown(canvas_weights[level - 1], canvas_weights[level]);
+    }
+
+    blendWeighted(image_pyramid[level], image_weights[level], canvas_pyramid[level], canvas_weights[level],
+                  image_pyramid[level]);
+  }
+
+  collapseLaplacianPyramid(image_pyramid, buffers_.upsampled);
+
+  // Pixels outside both the image and the canvas may have picked up some of the low frequencies.
+  cv::compare(buffers_.coverage, 0., buffers_.uncovered, cv::CMP_LE);
+  image_pyramid[0].setTo(cv::Scalar::all(0), buffers_.uncovered);
+  image_pyramid[0].convertTo(buffers_.blended, type_);
+
+  writeRegion(region, buffers_.blended, buffers_.coverage);
+}
+
+void MosaicCanvas::render(const cv::Rect& region, cv::Mat& image, std::uint64_t since_version) const
+{
+  if (image.size() != region.size() || image.type() != type_)
+  {
+    image.create(region.size(), type_);
+    image.setTo(cv::Scalar::all(0));
+    since_version = 0;
+  }
+
+  for (const auto& [index, tile] : tiles_)
+  {
+    if (tile.version <= since_version)
+    { continue; }
+
+    const cv::Rect tile_rect = tileRect(index);
+    const cv::Rect overlap = tile_rect & region;
+    if (overlap.empty())
+    { continue; }
+
+    tile.image(overlap - tile_rect.tl()).copyTo(image(overlap - region.tl()));
+  }
+}
+
+void MosaicCanvas::clear()
+{
+  tiles_.clear();
+  bounds_ = cv::Rect{};
+  ++version_;
+}
+
+cv::Rect MosaicCanvas::bounds() const
+{
+  return bounds_;
+}
+
+std::uint64_t MosaicCanvas::version() const
+{
+  return version_;
+}
+
+std::vector<cv::Point> MosaicCanvas::changedTiles(std::uint64_t since_version) const
+{
+  std::vector<cv::Point> changed;
+  for (const auto& [index, tile] : tiles_)
+  {
+    if (tile.version > since_version)
+    {
+      changed.push_back(index);
+    }
+  }
+
+  return changed;
+}
+
+cv::Mat MosaicCanvas::tile(const cv::Point& index) const
+{
+  const auto it = tiles_.find(index);
+  if (it == tiles_.end())
+  {
+    return cv::Mat{};
+  }
+
+  return it->second.image;
+}
+
+cv::Rect MosaicCanvas::tileRect(const cv::Point& index) const
+{
+  return {index.x * tile_size_, index.y * tile_size_, tile_size_, tile_size_};
+}
+
+size_t MosaicCanvas::numTiles() const
+{
+  return tiles_.size();
+}
+
+int MosaicCanvas::tileSize() const
+{
+  return tile_size_;
+}
+
+int MosaicCanvas::type() const
+{
+  return type_;
+}
+
+BlendMode MosaicCanvas::blendMode() const
+{
+  return blend_mode_;
+}
+
+void MosaicCanvas::readRegion(const cv::Rect& region, cv::Mat& image, cv::Mat& coverage) const
+{
+  image.create(region.size(), type_);
+  image.setTo(cv::Scalar::all(0));
+  coverage.create(region.size(), CV_32FC1);
+  coverage.setTo(cv::Scalar::all(0));
+
+  for (int y = tileIndex(region.y); y <= tileIndex(region.y + region.height - 1); ++y)
+  {
+    for (int x = tileIndex(region.x); x <= tileIndex(region.x + region.width - 1); ++x)
+    {
+      const auto it = tiles_.find({x, y});
+      if (it == tiles_.end())
+      { continue; }
+
+      const cv::Rect tile_rect = tileRect(it->first);
+      const cv::Rect overlap = tile_rect & region;
+      it->second.image(overlap - tile_rect.tl()).copyTo(image(overlap - region.tl()));
+      it->second.coverage(overlap - tile_rect.tl()).copyTo(coverage(overlap - region.tl()));
+    }
+  }
+}
+
+void MosaicCanvas::writeRegion(const cv::Rect& region, const cv::Mat& image, const cv::Mat& coverage)
+{
+  for (int y = tileIndex(region.y); y <= tileIndex(region.y + region.height - 1); ++y)
+  {
+    for (int x = tileIndex(region.x); x <= tileIndex(region.x + region.width - 1); ++x)
+    {
+      const cv::Point index{x, y};
+      const cv::Rect tile_rect = tileRect(index);
+      const cv::Rect overlap = tile_rect & region;
+
+      // Do not allocate tiles that are still empty.
+      const cv::Mat overlap_coverage = coverage(overlap - region.tl());
+      if (tiles_.count(index) == 0 && cv::countNonZero(overlap_coverage) == 0)
+      { continue; }
+
+      Tile& tile = allocateTile(index);
+      image(overlap - region.tl()).copyTo(tile.image(overlap - tile_rect.tl()));
+      overlap_coverage.copyTo(tile.coverage(overlap - tile_rect.tl()));
+      tile.version = version_;
+    }
+  }
+}
+
+MosaicCanvas::Tile& MosaicCanvas::allocateTile(const cv::Point& index)
+{
+  auto it = tiles_.find(index);
+  if (it != tiles_.end())
+  {
+    return it->second;
+  }
+
+  const cv::Rect tile_rect = tileRect(index);
+  bounds_ = bounds_.empty() ? tile_rect : (bounds_ | tile_rect);
+
+  Tile& tile = tiles_[index];
+  tile.image = cv::Mat::zeros(tile_size_, tile_size_, type_);
+  if (blend_mode_ != BlendMode::overwrite)
+  {
+    tile.coverage = cv::Mat::zeros(tile_size_, tile_size_, CV_32FC1);
+  }
+  tile.version = version_;
+  return tile;
+}
+
+int MosaicCanvas::tileIndex(int coordinate) const
+{
+  // Round towards negative infinity, also for negative coordinates.
+  return coordinate >= 0 ? coordinate / tile_size_ : -((-coordinate + tile_size_ - 1) / tile_size_);
+}
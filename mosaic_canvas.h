@@ -0,0 +1,134 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+#include <cstdint>
+#include <map>
+#include <vector>
+
+/// \brief How inserted images are combined with what is already in the canvas, from fastest to best looking.
+enum class BlendMode
+{
+  overwrite, ///< New pixels replace old pixels, which leaves hard seams.
+  feather,   ///< New images are faded in towards their borders.
+  multiband  ///< New images are faded in over a width that depends on the frequency band, which hides seams without blurring details.
+};
+
+/// \brief A mosaic image made of fixed-size tiles, which are allocated when something is first drawn into them.
+///
+/// The canvas has no fixed size, and may grow in any direction, also into negative pixel coordinates.
+/// Each tile records the version of the canvas when it was last changed,
+/// so that consumers can copy only the tiles that changed since they last looked.
+///
+/// When blending, each tile also stores how much of each pixel is covered by the inserted images.
+/// Blending is limited to the bounding box of the inserted image, and the buffers are kept between inserts.
+class MosaicCanvas
+{
+public:
+  /// \brief Constructs an empty canvas.
+  /// \param tile_size Width and height of each tile in pixels.
+  /// \param type The OpenCV type of the canvas pixels, which must be 8-bit with 1 to 4 channels.
+  /// \param blend_mode How inserted images are combined with the canvas.
+  explicit MosaicCanvas(int tile_size = 256, int type = CV_8UC3, BlendMode blend_mode = BlendMode::overwrite);
+
+  /// \brief Warps an image into the canvas, touching only the tiles covered by the warped image.
+  /// \param image The image to insert, which must have the same type as the canvas.
+  /// \param H Homography mapping pixels in the image to pixels in the canvas.
+  /// \return The bounding box of the warped image in canvas pixels, which is empty if nothing was inserted.
+  cv::Rect insert(const cv::Mat& image, const cv::Matx33f& H);
+
+  /// \brief Renders a region of the canvas into an image.
+  /// \param region The region in canvas pixels.
+  /// \param[in,out] image The rendered image. If it does not have the size of the region, it is reallocated.
+  /// \param since_version Only copy tiles that have changed since this version. Ignored if the image is reallocated.
+  void render(const cv::Rect& region, cv::Mat& image, std::uint64_t since_version = 0) const;
+
+  /// \brief Removes all tiles.
+  void clear();
+
+  /// \return The bounding box of all allocated tiles in canvas pixels.
+  cv::Rect bounds() const;
+
+  /// \return The current version, which is increased every time the canvas changes.
+  std::uint64_t version() const;
+
+  /// \return The indices of the tiles that have changed since a version.
+  std::vector<cv::Point> changedTiles(std::uint64_t since_version) const;
+
+  /// \return The tile with the given index, or an empty image if it is not allocated.
+  cv::Mat tile(const cv::Point& index) const;
+
+  /// \return The region covered by the tile with the given index in canvas pixels.
+  cv::Rect tileRect(const cv::Point& index) const;
+
+  /// \return The number of allocated tiles.
+  size_t numTiles() const;
+
+  /// \return The width and height of each tile in pixels.
+  int tileSize() const;
+
+  /// \return The OpenCV type of the canvas pixels.
+  int type() const;
+
+  /// \return How inserted images are combined with the canvas.
+  BlendMode blendMode() const;
+
+private:
+  struct Tile
+  {
+    cv::Mat image;
+    cv::Mat coverage;
+    std::uint64_t version;
+  };
+
+  /// \brief Buffers used when blending, which are reused between inserts.
+  struct BlendBuffers
+  {
+    cv::Mat mask_warp;
+    cv::Mat image_warp;
+    cv::Mat distance;
+    cv::Mat canvas_image;
+    cv::Mat canvas_coverage;
+    cv::Mat coverage;
+    cv::Mat uncovered;
+    cv::Mat blended;
+    cv::Mat upsampled;
+    std::vector<cv::Mat> image_pyramid;
+    std::vector<cv::Mat> canvas_pyramid;
+    std::vector<cv::Mat> image_weight_pyramid;
+    std::vector<cv::Mat> canvas_weight_pyramid;
+  };
+
+  /// \brief Warps an image into the tiles it covers, replacing the pixels that were there.
+  void overwrite(const cv::Mat& image, const cv::Matx33f& H, const cv::Rect& bbox,
+                 const std::vector<cv::Point2f>& corners);
+
+  /// \brief Warps an image into a region around its bounding box, and blends it with the canvas.
+  void blend(const cv::Mat& image, const cv::Matx33f& H, const cv::Rect& bbox);
+
+  /// \brief Copies the pixels and coverage in a region of the canvas, which are zero where no tile is allocated.
+  void readRegion(const cv::Rect& region, cv::Mat& image, cv::Mat& coverage) const;
+
+  /// \brief Copies pixels and coverage into a region of the canvas, allocating the tiles with nonzero coverage.
+  void writeRegion(const cv::Rect& region, const cv::Mat& image, const cv::Mat& coverage);
+
+  /// \brief Orders tile indices row by row.
+  struct TileIndexLess
+  {
+    bool operator()(const cv::Point& a, const cv::Point& b) const
+    { return a.y < b.y || (a.y == b.y && a.x < b.x); }
+  };
+
+  /// \brief Returns the tile with the given index, and allocates it if necessary.
+  Tile& allocateTile(const cv::Point& index);
+
+  /// \brief Returns the index of the tile containing a canvas pixel coordinate.
+  int tileIndex(int coordinate) const;
+
+  int tile_size_;
+  int type_;
+  BlendMode blend_mode_;
+  std::uint64_t version_;
+  cv::Rect bounds_;
+  std::map<cv::Point, Tile, TileIndexLess> tiles_;
+  BlendBuffers buffers_;
+};
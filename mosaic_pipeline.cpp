@@ -0,0 +1,982 @@
+#include "mosaic_pipeline.h"
+
+#include "feature_utils.h"
+#include "metrics.h"
+
+#include "opencv2/core/eigen.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/video.hpp"
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+namespace
+{
+/// \brief How long an idle stage sleeps before checking its queue again.
+constexpr std::chrono::microseconds idle_sleep{200};
+
+/// \brief Computes the fraction of a frame that overlaps with a keyframe.
+/// \param H Homography mapping pixels in the frame to the keyframe.
+/// \param intersection Buffer for the intersection polygon, which keeps its memory between calls.
+float computeOverlap(const Eigen::Matrix3f& H, const cv::Size& frame_size, const cv::Size& keyframe_size,
+                     std::vector<cv::Point2f>& intersection)
+{
+  const float cols = static_cast<float>(frame_size.width);
+  const float rows = static_cast<float>(frame_size.height);
+  const Eigen::Vector3f corners[4] = {{0.f, 0.f, 1.f}, {cols, 0.f, 1.f}, {cols, rows, 1.f}, {0.f, rows, 1.f}};
+
+  // The corners are fixed-size arrays, so that no memory is allocated for them.
+  std::array<cv::Point2f, 4> projected_corners;
+  for (size_t i = 0; i < projected_corners.size(); ++i)
+  {
+    const Eigen::Vector3f projected = H * corners[i];
+    if (projected.z() <= 0.f)
+    { return 0.f; }
+    projected_corners[i] = {projected.x() / projected.z(), projected.y() / projected.z()};
+  }
+
+  // The projected frame must be convex for the intersection to be valid.
+  if (!cv::isContourConvex(projected_corners))
+  { return 0.f; }
+
+  const std::array<cv::Point2f, 4> keyframe_corners{{
+      {0.f, 0.f},
+      {static_cast<float>(keyframe_size.width), 0.f},
+      {static_cast<float>(keyframe_size.width), static_cast<float>(keyframe_size.height)},
+      {0.f, static_cast<float>(keyframe_size.height)}}};
+
+  const float overlap_area = cv::intersectConvexConvex(projected_corners, keyframe_corners, intersection);
+  const float frame_area = static_cast<float>(cv::contourArea(projected_corners));
+
+  return frame_area > 0.f ? overlap_area / frame_area : 0.f;
+}
+
+/// \brief The radius of the patches that are matched when refining coarse-to-fine registrations.
+constexpr int fine_patch_radius = 7;
+
+/// \brief The minimum normalized cross-correlation for a patch match at full resolution.
+constexpr double min_fine_score = 0.8;
+
+/// \brief The maximum number of coarse inliers that are matched at full resolution.
+/// The inliers are ordered by match quality, so the best are used.
+constexpr size_t max_fine_points = 200;
+
+/// \brief Computes the number of times a frame can be halved while staying at least as wide as coarse_width.
+int coarseLevels(int frame_width, int coarse_width)
+{
+  int levels = 0;
+  while (coarse_width > 0 && (frame_width >> (levels + 1)) >= coarse_width)
+  {
+    ++levels;
+  }
+  return levels;
+}
+
+/// \brief Finds a patch around a point in the frame within a small window in the keyframe,
+/// with normalized cross-correlation and subpixel interpolation of the best match.
+/// \param frame_pt The point in the frame.
+/// \param predicted The predicted position of the point in the keyframe, which is the center of the search window.
+/// \param search_radius The maximum distance from the predicted position, in pixels along each axis.
+/// \param scores Buffer for the correlation scores.
+/// \param[out] match The position of the point in the keyframe.
+/// \return False if the patch or the window is not inside the images, or if the best match is weak.
+bool matchWindow(const cv::Mat& frame, const cv::Mat& keyframe, const Eigen::Vector2f& frame_pt,
+                 const Eigen::Vector2f& predicted, int search_radius, cv::Mat& scores, Eigen::Vector2f& match)
+{
+  const cv::Point patch_center{cvRound(frame_pt.x()), cvRound(frame_pt.y())};
+  const cv::Rect patch_rect{patch_center.x - fine_patch_radius, patch_center.y - fine_patch_radius,
+                            2*fine_patch_radius + 1, 2*fine_patch_radius + 1};
+
+  const int window_radius = fine_patch_radius + search_radius;
+  const cv::Rect window_rect{cvRound(predicted.x()) - window_radius, cvRound(predicted.y()) - window_radius,
+                             2*window_radius + 1, 2*window_radius + 1};
+
+  if ((patch_rect & cv::Rect{cv::Point{0, 0}, frame.size()}) != patch_rect ||
+      (window_rect & cv::Rect{cv::Point{0, 0}, keyframe.size()}) != window_rect)
+  { return false; }
+
+  cv::matchTemplate(keyframe(window_rect), frame(patch_rect), scores, cv::TM_CCOEFF_NORMED);
+  double max_score;
+  cv::Point max_loc;
+  cv::minMaxLoc(scores, nullptr, &max_score, nullptr, &max_loc);
+  if (!(max_score >= min_fine_score))
+  { return false; }
+
+  // Fit a parabola through the best score and its neighbours along each axis.
+  const auto subpixelOffset = [&scores](cv::Point loc, cv::Point step)
+  {
+    const cv::Point before = loc - step;
+    const cv::Point after = loc + step;
+    if (before.x < 0 || before.y < 0 || after.x >= scores.cols || after.y >= scores.rows)
+    { return 0.f; }
+
+    const float score_before = scores.at<float>(before);
+    const float score_after = scores.at<float>(after);
+    const float curvature = score_before - 2.f*scores.at<float>(loc) + score_after;
+    return curvature < 0.f ? 0.5f*(score_before - score_after) / curvature : 0.f;
+  };
+
+  // The point has the same offset from the patch center in both images.
+  match.x() = static_cast<float>(window_rect.x + max_loc.x + fine_patch_radius) + subpixelOffset(max_loc, {1, 0}) +
+              (frame_pt.x() - static_cast<float>(patch_center.x));
+  match.y() = static_cast<float>(window_rect.y + max_loc.y + fine_patch_radius) + subpixelOffset(max_loc, {0, 1}) +
+              (frame_pt.y() - static_cast<float>(patch_center.y));
+  return true;
+}
+
+/// \brief Releases an image if its memory is shared with other images or not owned by it,
+/// so that writing a new image into it allocates new memory rather than overwriting the others.
+void releaseIfShared(cv::Mat& image)
+{
+  if (!image.u || image.u->refcount > 1)
+  {
+    image.release();
+  }
+}
+
+/// \brief Makes sure that a point matrix has at least a number of columns, and only grows it.
+void reserveColumns(Eigen::Matrix2Xf& pts, Eigen::Index num_columns)
+{
+  if (pts.cols() < num_columns)
+  {
+    pts.resize(Eigen::NoChange, num_columns);
+  }
+}
+}
+
+void FrameData::reset()
+{
+  id = 0;
+  capture_time = {};
+  deadline = Clock::time_point::max();
+
+  releaseIfShared(frame);
+  releaseIfShared(gray_frame);
+  coarse_scale = 1.f;
+  detected = false;
+  keypoints.clear();
+  releaseIfShared(descriptors);
+  detection_duration = DurationInMs{0};
+  description_duration = DurationInMs{0};
+
+  reference = nullptr;
+  map_generation = 0;
+  path = FramePath::detection;
+  is_reference = false;
+  is_new_keyframe = false;
+  good_matches.clear();
+  matching_duration = DurationInMs{0};
+
+  estimated = false;
+  estimate.homography.setIdentity();
+  estimate.num_inliers = 0;
+  estimate.inliers.clear();
+  estimation_duration = DurationInMs{0};
+
+  registered = false;
+  to_mosaic.setIdentity();
+  num_inlier_pts = 0;
+}
+
+const char* stageName(PipelineStage stage)
+{
+  switch (stage)
+  {
+    case PipelineStage::capture: return "Capture";
+    case PipelineStage::features: return "Features";
+    case PipelineStage::matching: return "Matching";
+    case PipelineStage::compositing: return "Compositing";
+  }
+
+  return "";
+}
+
+const char* pathName(FramePath path)
+{
+  switch (path)
+  {
+    case FramePath::detection: return "detection";
+    case FramePath::tracking: return "tracking";
+    case FramePath::tracking_fallback: return "tracking failed, detection";
+  }
+
+  return "";
+}
+
+void StageStats::record(DurationInMs duration)
+{
+  // Smooth the latency with an exponential moving average.
+  constexpr double alpha = 0.1;
+  const double previous = latency_ms.load(std::memory_order_relaxed);
+  const double latency = num_processed.load(std::memory_order_relaxed) == 0
+                         ? duration.count() : (1. - alpha)*previous + alpha*duration.count();
+
+  latency_ms.store(latency, std::memory_order_relaxed);
+  num_processed.fetch_add(1, std::memory_order_relaxed);
+}
+
+MosaicPipeline::MosaicPipeline(FrameSource source, const PipelineSettings& settings)
+    : source_{std::move(source)}
+    , settings_{settings}
+    , detector_{createDetector(settings)}
+    , desc_extractor_{createDescriptorExtractor(settings.features)}
+    , fallback_detector_{createDetector(settings)}
+    , fallback_desc_extractor_{createDescriptorExtractor(settings.features)}
+    , reference_detector_{createDetector(settings)}
+    , reference_desc_extractor_{createDescriptorExtractor(settings.features)}
+    , matcher_{settings.features}
+    , estimator_{0.99f, 3.f, 10000, 1, settings.ransac_seed, std::make_unique<ProsacSampler>(),
+                 settings.refine_homographies, settings.sprt}
+    , tracking_estimator_{0.99f, 3.f, 10000, 1, settings.ransac_seed, std::make_unique<UniformSampler>(),
+                          settings.refine_homographies, settings.sprt}
+    , local_map_generation_{0}
+    , num_tracked_frames_{0}
+    , tracking_active_{false}
+    , features_queue_{settings.queue_capacity}
+    , matching_queue_{settings.queue_capacity}
+    , compositing_queue_{settings.queue_capacity}
+    , free_frames_{settings.frame_pool_capacity}
+    , map_generation_{0}
+    , keypoint_budget_{settings.features.max_keypoints}
+    , stop_requested_{false}
+    , capture_done_{false}
+    , features_done_{false}
+    , matching_done_{false}
+{
+  if (settings_.frame_budget < DurationInMs{0})
+  {
+    throw std::invalid_argument("The frame budget cannot be negative");
+  }
+
+  if (!(settings_.ransac_budget_share > 0.f && settings_.ransac_budget_share <= 1.f))
+  {
+    throw std::invalid_argument("The RANSAC share of the frame budget must be in (0, 1]");
+  }
+
+  if (settings_.min_keypoints < 1)
+  {
+    throw std::invalid_argument("The frame budget must leave at least one keypoint");
+  }
+}
+
+MosaicPipeline::~MosaicPipeline()
+{
+  stop();
+}
+
+void MosaicPipeline::start()
+{
+  if (!threads_.empty())
+  { return; }
+
+  if (!source_)
+  {
+    throw std::logic_error("The pipeline has no frame source to start from");
+  }
+
+  threads_.emplace_back(&MosaicPipeline::captureLoop, this);
+  threads_.emplace_back(&MosaicPipeline::featureLoop, this);
+  threads_.emplace_back(&MosaicPipeline::matchingLoop, this);
+}
+
+void MosaicPipeline::stop()
+{
+  stop_requested_ = true;
+  for (auto& thread : threads_)
+  {
+    thread.join();
+  }
+  threads_.clear();
+}
+
+void MosaicPipeline::process(FrameData& frame)
+{
+  checkNotRunning();
+  setDeadline(frame);
+
+  auto start = Clock::now();
+  extractFeatures(frame);
+  auto end = Clock::now();
+  stats(PipelineStage::features).record(end - start);
+
+  start = end;
+  registerFrame(frame);
+  stats(PipelineStage::matching).record(Clock::now() - start);
+  adaptKeypointBudget(frame);
+}
+
+bool MosaicPipeline::match(FrameData& frame, std::shared_ptr<const Reference> keyframe)
+{
+  checkNotRunning();
+  return matchKeyframe(frame, std::move(keyframe));
+}
+
+void MosaicPipeline::estimate(FrameData& frame)
+{
+  checkNotRunning();
+  estimateFromMatches(frame);
+}
+
+bool MosaicPipeline::tryPopResult(FramePtr& frame)
+{
+  return compositing_queue_.tryPop(frame);
+}
+
+void MosaicPipeline::recycle(FramePtr& frame)
+{
+  // Destroy the frame if the pool is full.
+  if (frame && !free_frames_.tryPush(frame))
+  {
+    frame.reset();
+  }
+}
+
+FramePtr MosaicPipeline::takeFrame()
+{
+  FramePtr frame;
+  if (free_frames_.tryPop(frame))
+  {
+    frame->reset();
+    return frame;
+  }
+
+  return std::make_unique<FrameData>();
+}
+
+bool MosaicPipeline::finished() const
+{
+  return (matching_done_ || stop_requested_) && compositing_queue_.size() == 0;
+}
+
+bool MosaicPipeline::setReference(FrameData& frame)
+{
+  // The feature stage skips detection while the matching stage is tracking,
+  // and a reference without descriptors would never match the following frames.
+  if (!frame.detected)
+  {
+    detectAndDescribe(frame, *reference_detector_, *reference_desc_extractor_);
+  }
+
+  if (frame.descriptors.empty())
+  { return false; }
+
+  frame.is_reference = true;
+  std::atomic_store(&pending_reference_, std::shared_ptr<const Reference>{makeKeyframe(frame, Eigen::Matrix3f::Identity())});
+  ++map_generation_;
+  return true;
+}
+
+void MosaicPipeline::clearReference()
+{
+  std::atomic_store(&pending_reference_, std::shared_ptr<const Reference>{});
+  ++map_generation_;
+}
+
+int MosaicPipeline::mapGeneration() const
+{
+  return map_generation_;
+}
+
+StageStats& MosaicPipeline::stats(PipelineStage stage)
+{
+  return stats_[static_cast<int>(stage)];
+}
+
+size_t MosaicPipeline::queueSize(PipelineStage stage) const
+{
+  switch (stage)
+  {
+    case PipelineStage::capture: return 0;
+    case PipelineStage::features: return features_queue_.size();
+    case PipelineStage::matching: return matching_queue_.size();
+    case PipelineStage::compositing: return compositing_queue_.size();
+  }
+
+  return 0;
+}
+
+bool MosaicPipeline::meetsDeadline(const FrameData& frame, DurationInMs remaining_work) const
+{
+  return settings_.frame_budget <= DurationInMs{0} || frame.deadline - Clock::now() >= remaining_work;
+}
+
+void MosaicPipeline::recordDeadline(const FrameData& frame, bool skipped)
+{
+  if (settings_.frame_budget <= DurationInMs{0})
+  { return; }
+
+  // A skipped frame is finished in time, but only because it was not composited.
+  if (skipped)
+  {
+    deadline_stats_.num_skipped.fetch_add(1, std::memory_order_relaxed);
+  }
+  else if (Clock::now() <= frame.deadline)
+  {
+    deadline_stats_.num_met.fetch_add(1, std::memory_order_relaxed);
+  }
+  else
+  {
+    deadline_stats_.num_missed.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+DeadlineStats& MosaicPipeline::deadlineStats()
+{
+  return deadline_stats_;
+}
+
+int MosaicPipeline::keypointBudget() const
+{
+  return keypoint_budget_.load(std::memory_order_relaxed);
+}
+
+void MosaicPipeline::captureLoop()
+{
+  StageStats& stats = this->stats(PipelineStage::capture);
+  int next_id = 0;
+
+  while (!stop_requested_)
+  {
+    auto data = takeFrame();
+
+    // Read a frame from the source.
+    const auto start = Clock::now();
+    bool captured;
+    {
+      LAB_MOSAIC_SCOPED_TIMER(TimedEvent::capture);
+      captured = source_(data->frame) && !data->frame.empty();
+    }
+    if (!captured)
+    { break; }
+    data->capture_time = Clock::now();
+    data->id = next_id++;
+    setDeadline(*data);
+    stats.record(data->capture_time - start);
+
+    if (settings_.live_source)
+    {
+      // Make room for the new frame by dropping the oldest one.
+      while (!features_queue_.tryPush(data))
+      {
+        FramePtr oldest;
+        if (features_queue_.tryPop(oldest))
+        {
+          stats.num_dropped.fetch_add(1, std::memory_order_relaxed);
+          recycle(oldest);
+        }
+      }
+    }
+    else if (!pushWait(features_queue_, data))
+    {
+      break;
+    }
+  }
+
+  capture_done_ = true;
+}
+
+void MosaicPipeline::featureLoop()
+{
+  StageStats& stats = this->stats(PipelineStage::features);
+  FramePtr data;
+
+  while (!stop_requested_)
+  {
+    if (!features_queue_.tryPop(data))
+    {
+      if (capture_done_ && features_queue_.size() == 0)
+      { break; }
+
+      std::this_thread::sleep_for(idle_sleep);
+      continue;
+    }
+
+    const auto start = Clock::now();
+    extractFeatures(*data);
+    stats.record(Clock::now() - start);
+
+    if (!pushWait(matching_queue_, data))
+    { break; }
+  }
+
+  features_done_ = true;
+}
+
+void MosaicPipeline::matchingLoop()
+{
+  StageStats& stats = this->stats(PipelineStage::matching);
+  FramePtr data;
+
+  while (!stop_requested_)
+  {
+    if (!matching_queue_.tryPop(data))
+    {
+      if (features_done_ && matching_queue_.size() == 0)
+      { break; }
+
+      std::this_thread::sleep_for(idle_sleep);
+      continue;
+    }
+
+    const auto start = Clock::now();
+    registerFrame(*data);
+    stats.record(Clock::now() - start);
+    adaptKeypointBudget(*data);
+
+    if (!pushWait(compositing_queue_, data))
+    { break; }
+  }
+
+  matching_done_ = true;
+}
+
+void MosaicPipeline::extractFeatures(FrameData& data)
+{
+  // Convert frame to gray scale image.
+  {
+    LAB_MOSAIC_SCOPED_TIMER(TimedEvent::conversion);
+    cv::cvtColor(data.frame, data.gray_frame, cv::COLOR_BGR2GRAY);
+  }
+
+  // Detect keypoints and compute descriptors, unless the matching stage is able to track the frame.
+  // The descriptors are computed here, so that the frame is ready both for matching and for becoming a reference.
+  if (!(settings_.tracking && tracking_active_))
+  {
+    detectAndDescribe(data, *detector_, *desc_extractor_);
+  }
+}
+
+void MosaicPipeline::setDeadline(FrameData& data) const
+{
+  if (settings_.frame_budget > DurationInMs{0})
+  {
+    data.deadline = data.capture_time + std::chrono::duration_cast<Clock::duration>(settings_.frame_budget);
+  }
+}
+
+void MosaicPipeline::registerFrame(FrameData& data)
+{
+  // Start a new keyframe map if the reference has been set or cleared.
+  const int map_generation = map_generation_;
+  if (map_generation != local_map_generation_)
+  {
+    local_map_generation_ = map_generation;
+    keyframes_.clear();
+    track_reference_ = nullptr;
+
+    if (const auto pending = std::atomic_load(&pending_reference_))
+    {
+      keyframes_.addKeyframe(std::make_shared<Reference>(*pending));
+    }
+  }
+  data.map_generation = local_map_generation_;
+
+  // Try to track the frame first.
+  if (settings_.tracking && track_reference_ && num_tracked_frames_ < settings_.max_tracked_frames)
+  {
+    if (trackFrame(data))
+    {
+      tracking_active_ = track_reference_ != nullptr;
+      return;
+    }
+
+    data.path = FramePath::tracking_fallback;
+    data.estimate.num_inliers = 0;
+    data.estimate.inliers.clear();
+    data.estimated = false;
+  }
+  track_reference_ = nullptr;
+  num_tracked_frames_ = 0;
+
+  // The feature stage skips detection while we are tracking.
+  if (!data.detected)
+  {
+    detectAndDescribe(data, *fallback_detector_, *fallback_desc_extractor_);
+  }
+
+  if (keyframes_.empty())
+  {
+    if (settings_.auto_reference && !data.descriptors.empty())
+    {
+      // This frame becomes the reference for the following frames.
+      data.reference = keyframes_.addKeyframe(makeKeyframe(data, Eigen::Matrix3f::Identity()));
+      data.is_reference = true;
+      data.registered = true;
+
+      // Track the keypoints of the reference, which correspond to themselves.
+      if (settings_.tracking)
+      {
+        cv::KeyPoint::convert(data.keypoints, track_frame_points_);
+        track_reference_points_ = track_frame_points_;
+        track_gray_frame_ = data.gray_frame;
+        track_reference_ = data.reference;
+      }
+    }
+  }
+  else
+  {
+    matchFrame(data);
+
+    // Track the inliers into the next frame.
+    if (settings_.tracking && data.registered)
+    {
+      updateTrack(data, matching_pts1_, matching_pts2_);
+    }
+  }
+
+  tracking_active_ = track_reference_ != nullptr;
+}
+
+void MosaicPipeline::matchFrame(FrameData& data)
+{
+  if (data.descriptors.empty())
+  { return; }
+
+  // Find the nearest keyframe through the index, unless there is only one.
+  const auto start = Clock::now();
+  auto keyframe = keyframes_.size() == 1 ? keyframes_.keyframe(0) : keyframes_.findNearest(data.descriptors);
+  const bool matched = matchKeyframe(data, std::move(keyframe));
+
+  // The matching time includes finding the keyframe.
+  data.matching_duration = Clock::now() - start;
+  if (!matched)
+  { return; }
+
+  estimateFromMatches(data);
+  if (!data.registered)
+  { return; }
+
+  // Insert a new keyframe when the frame has moved away from its keyframe.
+  constexpr size_t min_keyframe_inliers = 30;
+  if (settings_.keyframe_min_overlap > 0.f && data.estimate.num_inliers >= min_keyframe_inliers &&
+      computeOverlap(data.estimate.homography, data.frame.size(), data.reference->image.size(), overlap_intersection_) <
+      settings_.keyframe_min_overlap)
+  {
+    keyframes_.addKeyframe(makeKeyframe(data, data.to_mosaic));
+    data.is_new_keyframe = true;
+  }
+}
+
+bool MosaicPipeline::matchKeyframe(FrameData& data, std::shared_ptr<const Reference> keyframe)
+{
+  data.reference = std::move(keyframe);
+  if (data.descriptors.empty() || !data.reference || data.reference->descriptors.empty())
+  { return false; }
+
+  // Match descriptors with ratio test.
+  const auto start = Clock::now();
+  {
+    LAB_MOSAIC_SCOPED_TIMER(TimedEvent::matching);
+    matcher_.match(data.descriptors, data.reference->descriptors, data.good_matches);
+  }
+  data.matching_duration = Clock::now() - start;
+
+  return data.good_matches.size() >= settings_.features.min_matches;
+}
+
+void MosaicPipeline::estimateFromMatches(FrameData& data)
+{
+  if (!data.reference || data.good_matches.size() < settings_.features.min_matches)
+  { return; }
+
+  // Extract pixel coordinates for corresponding points, and estimate the homography.
+  // The point buffers only grow, and the estimate is written into the memory of the frame data.
+  const auto start = Clock::now();
+  const auto num_matches = static_cast<Eigen::Index>(data.good_matches.size());
+  reserveColumns(matching_pts1_, num_matches);
+  reserveColumns(matching_pts2_, num_matches);
+  extractMatchingPoints(data.keypoints, data.reference->keypoints, data.good_matches,
+                        matching_pts1_.leftCols(num_matches), matching_pts2_.leftCols(num_matches));
+  estimateHomography(estimator_, data, matching_pts1_.leftCols(num_matches), matching_pts2_.leftCols(num_matches),
+                     data.estimate);
+  data.estimated = true;
+  data.estimation_duration = Clock::now() - start;
+
+  if (data.estimate.num_inliers == 0)
+  { return; }
+
+  // Refine a coarse homography at full resolution.
+  if (data.coarse_scale > 1.f)
+  {
+    refineAtFullResolution(data);
+  }
+
+  // Chain the frame to the mosaic through its keyframe.
+  data.to_mosaic = data.reference->to_mosaic * data.estimate.homography;
+  data.registered = true;
+  storeInliers(data, matching_pts1_, matching_pts2_);
+}
+
+bool MosaicPipeline::trackFrame(FrameData& data)
+{
+  // Track the inliers from the previous frame with pyramidal optical flow.
+  const auto start = Clock::now();
+  {
+    LAB_MOSAIC_SCOPED_TIMER(TimedEvent::tracking);
+    cv::calcOpticalFlowPyrLK(track_gray_frame_, data.gray_frame, track_frame_points_, tracked_points_,
+                             tracked_status_, tracked_errors_, cv::Size(21, 21), 3);
+  }
+
+  // Keep the points that were tracked successfully, and stayed inside the frame.
+  const cv::Rect frame_rect{cv::Point{0, 0}, data.gray_frame.size()};
+  Eigen::Index num_tracked = 0;
+  reserveColumns(matching_pts1_, static_cast<Eigen::Index>(tracked_points_.size()));
+  reserveColumns(matching_pts2_, static_cast<Eigen::Index>(tracked_points_.size()));
+  for (size_t i = 0; i < tracked_points_.size(); ++i)
+  {
+    if (tracked_status_[i] && frame_rect.contains(tracked_points_[i]))
+    {
+      matching_pts1_.col(num_tracked) << tracked_points_[i].x, tracked_points_[i].y;
+      matching_pts2_.col(num_tracked) << track_reference_points_[i].x, track_reference_points_[i].y;
+      ++num_tracked;
+    }
+  }
+
+  const auto tracked = Clock::now();
+  data.matching_duration = tracked - start;
+
+  if (static_cast<size_t>(num_tracked) < settings_.min_tracked_inliers)
+  { return false; }
+
+  // Estimate the homography to the tracked keyframe.
+  // The tracked points are not ordered by quality, so they are sampled uniformly rather than with PROSAC.
+  estimateHomography(tracking_estimator_, data, matching_pts1_.leftCols(num_tracked),
+                     matching_pts2_.leftCols(num_tracked), data.estimate);
+  data.estimated = true;
+  data.estimation_duration = Clock::now() - tracked;
+
+  if (data.estimate.num_inliers < settings_.min_tracked_inliers)
+  { return false; }
+
+  data.reference = track_reference_;
+  data.to_mosaic = data.reference->to_mosaic * data.estimate.homography;
+  data.registered = true;
+  data.path = FramePath::tracking;
+  storeInliers(data, matching_pts1_, matching_pts2_);
+  ++num_tracked_frames_;
+
+  updateTrack(data, matching_pts1_, matching_pts2_);
+
+  // When the frame has moved away from its keyframe, detect keypoints in the next frame so that it may become a keyframe.
+  if (settings_.keyframe_min_overlap > 0.f &&
+      computeOverlap(data.estimate.homography, data.frame.size(), data.reference->image.size(), overlap_intersection_) <
+      settings_.keyframe_min_overlap)
+  {
+    track_reference_ = nullptr;
+  }
+
+  return true;
+}
+
+void MosaicPipeline::refineAtFullResolution(FrameData& data)
+{
+  const cv::Mat& keyframe = data.reference->gray_image;
+  if (keyframe.empty())
+  { return; }
+
+  // The keypoints were detected in the downscaled frame, so the search windows must cover a few of its pixels.
+  const int search_radius = std::clamp(static_cast<int>(2.f * data.coarse_scale), 4, 16);
+  const Eigen::Matrix3f& H = data.estimate.homography;
+
+  // Match a patch around each of the best coarse inliers within a window around its predicted position in the keyframe.
+  const size_t num_candidates = std::min(data.estimate.inliers.size(), max_fine_points);
+  reserveColumns(fine_pts1_, static_cast<Eigen::Index>(num_candidates));
+  reserveColumns(fine_pts2_, static_cast<Eigen::Index>(num_candidates));
+  Eigen::Index num_matched = 0;
+  {
+    LAB_MOSAIC_SCOPED_TIMER(TimedEvent::matching);
+    for (size_t k = 0; k < num_candidates; ++k)
+    {
+      const Eigen::Vector2f frame_pt = matching_pts1_.col(data.estimate.inliers[k]);
+      const Eigen::Vector2f predicted = (H * frame_pt.homogeneous()).hnormalized();
+
+      Eigen::Vector2f keyframe_pt;
+      if (matchWindow(data.gray_frame, keyframe, frame_pt, predicted, search_radius, fine_scores_, keyframe_pt))
+      {
+        fine_pts1_.col(num_matched) = frame_pt;
+        fine_pts2_.col(num_matched) = keyframe_pt;
+        ++num_matched;
+      }
+    }
+  }
+
+  if (static_cast<size_t>(num_matched) < settings_.features.min_matches)
+  { return; }
+
+  estimateHomography(estimator_, data, fine_pts1_.leftCols(num_matched), fine_pts2_.leftCols(num_matched),
+                     fine_estimate_);
+  if (fine_estimate_.num_inliers < settings_.features.min_matches)
+  { return; }
+
+  // Continue with the full resolution correspondences, so that the stored and tracked inliers are accurate as well.
+  std::swap(data.estimate, fine_estimate_);
+  matching_pts1_.swap(fine_pts1_);
+  matching_pts2_.swap(fine_pts2_);
+}
+
+void MosaicPipeline::estimateHomography(HomographyEstimator& estimator, const FrameData& data,
+                                        const Eigen::Ref<const Eigen::Matrix2Xf>& pts1,
+                                        const Eigen::Ref<const Eigen::Matrix2Xf>& pts2, HomographyEstimate& estimate)
+{
+  if (settings_.frame_budget <= DurationInMs{0})
+  {
+    estimator.estimate(pts1, pts2, estimate);
+    return;
+  }
+
+  // RANSAC gets its share of the budget, but no more than what is left before the frame must be composited.
+  const DurationInMs compositing_latency{stats(PipelineStage::compositing).latency_ms.load(std::memory_order_relaxed)};
+  const DurationInMs time_left = data.deadline - Clock::now() - compositing_latency;
+  const DurationInMs time_budget = std::min(time_left, settings_.ransac_budget_share * settings_.frame_budget);
+  if (!estimator.estimate(pts1, pts2, estimate, time_budget))
+  {
+    deadline_stats_.num_ransac_stopped.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void MosaicPipeline::adaptKeypointBudget(const FrameData& data)
+{
+  // Only frames with detected keypoints show how the number of keypoints affects the latency.
+  if (settings_.frame_budget <= DurationInMs{0} || !data.detected)
+  { return; }
+
+  // The frame should be registered in time to be composited before its deadline.
+  const DurationInMs compositing_latency{stats(PipelineStage::compositing).latency_ms.load(std::memory_order_relaxed)};
+  const DurationInMs target = settings_.frame_budget - compositing_latency;
+  const DurationInMs latency = Clock::now() - data.capture_time;
+
+  // Shrink the budget quickly when the frame is late, and grow it slowly when there is plenty of time,
+  // with a band in between so that the budget settles rather than oscillates.
+  const int budget = keypoint_budget_.load(std::memory_order_relaxed);
+  int new_budget = budget;
+  if (latency > target)
+  {
+    new_budget = static_cast<int>(0.85f * static_cast<float>(budget));
+  }
+  else if (latency < 0.7 * target)
+  {
+    new_budget = static_cast<int>(1.1f * static_cast<float>(budget)) + 1;
+  }
+
+  const int max_keypoints = settings_.features.max_keypoints;
+  keypoint_budget_.store(std::clamp(new_budget, std::min(settings_.min_keypoints, max_keypoints), max_keypoints),
+                         std::memory_order_relaxed);
+}
+
+void MosaicPipeline::storeInliers(FrameData& data, const Eigen::Matrix2Xf& frame_pts, const Eigen::Matrix2Xf& reference_pts)
+{
+  const auto num_inliers = static_cast<Eigen::Index>(data.estimate.inliers.size());
+  reserveColumns(data.inlier_pts, num_inliers);
+  reserveColumns(data.reference_inlier_pts, num_inliers);
+  data.num_inlier_pts = num_inliers;
+  for (Eigen::Index i = 0; i < num_inliers; ++i)
+  {
+    data.inlier_pts.col(i) = frame_pts.col(data.estimate.inliers[i]);
+    data.reference_inlier_pts.col(i) = reference_pts.col(data.estimate.inliers[i]);
+  }
+}
+
+void MosaicPipeline::updateTrack(const FrameData& data, const Eigen::Matrix2Xf& frame_pts, const Eigen::Matrix2Xf& reference_pts)
+{
+  track_frame_points_.clear();
+  track_reference_points_.clear();
+  for (const auto i : data.estimate.inliers)
+  {
+    track_frame_points_.emplace_back(frame_pts(0, i), frame_pts(1, i));
+    track_reference_points_.emplace_back(reference_pts(0, i), reference_pts(1, i));
+  }
+
+  track_gray_frame_ = data.gray_frame;
+  track_reference_ = data.reference;
+}
+
+void MosaicPipeline::detectAndDescribe(FrameData& data, cv::Feature2D& detector, cv::Feature2D& desc_extractor) const
+{
+  // Detect keypoints, in a downscaled frame when registering coarse-to-fine.
+  const auto start = Clock::now();
+  const int levels = coarseLevels(data.gray_frame.cols, settings_.coarse_width);
+  const cv::Mat& detection_frame = levels > 0 ? data.coarse_gray_frame : data.gray_frame;
+  {
+    LAB_MOSAIC_SCOPED_TIMER(TimedEvent::detection);
+    if (levels > 0)
+    {
+      const cv::Size coarse_size{data.gray_frame.cols >> levels, data.gray_frame.rows >> levels};
+      cv::resize(data.gray_frame, data.coarse_gray_frame, coarse_size, 0., 0., cv::INTER_AREA);
+    }
+    detector.detect(detection_frame, data.keypoints);
+    cv::KeyPointsFilter::retainBest(data.keypoints, keypointBudget());
+  }
+  const auto detected = Clock::now();
+  data.detection_duration = detected - start;
+
+  // Compute descriptors.
+  {
+    LAB_MOSAIC_SCOPED_TIMER(TimedEvent::description);
+    desc_extractor.compute(detection_frame, data.keypoints, data.descriptors);
+  }
+  data.description_duration = Clock::now() - detected;
+  data.detected = true;
+
+  // Map the keypoints to the full resolution frame, where pixel centers are at half-pixel offsets from the coarse ones.
+  data.coarse_scale = static_cast<float>(1 << levels);
+  if (levels > 0)
+  {
+    const float scale = data.coarse_scale;
+    for (auto& keypoint : data.keypoints)
+    {
+      keypoint.pt = (keypoint.pt + cv::Point2f{0.5f, 0.5f}) * scale - cv::Point2f{0.5f, 0.5f};
+      keypoint.size *= scale;
+    }
+  }
+}
+
+cv::Ptr<cv::Feature2D> MosaicPipeline::createDetector(const PipelineSettings& settings)
+{
+  const FeatureSettings& features = settings.features;
+  validateFeatureSettings(features);
+
+  if (settings.detection == DetectionStrategy::global)
+  {
+    return createFeatureDetector(features, features.max_keypoints);
+  }
+
+  // Share the keypoint budget between the cells.
+  const int num_cells = std::max(settings.detection_grid.area(), 1);
+  const int max_in_cell = (features.max_keypoints + num_cells - 1) / num_cells;
+  return GridDetector::create([features, max_in_cell]() { return createFeatureDetector(features, 4*max_in_cell); },
+                              settings.detection_grid, max_in_cell, detectorPatchWidth(features.detector));
+}
+
+std::shared_ptr<Reference> MosaicPipeline::makeKeyframe(const FrameData& frame, const Eigen::Matrix3f& to_mosaic)
+{
+  auto keyframe = std::make_shared<Reference>();
+  keyframe->frame_id = frame.id;
+  keyframe->image = frame.frame;
+  keyframe->gray_image = frame.gray_frame;
+  keyframe->keypoints = frame.keypoints;
+  keyframe->descriptors = frame.descriptors;
+  keyframe->to_mosaic = to_mosaic;
+  return keyframe;
+}
+
+void MosaicPipeline::checkNotRunning() const
+{
+  if (!threads_.empty())
+  {
+    throw std::logic_error("Frames cannot be processed on the calling thread while the stage threads are running");
+  }
+}
+
+bool MosaicPipeline::pushWait(BoundedQueue<FramePtr>& queue, FramePtr& frame)
+{
+  while (!queue.tryPush(frame))
+  {
+    if (stop_requested_)
+    { return false; }
+
+    std::this_thread::sleep_for(idle_sleep);
+  }
+
+  return true;
+}
@@ -0,0 +1,455 @@
+#pragma once
+
+#include "bounded_queue.h"
+#include "feature_config.h"
+#include "homography_estimator.h"
+#include "keyframe_map.h"
+
+#include "opencv2/core.hpp"
+#include "opencv2/features2d.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Make shorthand aliases for timing tools.
+using Clock = std::chrono::high_resolution_clock;
+using DurationInMs = std::chrono::duration<double, std::milli>;
+
+/// \brief How a frame was registered.
+enum class FramePath
+{
+  /// \brief Keypoints were detected and matched against a keyframe.
+  detection,
+
+  /// \brief The inliers from the previous frame were tracked with optical flow.
+  tracking,
+
+  /// \brief Tracking failed, so keypoints were detected and matched after all.
+  tracking_fallback
+};
+
+/// \return The name of a frame path.
+const char* pathName(FramePath path);
+
+/// \brief Data for a frame, which is filled in as the frame passes through the pipeline.
+///
+/// Frames are recycled by the pipeline, so the images, keypoints, matches and inliers of a frame
+/// are reused as buffers for later frames.
+struct FrameData
+{
+  /// \brief Clears the data for a new frame, while keeping the memory of the buffers.
+  /// Images that are shared with others, such as with a keyframe, are released rather than overwritten.
+  void reset();
+
+  int id{0};
+  Clock::time_point capture_time;
+
+  /// \brief The time the frame should be composited by, which is only set when there is a frame budget.
+  Clock::time_point deadline{Clock::time_point::max()};
+
+  cv::Mat frame;
+  cv::Mat gray_frame;
+
+  /// \brief The downscaled gray frame that keypoints are detected in when registering coarse-to-fine,
+  /// and the scale from it to the frame. The keypoints are scaled to the frame after detection.
+  cv::Mat coarse_gray_frame;
+  float coarse_scale{1.f};
+
+  bool detected{false};
+  std::vector<cv::KeyPoint> keypoints;
+  cv::Mat descriptors;
+  DurationInMs detection_duration{0};
+  DurationInMs description_duration{0};
+
+  /// \brief The keyframe this frame was matched against, and the keyframe map generation it belongs to.
+  std::shared_ptr<const Reference> reference;
+  int map_generation{0};
+  FramePath path{FramePath::detection};
+  bool is_reference{false};
+  bool is_new_keyframe{false};
+  std::vector<cv::DMatch> good_matches;
+  DurationInMs matching_duration{0};
+
+  bool estimated{false};
+  HomographyEstimate estimate{};
+  DurationInMs estimation_duration{0};
+
+  /// \brief True if the frame was registered, so that to_mosaic maps pixels in the frame to the mosaic frame.
+  bool registered{false};
+  Eigen::Matrix3f to_mosaic{Eigen::Matrix3f::Identity()};
+
+  /// \brief The inlier correspondences between the frame and its reference, when registered.
+  /// Only the first num_inlier_pts columns are used, since the matrices only grow so that they keep their memory.
+  Eigen::Matrix2Xf inlier_pts;
+  Eigen::Matrix2Xf reference_inlier_pts;
+  Eigen::Index num_inlier_pts{0};
+};
+
+using FramePtr = std::unique_ptr<FrameData>;
+
+/// \brief How keypoints are detected.
+enum class DetectionStrategy
+{
+  /// \brief Detect in the whole image, and keep the strongest keypoints.
+  global,
+
+  /// \brief Detect in cells on a grid in parallel, and keep the strongest keypoints in each cell.
+  /// This spreads the keypoints over the image.
+  grid
+};
+
+/// \brief Settings for the mosaic pipeline.
+struct PipelineSettings
+{
+  /// \brief True if the source is live, so that old frames should be dropped rather than delaying new ones.
+  bool live_source{true};
+
+  /// \brief If true, the first frame with descriptors becomes the reference when there is none.
+  bool auto_reference{false};
+
+  /// \brief A registered frame becomes a keyframe when it overlaps less than this with its keyframe.
+  /// Set to zero to only match against the reference.
+  float keyframe_min_overlap{0.5f};
+
+  /// \brief If true, frames are registered by tracking the inliers from the previous frame with optical flow,
+  /// and keypoints are only detected and matched when tracking fails.
+  bool tracking{false};
+
+  /// \brief The keypoint detector, descriptor extractor and matcher.
+  FeatureSettings features{};
+
+  /// \brief How keypoints are detected.
+  DetectionStrategy detection{DetectionStrategy::global};
+
+  /// \brief The grid used by the grid detection strategy.
+  cv::Size detection_grid{8, 6};
+
+  /// \brief Tracking fails when fewer inliers than this are left.
+  size_t min_tracked_inliers{50};
+
+  /// \brief Keypoints are detected again after this many tracked frames, to limit drift.
+  int max_tracked_frames{30};
+
+  /// \brief If true, homographies are refined with Levenberg-Marquardt after RANSAC.
+  bool refine_homographies{true};
+
+  /// \brief If true, RANSAC rejects bad hypotheses early with the SPRT, which pays off with many correspondences.
+  bool sprt{true};
+
+  /// \brief The seed for RANSAC, or none for a random seed. A fixed seed makes the estimates reproducible.
+  std::optional<std::uint32_t> ransac_seed{};
+
+  /// \brief If positive, frames at least twice this wide are registered coarse-to-fine.
+  ///
+  /// Keypoints are detected and matched in the frame downscaled by a power of two to at least this width.
+  /// The coarse homography is then refined at full resolution, by matching patches around the inliers
+  /// within small windows predicted by the coarse homography.
+  /// This keeps the cost of registration nearly constant as the resolution grows.
+  int coarse_width{0};
+
+  /// \brief If positive, each frame should be composited within this time from when it was captured.
+  ///
+  /// RANSAC stops with the best hypothesis so far when its share of the budget is spent,
+  /// and the number of keypoints is adapted to how long the recent frames took to register.
+  /// The caller may skip compositing frames that would miss their deadline, see MosaicPipeline::meetsDeadline().
+  DurationInMs frame_budget{0};
+
+  /// \brief The share of the frame budget that RANSAC may spend on a frame.
+  float ransac_budget_share{0.25f};
+
+  /// \brief The fewest keypoints the frame budget may reduce detection to.
+  int min_keypoints{200};
+
+  /// \brief The capacity of each queue between stages, which must be a power of two.
+  size_t queue_capacity{4};
+
+  /// \brief The maximum number of processed frames kept for reuse, which must be a power of two.
+  /// Recycled frames beyond this are destroyed.
+  size_t frame_pool_capacity{16};
+};
+
+/// \brief The stages in the pipeline.
+enum class PipelineStage
+{
+  capture,
+  features,
+  matching,
+  compositing
+};
+
+/// \return The name of a pipeline stage.
+const char* stageName(PipelineStage stage);
+
+/// \brief Statistics for a pipeline stage.
+/// Each stage is updated by a single thread, and may be read from any thread.
+struct StageStats
+{
+  std::atomic<std::uint64_t> num_processed{0};
+  std::atomic<std::uint64_t> num_dropped{0};
+  std::atomic<double> latency_ms{0.};
+
+  /// \brief Records the processing time for a frame, and updates the smoothed latency.
+  void record(DurationInMs duration);
+};
+
+/// \brief Counts how frames did against their deadlines when there is a frame budget.
+/// The counters may be read from any thread.
+struct DeadlineStats
+{
+  std::atomic<std::uint64_t> num_met{0};
+  std::atomic<std::uint64_t> num_missed{0};
+
+  /// \brief The number of frames that were not composited, since they would have missed their deadline.
+  std::atomic<std::uint64_t> num_skipped{0};
+
+  /// \brief The number of estimates where RANSAC was stopped by its share of the budget.
+  std::atomic<std::uint64_t> num_ransac_stopped{0};
+};
+
+/// \brief Runs capture, feature extraction and matching/estimation on separate threads.
+///
+/// Frames are matched against the nearest keyframe in a keyframe map.
+/// A registered frame that overlaps too little with its keyframe becomes a new keyframe,
+/// chained to the mosaic through the homography of the keyframe it was registered against.
+///
+/// The stages are connected by bounded lock-free queues.
+/// When a downstream stage is too slow, upstream stages wait for room in the queue,
+/// except for live sources where the capture stage drops the oldest queued frame instead.
+/// The final stage (compositing) is run by the caller, which pops the processed frames with tryPopResult().
+///
+/// Alternatively, the caller may push frames through the feature and matching stages on its own thread with process(),
+/// without starting the stage threads.
+/// When the caller returns the frames with recycle(), their buffers are reused,
+/// so that the pipeline runs without allocating memory for each frame once the buffers have grown.
+///
+/// With a frame budget, each frame gets a deadline when it is captured.
+/// The pipeline keeps the frames within their budget by limiting RANSAC and adapting the number of keypoints,
+/// while the caller skips compositing the frames that are late, and reports each frame with recordDeadline().
+class MosaicPipeline
+{
+public:
+  /// \brief Reads the next frame, and returns false when there are no more frames.
+  using FrameSource = std::function<bool(cv::Mat&)>;
+
+  /// \brief Constructs the pipeline.
+  /// \param source The source of frames, which may be empty if frames are only pushed with process().
+  /// \param settings The pipeline settings. Throws std::invalid_argument if the frame budget settings are invalid.
+  explicit MosaicPipeline(FrameSource source, const PipelineSettings& settings = PipelineSettings{});
+
+  /// \brief Stops the pipeline.
+  ~MosaicPipeline();
+
+  MosaicPipeline(const MosaicPipeline&) = delete;
+  MosaicPipeline& operator=(const MosaicPipeline&) = delete;
+
+  /// \brief Starts the stage threads. Throws std::logic_error if the pipeline has no frame source.
+  void start();
+
+  /// \brief Stops the stage threads, and waits for them to finish.
+  void stop();
+
+  /// \brief Runs the feature and matching stages for a frame on the calling thread.
+  /// The frame must have its id, capture time and image set, and is otherwise filled in like the frames from the stage threads.
+  /// Throws std::logic_error if the stage threads are running.
+  void process(FrameData& frame);
+
+  /// \brief Matches the descriptors of a frame against a keyframe on the calling thread, like the matching stage does
+  /// once it has found the nearest keyframe. Sets the reference and the good matches of the frame.
+  /// Throws std::logic_error if the stage threads are running.
+  /// \return True if there are enough good matches to estimate a homography.
+  bool match(FrameData& frame, std::shared_ptr<const Reference> keyframe);
+
+  /// \brief Estimates the homography from a frame to its reference from the good matches on the calling thread,
+  /// like the matching stage does, and registers the frame if estimation succeeds.
+  /// A homography from keypoints detected in a downscaled frame is refined at full resolution.
+  /// Throws std::logic_error if the stage threads are running.
+  void estimate(FrameData& frame);
+
+  /// \brief Pops the next fully processed frame.
+  /// \return False if no frame is ready.
+  bool tryPopResult(FramePtr& frame);
+
+  /// \brief Returns a processed frame to the pipeline, so that its buffers can be reused for a later frame.
+  /// The frame is left empty.
+  void recycle(FramePtr& frame);
+
+  /// \return True when the source is exhausted and all frames have been popped.
+  bool finished() const;
+
+  /// \brief Starts a new keyframe map, with a processed frame as the reference for matching the following frames.
+  /// A frame that was tracked has no keypoints, so they are detected and described here, on the calling thread.
+  /// The frame is marked as the reference, so that it is recorded as such when it is recorded afterwards.
+  /// \return False if no keypoints were found in the frame, in which case the keyframe map is left unchanged.
+  bool setReference(FrameData& frame);
+
+  /// \brief Removes the reference and all keyframes.
+  void clearReference();
+
+  /// \return The current keyframe map generation, which changes every time the reference is set or cleared.
+  int mapGeneration() const;
+
+  /// \return The statistics for a stage.
+  StageStats& stats(PipelineStage stage);
+
+  /// \return The number of frames waiting in the queue in front of a stage.
+  size_t queueSize(PipelineStage stage) const;
+
+  /// \return True if a frame can still be finished before its deadline, with some work left to do on it.
+  /// This is always true when there is no frame budget.
+  bool meetsDeadline(const FrameData& frame, DurationInMs remaining_work) const;
+
+  /// \brief Counts a finished frame as having met, missed or been skipped to keep its deadline,
+  /// when there is a frame budget.
+  /// \param frame The finished frame.
+  /// \param skipped True if the frame was not composited, since it would have missed its deadline.
+  void recordDeadline(const FrameData& frame, bool skipped);
+
+  /// \return The deadline statistics.
+  DeadlineStats& deadlineStats();
+
+  /// \return The number of keypoints detected in each frame, which is adapted when there is a frame budget.
+  int keypointBudget() const;
+
+private:
+  void captureLoop();
+  void featureLoop();
+  void matchingLoop();
+
+  /// \brief Converts a frame to gray scale, and detects keypoints and computes descriptors unless it can be tracked.
+  void extractFeatures(FrameData& data);
+
+  /// \brief Takes a frame from the pool of recycled frames, or creates a new frame if the pool is empty.
+  FramePtr takeFrame();
+
+  /// \brief Pushes a frame, waiting for room in the queue. Returns false if the pipeline is stopped while waiting.
+  bool pushWait(BoundedQueue<FramePtr>& queue, FramePtr& frame);
+
+  /// \brief Sets the deadline of a captured frame, when there is a frame budget.
+  void setDeadline(FrameData& data) const;
+
+  /// \brief Registers a frame to the mosaic, by tracking or matching.
+  void registerFrame(FrameData& data);
+
+  /// \brief Estimates a homography for a frame, within the share of the frame budget for RANSAC.
+  void estimateHomography(HomographyEstimator& estimator, const FrameData& data,
+                          const Eigen::Ref<const Eigen::Matrix2Xf>& pts1, const Eigen::Ref<const Eigen::Matrix2Xf>& pts2,
+                          HomographyEstimate& estimate);
+
+  /// \brief Shrinks the keypoint budget when a registered frame is late for compositing, and grows it when there is time to spare.
+  void adaptKeypointBudget(const FrameData& data);
+
+  /// \brief Matches a frame against the nearest keyframe, and registers it to the mosaic.
+  void matchFrame(FrameData& data);
+
+  /// \brief Matches a frame against a keyframe, see match().
+  bool matchKeyframe(FrameData& data, std::shared_ptr<const Reference> keyframe);
+
+  /// \brief Estimates and refines the homography from the good matches of a frame, and registers it, see estimate().
+  void estimateFromMatches(FrameData& data);
+
+  /// \brief Throws std::logic_error if the stage threads are running, since the caller would race with them.
+  void checkNotRunning() const;
+
+  /// \brief Tracks the inliers from the previous frame, and registers the frame to the mosaic.
+  /// \return False if tracking failed.
+  bool trackFrame(FrameData& data);
+
+  /// \brief Refines a homography that was estimated from keypoints detected in a downscaled frame.
+  /// The inliers are matched again at full resolution, and the homography is estimated from these matches.
+  /// The coarse homography is kept if refinement fails.
+  void refineAtFullResolution(FrameData& data);
+
+  /// \brief Copies the inlier correspondences of a registered frame into the frame data.
+  static void storeInliers(FrameData& data, const Eigen::Matrix2Xf& frame_pts, const Eigen::Matrix2Xf& reference_pts);
+
+  /// \brief Stores the inliers of a registered frame, so that they can be tracked into the next frame.
+  void updateTrack(const FrameData& data, const Eigen::Matrix2Xf& frame_pts, const Eigen::Matrix2Xf& reference_pts);
+
+  /// \brief Detects keypoints and computes descriptors for a frame.
+  void detectAndDescribe(FrameData& data, cv::Feature2D& detector, cv::Feature2D& desc_extractor) const;
+
+  /// \brief Creates the keypoint detector for the feature settings and the detection strategy.
+  /// Throws std::invalid_argument if the feature settings are invalid.
+  static cv::Ptr<cv::Feature2D> createDetector(const PipelineSettings& settings);
+
+  /// \brief Creates a keyframe from a processed frame.
+  static std::shared_ptr<Reference> makeKeyframe(const FrameData& frame, const Eigen::Matrix3f& to_mosaic);
+
+  FrameSource source_;
+  PipelineSettings settings_;
+
+  cv::Ptr<cv::Feature2D> detector_;
+  cv::Ptr<cv::Feature2D> desc_extractor_;
+
+  /// \brief The matching stage has its own detector and extractor for when tracking fails.
+  cv::Ptr<cv::Feature2D> fallback_detector_;
+  cv::Ptr<cv::Feature2D> fallback_desc_extractor_;
+
+  /// \brief The detector and extractor for references set by the caller, which are only used by setReference().
+  cv::Ptr<cv::Feature2D> reference_detector_;
+  cv::Ptr<cv::Feature2D> reference_desc_extractor_;
+  FeatureMatcher matcher_;
+
+  /// \brief The estimator for matched points, which are ordered by match quality for PROSAC,
+  /// and the estimator for tracked points, which have no such order and are sampled uniformly.
+  HomographyEstimator estimator_;
+  HomographyEstimator tracking_estimator_;
+
+  /// \brief The keyframe map, which is only accessed by the matching stage.
+  KeyframeMap keyframes_;
+  int local_map_generation_;
+  Eigen::Matrix2Xf matching_pts1_;
+  Eigen::Matrix2Xf matching_pts2_;
+
+  /// \brief Buffers for refining coarse-to-fine registrations, which are swapped with the matching buffers on success.
+  Eigen::Matrix2Xf fine_pts1_;
+  Eigen::Matrix2Xf fine_pts2_;
+  HomographyEstimate fine_estimate_;
+  cv::Mat fine_scores_;
+
+  /// \brief Buffer for the intersection between a frame and its keyframe when computing their overlap.
+  std::vector<cv::Point2f> overlap_intersection_;
+
+  /// \brief The tracking state, which is only accessed by the matching stage.
+  /// Tracked points in the previous frame correspond to points in the tracked keyframe.
+  cv::Mat track_gray_frame_;
+  std::vector<cv::Point2f> track_frame_points_;
+  std::vector<cv::Point2f> track_reference_points_;
+  std::shared_ptr<const Reference> track_reference_;
+  int num_tracked_frames_;
+  std::vector<cv::Point2f> tracked_points_;
+  std::vector<uchar> tracked_status_;
+  std::vector<float> tracked_errors_;
+
+  /// \brief Tells the feature stage that detection can be skipped, since the matching stage is tracking.
+  std::atomic<bool> tracking_active_;
+
+  BoundedQueue<FramePtr> features_queue_;
+  BoundedQueue<FramePtr> matching_queue_;
+  BoundedQueue<FramePtr> compositing_queue_;
+
+  /// \brief Recycled frames, which are reused by the capture stage.
+  BoundedQueue<FramePtr> free_frames_;
+
+  /// \brief A new reference requested by setReference(), which the matching stage picks up when the generation changes.
+  std::shared_ptr<const Reference> pending_reference_;
+  std::atomic<int> map_generation_;
+
+  StageStats stats_[4];
+
+  /// \brief The keypoint budget, which is adapted by the matching stage and read by the feature stages.
+  std::atomic<int> keypoint_budget_;
+  DeadlineStats deadline_stats_;
+
+  std::atomic<bool> stop_requested_;
+  std::atomic<bool> capture_done_;
+  std::atomic<bool> features_done_;
+  std::atomic<bool> matching_done_;
+  std::vector<std::thread> threads_;
+};
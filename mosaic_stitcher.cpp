@@ -0,0 +1,120 @@
+#include "mosaic_stitcher.h"
+
+#include "metrics.h"
+
+#include "opencv2/core/eigen.hpp"
+
+#include <stdexcept>
+
+MosaicStitcher::MosaicStitcher(const StitcherSettings& settings)
+    : pipeline_{MosaicPipeline::FrameSource{}, pipelineSettings(settings)}
+    , next_id_{0}
+    , canvas_{settings.tile_size, CV_8UC3, settings.blend_mode}
+{ }
+
+StitchResult MosaicStitcher::addFrame(const cv::Mat& frame)
+{
+  if (frame.empty() || frame.type() != CV_8UC3)
+  {
+    throw std::invalid_argument("Frames must be 8-bit BGR images");
+  }
+
+  // Reuse the buffers of the previous frame.
+  // The copy is made after reset(), which releases the image if a keyframe still refers to it.
+  const auto start = Clock::now();
+  frame_.reset();
+  frame_.id = next_id_++;
+  frame_.capture_time = start;
+  frame.copyTo(frame_.frame);
+
+  pipeline_.process(frame_);
+
+  StitchResult result;
+  result.frame_id = frame_.id;
+  result.path = frame_.path;
+  result.num_inliers = frame_.estimate.num_inliers;
+
+  const std::lock_guard<std::mutex> lock{canvas_mutex_};
+  if (frame_.registered)
+  {
+    const auto composite_start = Clock::now();
+    {
+      LAB_MOSAIC_SCOPED_TIMER(TimedEvent::compositing);
+
+      cv::Matx33f H_cv;
+      cv::eigen2cv(frame_.to_mosaic, H_cv);
+      result.updated_region = canvas_.insert(frame_.frame, H_cv);
+    }
+    pipeline_.stats(PipelineStage::compositing).record(Clock::now() - composite_start);
+
+    result.registered = true;
+    result.to_mosaic = frame_.to_mosaic;
+  }
+  result.version = canvas_.version();
+
+  return result;
+}
+
+MosaicSnapshot MosaicStitcher::snapshot() const
+{
+  const std::lock_guard<std::mutex> lock{canvas_mutex_};
+
+  MosaicSnapshot snapshot;
+  snapshot.region = canvas_.bounds();
+  snapshot.version = canvas_.version();
+  canvas_.render(snapshot.region, snapshot.image);
+  return snapshot;
+}
+
+void MosaicStitcher::render(const cv::Rect& region, cv::Mat& image, std::uint64_t since_version) const
+{
+  const std::lock_guard<std::mutex> lock{canvas_mutex_};
+  canvas_.render(region, image, since_version);
+}
+
+cv::Rect MosaicStitcher::bounds() const
+{
+  const std::lock_guard<std::mutex> lock{canvas_mutex_};
+  return canvas_.bounds();
+}
+
+std::uint64_t MosaicStitcher::version() const
+{
+  const std::lock_guard<std::mutex> lock{canvas_mutex_};
+  return canvas_.version();
+}
+
+bool MosaicStitcher::exportTiles(TileExporter& exporter, bool wait) const
+{
+  const std::lock_guard<std::mutex> lock{canvas_mutex_};
+  return exporter.exportChanges(canvas_, wait);
+}
+
+void MosaicStitcher::reset()
+{
+  // With an empty keyframe map, the next frame becomes the reference.
+  pipeline_.clearReference();
+
+  const std::lock_guard<std::mutex> lock{canvas_mutex_};
+  canvas_.clear();
+}
+
+StageStats& MosaicStitcher::stats(PipelineStage stage)
+{
+  return pipeline_.stats(stage);
+}
+
+PipelineSettings MosaicStitcher::pipelineSettings(const StitcherSettings& settings)
+{
+  PipelineSettings pipeline_settings;
+  pipeline_settings.live_source = false;
+  pipeline_settings.auto_reference = true;
+  pipeline_settings.features = settings.features;
+  pipeline_settings.detection = settings.detection;
+  pipeline_settings.tracking = settings.tracking;
+  pipeline_settings.keyframe_min_overlap = settings.keyframe_min_overlap;
+  pipeline_settings.coarse_width = settings.coarse_width;
+  pipeline_settings.refine_homographies = settings.refine_homographies;
+  pipeline_settings.sprt = settings.sprt;
+  return pipeline_settings;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "feature_config.h"
+#include "mosaic_canvas.h"
+#include "mosaic_pipeline.h"
+#include "tile_exporter.h"
+
+#include "opencv2/core.hpp"
+#include "Eigen/Dense"
+
+#include <cstdint>
+#include <mutex>
+
+/// \brief Settings for the stitcher.
+struct StitcherSettings
+{
+  /// \brief The keypoint detector, descriptor extractor and matcher.
+  FeatureSettings features{};
+
+  /// \brief How keypoints are detected.
+  DetectionStrategy detection{DetectionStrategy::grid};
+
+  /// \brief If true, frames are registered by tracking the inliers from the previous frame with optical flow,
+  /// and keypoints are only detected and matched when tracking fails.
+  bool tracking{true};
+
+  /// \brief A registered frame becomes a keyframe when it overlaps less than this with its keyframe.
+  float keyframe_min_overlap{0.5f};
+
+  /// \brief Frames at least twice this wide are registered coarse-to-fine, see PipelineSettings::coarse_width.
+  int coarse_width{640};
+
+  /// \brief If true, homographies are refined with Levenberg-Marquardt after RANSAC.
+  bool refine_homographies{true};
+
+  /// \brief If true, RANSAC rejects bad hypotheses early with the SPRT, see PipelineSettings::sprt.
+  bool sprt{true};
+
+  /// \brief The width and height of the canvas tiles in pixels.
+  int tile_size{256};
+
+  /// \brief How frames are combined with the canvas.
+  BlendMode blend_mode{BlendMode::feather};
+};
+
+/// \brief The result of adding a frame to the mosaic.
+struct StitchResult
+{
+  int frame_id{0};
+
+  /// \brief True if the frame was registered and composited into the mosaic.
+  bool registered{false};
+
+  /// \brief How the frame was registered.
+  FramePath path{FramePath::detection};
+
+  /// \brief The pose of the frame, which is the homography mapping pixels in the frame to the mosaic.
+  Eigen::Matrix3f to_mosaic{Eigen::Matrix3f::Identity()};
+  size_t num_inliers{0};
+
+  /// \brief The region of the canvas that was updated, which is empty if nothing was composited.
+  cv::Rect updated_region;
+
+  /// \brief The canvas version after the frame was added.
+  /// Pass the version of an earlier update to render() to copy only what has changed since.
+  std::uint64_t version{0};
+};
+
+/// \brief A rendered image of the canvas.
+struct MosaicSnapshot
+{
+  cv::Mat image;
+
+  /// \brief The region of the canvas in the image.
+  cv::Rect region;
+
+  /// \brief The canvas version the image shows.
+  std::uint64_t version{0};
+};
+
+/// \brief Stitches frames pushed by the caller into a mosaic, without any GUI or threads of its own.
+///
+/// The first frame becomes the reference, and defines the mosaic coordinate system.
+/// Each following frame is registered against the nearest keyframe and composited into a tiled canvas,
+/// all on the thread that adds it.
+/// Frames must be added from one thread at a time, while the canvas may be rendered from any thread concurrently.
+class MosaicStitcher
+{
+public:
+  /// \brief Constructs the stitcher.
+  /// Throws std::invalid_argument if the feature settings are invalid.
+  explicit MosaicStitcher(const StitcherSettings& settings = StitcherSettings{});
+
+  /// \brief Registers a frame and composites it into the mosaic.
+  /// \param frame An 8-bit BGR image. It is copied, so the caller may reuse it right away.
+  /// \return The pose of the frame and the updated region of the canvas.
+  StitchResult addFrame(const cv::Mat& frame);
+
+  /// \brief Renders the whole canvas.
+  MosaicSnapshot snapshot() const;
+
+  /// \brief Renders a region of the canvas into an image, see MosaicCanvas::render().
+  void render(const cv::Rect& region, cv::Mat& image, std::uint64_t since_version = 0) const;
+
+  /// \return The bounding box of the canvas.
+  cv::Rect bounds() const;
+
+  /// \return The current canvas version.
+  std::uint64_t version() const;
+
+  /// \brief Queues the tiles that have changed since the previous export for writing, see TileExporter::exportChanges().
+  /// Frames cannot be added while it waits for the previous export.
+  bool exportTiles(TileExporter& exporter, bool wait = false) const;
+
+  /// \brief Starts a new mosaic, with the next frame as the reference.
+  void reset();
+
+  /// \return The statistics for the feature and matching stages, and for compositing.
+  StageStats& stats(PipelineStage stage);
+
+private:
+  static PipelineSettings pipelineSettings(const StitcherSettings& settings);
+
+  MosaicPipeline pipeline_;
+  FrameData frame_;
+  int next_id_;
+
+  mutable std::mutex canvas_mutex_;
+  MosaicCanvas canvas_;
+};
@@ -0,0 +1,147 @@
+#include "perspective_warp.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace
+{
+/// \brief The number of fractional bits in the fixed-point interpolation weights.
+constexpr int weight_bits = 5;
+constexpr int weight_scale = 1 << weight_bits;
+
+/// \brief The number of destination pixels for which source coordinates are computed at a time.
+constexpr int chunk_size = 256;
+
+/// \brief Warps a band of destination rows.
+/// \param H_inv Homography mapping pixels in the destination to pixels in the image.
+template<int channels>
+void warpRows(const cv::Mat& image, const cv::Matx33f& H_inv, cv::Mat& dst, cv::Mat& mask, WarpBorder border,
+              const cv::Range& rows)
+{
+  const float max_u = static_cast<float>(image.cols) - 0.5f;
+  const float max_v = static_cast<float>(image.rows) - 0.5f;
+  const float last_col = static_cast<float>(image.cols - 1);
+  const float last_row = static_cast<float>(image.rows - 1);
+
+  float us[chunk_size];
+  float vs[chunk_size];
+
+  for (int y = rows.start; y < rows.end; ++y)
+  {
+    uchar* dst_row = dst.ptr<uchar>(y);
+    uchar* mask_row = mask.empty() ? nullptr : mask.ptr<uchar>(y);
+
+    // The homogeneous source coordinates are linear along the row.
+    const float fy = static_cast<float>(y);
+    const float u_row = H_inv(0, 1) * fy + H_inv(0, 2);
+    const float v_row = H_inv(1, 1) * fy + H_inv(1, 2);
+    const float w_row = H_inv(2, 1) * fy + H_inv(2, 2);
+
+    for (int chunk_start = 0; chunk_start < dst.cols; chunk_start += chunk_size)
+    {
+      const int chunk_end = std::min(chunk_start + chunk_size, dst.cols);
+
+      // Compute the source coordinates for the chunk, which the compiler can vectorize.
+      // Points behind the camera are moved outside the image.
+      for (int i = 0; i < chunk_end - chunk_start; ++i)
+      {
+        const float fx = static_cast<float>(chunk_start + i);
+        const float w = H_inv(2, 0) * fx + w_row;
+        const float w_inv = w > 0.f ? 1.f / w : 0.f;
+        us[i] = w > 0.f ? (H_inv(0, 0) * fx + u_row) * w_inv : -1.f;
+        vs[i] = w > 0.f ? (H_inv(1, 0) * fx + v_row) * w_inv : -1.f;
+      }
+
+      // Sample the image at the source coordinates.
+      for (int x = chunk_start; x < chunk_end; ++x)
+      {
+        const float u = us[x - chunk_start];
+        const float v = vs[x - chunk_start];
+        const bool inside = u >= -0.5f && u < max_u && v >= -0.5f && v < max_v;
+
+        if (mask_row)
+        { mask_row[x] = inside ? 1 : 0; }
+
+        if (!inside && border == WarpBorder::transparent)
+        { continue; }
+
+        // Clamping the coordinates replicates the border pixels.
+        const int u_fixed = cvRound(std::clamp(u, 0.f, last_col) * weight_scale);
+        const int v_fixed = cvRound(std::clamp(v, 0.f, last_row) * weight_scale);
+        const int u0 = u_fixed >> weight_bits;
+        const int v0 = v_fixed >> weight_bits;
+        const int du = u_fixed & (weight_scale - 1);
+        const int dv = v_fixed & (weight_scale - 1);
+        const int u1 = std::min(u0 + 1, image.cols - 1);
+        const int v1 = std::min(v0 + 1, image.rows - 1);
+
+        const uchar* row0 = image.ptr<uchar>(v0);
+        const uchar* row1 = image.ptr<uchar>(v1);
+        const uchar* p00 = row0 + u0 * channels;
+        const uchar* p01 = row0 + u1 * channels;
+        const uchar* p10 = row1 + u0 * channels;
+        const uchar* p11 = row1 + u1 * channels;
+
+        const int w00 = (weight_scale - du) * (weight_scale - dv);
+        const int w01 = du * (weight_scale - dv);
+        const int w10 = (weight_scale - du) * dv;
+        const int w11 = du * dv;
+
+        constexpr int rounding = 1 << (2 * weight_bits - 1);
+        uchar* out = dst_row + x * channels;
+        for (int c = 0; c < channels; ++c)
+        {
+          out[c] = static_cast<uchar>(
+              (p00[c] * w00 + p01[c] * w01 + p10[c] * w10 + p11[c] * w11 + rounding) >> (2 * weight_bits));
+        }
+      }
+    }
+  }
+}
+}
+
+void warpPerspectiveFused(const cv::Mat& image, const cv::Matx33f& H, cv::Mat& dst, cv::OutputArray mask,
+                          WarpBorder border)
+{
+  if (image.depth() != CV_8U || image.channels() > 4)
+  {
+    throw std::invalid_argument("The image must be 8-bit with 1 to 4 channels");
+  }
+
+  if (dst.type() != image.type())
+  {
+    throw std::invalid_argument("The destination type does not match the image type");
+  }
+
+  cv::Mat mask_mat;
+  if (mask.needed())
+  {
+    mask.create(dst.size(), CV_8UC1);
+    mask_mat = mask.getMat();
+  }
+
+  if (image.empty() || dst.empty())
+  {
+    if (!mask_mat.empty())
+    { mask_mat.setTo(cv::Scalar::all(0)); }
+    return;
+  }
+
+  // Compute the inverse in double precision, since the homography may be poorly conditioned.
+  const cv::Matx33f H_inv = cv::Matx33d(H).inv();
+
+  // Warp bands of rows in parallel. Each band should be large enough to be worth the scheduling overhead.
+  constexpr int min_band_rows = 16;
+  const double num_bands = std::max(1, dst.rows / min_band_rows);
+
+  cv::parallel_for_(cv::Range(0, dst.rows), [&](const cv::Range& rows)
+  {
+    switch (image.channels())
+    {
+      case 1: warpRows<1>(image, H_inv, dst, mask_mat, border, rows); break;
+      case 2: warpRows<2>(image, H_inv, dst, mask_mat, border, rows); break;
+      case 3: warpRows<3>(image, H_inv, dst, mask_mat, border, rows); break;
+      default: warpRows<4>(image, H_inv, dst, mask_mat, border, rows); break;
+    }
+  }, num_bands);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+
+/// \brief What happens to destination pixels that the warped image does not cover.
+enum class WarpBorder
+{
+  transparent, ///< The pixels are left as they are.
+  replicate    ///< The pixels get the value of the nearest image border pixel.
+};
+
+/// \brief Warps an 8-bit image with a homography and bilinear interpolation,
+/// computing the warped pixels and which of them are covered by the image in a single pass over the destination.
+///
+/// Each destination row is mapped back into the image in chunks,
+/// first computing the source coordinates for the whole chunk and then sampling them with fixed-point weights.
+/// The rows are split into bands that are warped in parallel. No memory is allocated,
+/// except for the mask if it does not already have the size of the destination.
+/// \param image The image to warp, which must be 8-bit with 1 to 4 channels.
+/// \param H Homography mapping pixels in the image to pixels in the destination.
+/// \param[in,out] dst The destination, which must have the type of the image. Its size sets the region that is warped.
+///                    It may be a view into a larger image, such as a part of a tile.
+/// \param[out] mask Optional mask, which is 1 where the destination is covered by the image, and 0 elsewhere.
+///                  A pixel is covered when its nearest source pixel is inside the image.
+/// \param border What happens to destination pixels that are not covered.
+void warpPerspectiveFused(const cv::Mat& image, const cv::Matx33f& H, cv::Mat& dst,
+                          cv::OutputArray mask = cv::noArray(), WarpBorder border = WarpBorder::transparent);
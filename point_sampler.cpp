@@ -0,0 +1,95 @@
+#include "point_sampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+/// \brief Draws distinct indices in [0, range) into sample[first], ..., sample[3].
+/// The indices must also be distinct from sample[0], ..., sample[first-1].
+void drawDistinct(Eigen::Index range, int first, std::mt19937& generator, PointSampler::Sample& sample)
+{
+  std::uniform_int_distribution<Eigen::Index> distribution(0, range - 1);
+
+  for (int i = first; i < static_cast<int>(sample.size()); ++i)
+  {
+    do
+    {
+      sample[i] = distribution(generator);
+    } while (std::find(sample.begin(), sample.begin() + i, sample[i]) != sample.begin() + i);
+  }
+}
+}
+
+void UniformSampler::prepare(Eigen::Index num_points)
+{
+  num_points_ = num_points;
+}
+
+void UniformSampler::sample(int, std::mt19937& generator, Sample& sample) const
+{
+  drawDistinct(num_points_, 0, generator, sample);
+}
+
+Eigen::Index UniformSampler::sampleSetSize(int) const
+{
+  return num_points_;
+}
+
+ProsacSampler::ProsacSampler(int growth_max_samples)
+    : growth_max_samples_{growth_max_samples}
+{ }
+
+void ProsacSampler::prepare(Eigen::Index num_points)
+{
+  constexpr Eigen::Index m = std::tuple_size<Sample>::value;
+  num_points_ = num_points;
+
+  // T_n is the expected number of samples drawn from the best n correspondences
+  // among growth_max_samples samples drawn from all correspondences.
+  double T_n = growth_max_samples_;
+  for (Eigen::Index i = 0; i < m; ++i)
+  {
+    T_n *= static_cast<double>(m - i) / static_cast<double>(num_points_ - i);
+  }
+
+  // The sample numbers T'_n where the set of correspondences grows from n to n + 1.
+  growth_.clear();
+  growth_.reserve(num_points_ - m + 1);
+  growth_.push_back(1);
+  for (Eigen::Index n = m; n < num_points_; ++n)
+  {
+    const double T_next = T_n * static_cast<double>(n + 1) / static_cast<double>(n + 1 - m);
+    growth_.push_back(growth_.back() + static_cast<long>(std::ceil(T_next - T_n)));
+    T_n = T_next;
+  }
+}
+
+void ProsacSampler::sample(int iteration, std::mt19937& generator, Sample& sample) const
+{
+  const Eigen::Index n = sampleSetSize(iteration);
+
+  if (iteration + 1 > growth_.back())
+  {
+    // PROSAC has turned into standard RANSAC.
+    drawDistinct(n, 0, generator, sample);
+    return;
+  }
+
+  // The n-th best correspondence is always part of the samples drawn from the best n correspondences.
+  sample[0] = n - 1;
+  drawDistinct(n - 1, 1, generator, sample);
+}
+
+Eigen::Index ProsacSampler::sampleSetSize(int iteration) const
+{
+  constexpr Eigen::Index m = std::tuple_size<Sample>::value;
+
+  const auto stage = std::lower_bound(growth_.begin(), growth_.end(), static_cast<long>(iteration) + 1);
+  if (stage == growth_.end())
+  {
+    return num_points_;
+  }
+
+  return m + (stage - growth_.begin());
+}
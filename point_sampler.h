@@ -0,0 +1,74 @@
+#pragma once
+
+#include "Eigen/Dense"
+#include <array>
+#include <random>
+#include <vector>
+
+/// \brief Draws minimal samples of point correspondences for RANSAC.
+///
+/// Samples are a function of the iteration number and the random generator only,
+/// so the same sampler can be used by several RANSAC workers at once.
+class PointSampler
+{
+public:
+  /// \brief Indices of four distinct point correspondences.
+  using Sample = std::array<Eigen::Index, 4>;
+
+  virtual ~PointSampler() = default;
+
+  /// \brief Prepares the sampler for a new set of point correspondences.
+  /// \param num_points The number of point correspondences, at least 4.
+  virtual void prepare(Eigen::Index num_points) = 0;
+
+  /// \brief Draws a sample.
+  /// \param iteration The RANSAC iteration the sample is drawn for, starting at 0.
+  /// \param generator The random generator.
+  /// \param[out] sample The indices of the sampled point correspondences.
+  virtual void sample(int iteration, std::mt19937& generator, Sample& sample) const = 0;
+
+  /// \brief The number of point correspondences that samples are drawn from in an iteration.
+  /// \param iteration The RANSAC iteration, starting at 0.
+  /// \return The samples in this iteration are drawn from the correspondences [0, sampleSetSize(iteration)).
+  virtual Eigen::Index sampleSetSize(int iteration) const = 0;
+};
+
+/// \brief Draws samples uniformly from all point correspondences.
+class UniformSampler : public PointSampler
+{
+public:
+  void prepare(Eigen::Index num_points) override;
+
+  void sample(int iteration, std::mt19937& generator, Sample& sample) const override;
+
+  Eigen::Index sampleSetSize(int iteration) const override;
+
+private:
+  Eigen::Index num_points_{0};
+};
+
+/// \brief Progressive sampling (PROSAC) from point correspondences ordered by decreasing match quality.
+///
+/// The first samples are drawn from the best correspondences only,
+/// and the set of correspondences to draw from grows progressively until it contains all of them.
+/// See O. Chum and J. Matas, "Matching with PROSAC - Progressive Sample Consensus", CVPR 2005.
+class ProsacSampler : public PointSampler
+{
+public:
+  /// \brief Constructs the sampler.
+  /// \param growth_max_samples The number of samples after which PROSAC draws from all correspondences.
+  explicit ProsacSampler(int growth_max_samples = 200000);
+
+  void prepare(Eigen::Index num_points) override;
+
+  void sample(int iteration, std::mt19937& generator, Sample& sample) const override;
+
+  Eigen::Index sampleSetSize(int iteration) const override;
+
+private:
+  int growth_max_samples_;
+  Eigen::Index num_points_{0};
+
+  /// \brief growth_[k] is the last sample number drawn from the best 4 + k correspondences.
+  std::vector<long> growth_;
+};
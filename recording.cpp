@@ -0,0 +1,358 @@
+#include "recording.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <type_traits>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+constexpr char file_magic[8] = {'L', 'M', 'R', 'E', 'C', '\0', '\0', '\0'};
+constexpr std::uint32_t format_version = 1;
+
+/// \brief The alignment of every block in the file, relative to the start of the file.
+constexpr size_t alignment = 16;
+
+enum ChunkFlags : std::uint32_t
+{
+  estimated_flag = 1u << 0,
+  registered_flag = 1u << 1,
+  is_reference_flag = 1u << 2,
+  is_new_keyframe_flag = 1u << 3
+};
+
+struct FileHeader
+{
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t reserved;
+};
+
+struct MatHeader
+{
+  std::int32_t rows;
+  std::int32_t cols;
+  std::int32_t type;
+  std::int32_t reserved;
+};
+
+/// \brief The header of the chunk for a frame. The homographies are stored in row-major order.
+struct ChunkHeader
+{
+  /// \brief The size of the chunk, including this header and the padding after the last block.
+  std::uint64_t size;
+  std::int32_t frame_id;
+  std::int32_t reference_id;
+  std::int32_t path;
+  std::uint32_t flags;
+  std::uint64_t num_inliers;
+  float homography[9];
+  float to_mosaic[9];
+  MatHeader image;
+  MatHeader descriptors;
+  std::uint64_t num_keypoints;
+  std::uint64_t num_matches;
+  std::uint64_t reserved;
+};
+
+static_assert(sizeof(FileHeader) % alignment == 0, "The file header must keep the chunks aligned");
+static_assert(sizeof(ChunkHeader) % alignment == 0, "The chunk header must keep the blocks aligned");
+
+// The keypoints and matches are stored as they are in memory, so that they can be used directly from the map.
+static_assert(std::is_trivially_copyable_v<cv::KeyPoint> && std::is_trivially_copyable_v<cv::DMatch>,
+              "Keypoints and matches must be trivially copyable to be recorded");
+
+using Matrix3fRowMajor = Eigen::Matrix<float, 3, 3, Eigen::RowMajor>;
+
+size_t alignedSize(size_t size)
+{
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+MatHeader matHeader(const cv::Mat& mat)
+{
+  return {mat.rows, mat.cols, mat.type(), 0};
+}
+
+size_t matSize(const MatHeader& header)
+{
+  if (header.rows <= 0 || header.cols <= 0)
+  { return 0; }
+
+  return static_cast<size_t>(header.rows) * static_cast<size_t>(header.cols) * CV_ELEM_SIZE(header.type);
+}
+
+/// \return The total size of the blocks after a chunk header, including padding.
+size_t blocksSize(const ChunkHeader& header)
+{
+  return alignedSize(matSize(header.image)) +
+         alignedSize(header.num_keypoints * sizeof(cv::KeyPoint)) +
+         alignedSize(matSize(header.descriptors)) +
+         alignedSize(header.num_matches * sizeof(cv::DMatch));
+}
+
+/// \brief Wraps a recorded matrix in a read-only cv::Mat header, and advances the pointer past its block.
+cv::Mat matView(const MatHeader& header, const unsigned char*& block)
+{
+  const size_t size = matSize(header);
+  if (size == 0)
+  { return cv::Mat{}; }
+
+  const cv::Mat view(header.rows, header.cols, header.type, const_cast<unsigned char*>(block));
+  block += alignedSize(size);
+  return view;
+}
+
+/// \brief Wraps a recorded array, and advances the pointer past its block.
+template<typename T>
+RecordedArray<T> arrayView(std::uint64_t size, const unsigned char*& block)
+{
+  const RecordedArray<T> view{reinterpret_cast<const T*>(block), static_cast<size_t>(size)};
+  block += alignedSize(view.size * sizeof(T));
+  return view;
+}
+}
+
+RecordingWriter::RecordingWriter(const std::string& path, bool record_frames)
+    : file_{path, std::ios::binary | std::ios::trunc}
+    , record_frames_{record_frames}
+    , num_frames_{0}
+{
+  if (!file_)
+  {
+    throw std::runtime_error("Could not write recording " + path);
+  }
+
+  FileHeader header{};
+  std::memcpy(header.magic, file_magic, sizeof(file_magic));
+  header.version = format_version;
+  file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file_.flush();
+}
+
+void RecordingWriter::append(const FrameData& frame)
+{
+  const cv::Mat image = record_frames_ ? frame.frame : cv::Mat{};
+
+  ChunkHeader header{};
+  header.frame_id = frame.id;
+  header.reference_id = frame.reference ? frame.reference->frame_id : -1;
+  header.path = static_cast<std::int32_t>(frame.path);
+  header.flags = (frame.estimated ? estimated_flag : 0u) |
+                 (frame.registered ? registered_flag : 0u) |
+                 (frame.is_reference ? is_reference_flag : 0u) |
+                 (frame.is_new_keyframe ? is_new_keyframe_flag : 0u);
+  header.num_inliers = frame.estimate.num_inliers;
+  Eigen::Map<Matrix3fRowMajor>{header.homography} = frame.estimate.homography;
+  Eigen::Map<Matrix3fRowMajor>{header.to_mosaic} = frame.to_mosaic;
+  header.image = matHeader(image);
+  header.descriptors = matHeader(frame.descriptors);
+  header.num_keypoints = frame.keypoints.size();
+  header.num_matches = frame.good_matches.size();
+  header.size = sizeof(header) + blocksSize(header);
+
+  file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  // Write the matrices row by row, since they may not be continuous.
+  const auto writeMat = [this](const cv::Mat& mat)
+  {
+    if (mat.empty())
+    { return; }
+
+    const size_t row_size = mat.cols * mat.elemSize();
+    for (int row = 0; row < mat.rows; ++row)
+    {
+      file_.write(reinterpret_cast<const char*>(mat.ptr(row)), static_cast<std::streamsize>(row_size));
+    }
+    writeAligned(nullptr, mat.rows * row_size);
+  };
+
+  writeMat(image);
+  writeAligned(frame.keypoints.data(), frame.keypoints.size() * sizeof(cv::KeyPoint));
+  writeMat(frame.descriptors);
+  writeAligned(frame.good_matches.data(), frame.good_matches.size() * sizeof(cv::DMatch));
+
+  // Make the chunk readable right away.
+  file_.flush();
+  if (!file_)
+  {
+    throw std::runtime_error("Could not write to recording");
+  }
+  ++num_frames_;
+}
+
+size_t RecordingWriter::numFrames() const
+{
+  return num_frames_;
+}
+
+void RecordingWriter::writeAligned(const void* data, size_t size)
+{
+  if (data && size > 0)
+  {
+    file_.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+  }
+
+  constexpr char padding[alignment] = {};
+  file_.write(padding, static_cast<std::streamsize>(alignedSize(size) - size));
+}
+
+RecordingReader::RecordingReader(const std::string& path)
+    : data_{nullptr}
+    , size_{0}
+    , mapping_{nullptr}
+{
+#ifdef _WIN32
+  const HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr);
+  LARGE_INTEGER file_size{};
+  if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size))
+  {
+    if (file != INVALID_HANDLE_VALUE)
+    { CloseHandle(file); }
+    throw std::runtime_error("Could not open recording " + path);
+  }
+  size_ = static_cast<size_t>(file_size.QuadPart);
+
+  if (size_ > 0)
+  {
+    mapping_ = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    data_ = mapping_ ? static_cast<const unsigned char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+  }
+  CloseHandle(file);
+#else
+  const int file = ::open(path.c_str(), O_RDONLY);
+  struct stat file_stat{};
+  if (file < 0 || ::fstat(file, &file_stat) != 0)
+  {
+    if (file >= 0)
+    { ::close(file); }
+    throw std::runtime_error("Could not open recording " + path);
+  }
+  size_ = static_cast<size_t>(file_stat.st_size);
+
+  if (size_ > 0)
+  {
+    void* map = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, file, 0);
+    data_ = map != MAP_FAILED ? static_cast<const unsigned char*>(map) : nullptr;
+  }
+  ::close(file);
+#endif
+
+  if (size_ > 0 && !data_)
+  {
+    unmap();
+    throw std::runtime_error("Could not map recording " + path);
+  }
+
+  FileHeader header{};
+  if (size_ >= sizeof(header))
+  {
+    std::memcpy(&header, data_, sizeof(header));
+  }
+  if (std::memcmp(header.magic, file_magic, sizeof(file_magic)) != 0)
+  {
+    unmap();
+    throw std::runtime_error(path + " is not a recording");
+  }
+  if (header.version != format_version)
+  {
+    unmap();
+    throw std::runtime_error("Unsupported version of recording " + path);
+  }
+
+  // Index the complete chunks. A chunk that was cut short ends the recording.
+  size_t offset = sizeof(header);
+  while (size_ - offset >= sizeof(ChunkHeader))
+  {
+    ChunkHeader chunk{};
+    std::memcpy(&chunk, data_ + offset, sizeof(chunk));
+    if (chunk.size < sizeof(chunk) || chunk.size > size_ - offset || chunk.size % alignment != 0 ||
+        sizeof(chunk) + blocksSize(chunk) > chunk.size)
+    { break; }
+
+    frame_indices_.emplace(chunk.frame_id, chunk_offsets_.size());
+    chunk_offsets_.push_back(offset);
+    offset += chunk.size;
+  }
+}
+
+RecordingReader::~RecordingReader()
+{
+  unmap();
+}
+
+void RecordingReader::unmap()
+{
+#ifdef _WIN32
+  if (data_)
+  { UnmapViewOfFile(data_); }
+  if (mapping_)
+  { CloseHandle(mapping_); }
+#else
+  if (data_)
+  { ::munmap(const_cast<unsigned char*>(data_), size_); }
+#endif
+  data_ = nullptr;
+  mapping_ = nullptr;
+}
+
+size_t RecordingReader::numFrames() const
+{
+  return chunk_offsets_.size();
+}
+
+RecordedFrame RecordingReader::frame(size_t index) const
+{
+  ChunkHeader chunk{};
+  std::memcpy(&chunk, data_ + chunk_offsets_.at(index), sizeof(chunk));
+
+  RecordedFrame frame;
+  frame.id = chunk.frame_id;
+  frame.reference_id = chunk.reference_id;
+  frame.path = static_cast<FramePath>(chunk.path);
+  frame.estimated = chunk.flags & estimated_flag;
+  frame.registered = chunk.flags & registered_flag;
+  frame.is_reference = chunk.flags & is_reference_flag;
+  frame.is_new_keyframe = chunk.flags & is_new_keyframe_flag;
+  frame.num_inliers = static_cast<size_t>(chunk.num_inliers);
+  frame.homography = Eigen::Map<const Matrix3fRowMajor>{chunk.homography};
+  frame.to_mosaic = Eigen::Map<const Matrix3fRowMajor>{chunk.to_mosaic};
+
+  // The blocks follow the header in a fixed order.
+  const unsigned char* block = data_ + chunk_offsets_[index] + sizeof(chunk);
+  frame.image = matView(chunk.image, block);
+  frame.keypoints = arrayView<cv::KeyPoint>(chunk.num_keypoints, block);
+  frame.descriptors = matView(chunk.descriptors, block);
+  frame.matches = arrayView<cv::DMatch>(chunk.num_matches, block);
+
+  return frame;
+}
+
+long RecordingReader::findFrame(int id) const
+{
+  const auto index = frame_indices_.find(id);
+  return index != frame_indices_.end() ? static_cast<long>(index->second) : -1;
+}
+
+bool isRecordingPath(const std::string& path)
+{
+  std::string extension = std::filesystem::path(path).extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+  return extension == ".lmrec";
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "mosaic_pipeline.h"
+
+#include "opencv2/core.hpp"
+#include "opencv2/features2d.hpp"
+#include "Eigen/Dense"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// \brief A read-only view of an array in a recording.
+template<typename T>
+struct RecordedArray
+{
+  const T* data{nullptr};
+  size_t size{0};
+
+  const T* begin() const { return data; }
+  const T* end() const { return data + size; }
+  const T& operator[](size_t i) const { return data[i]; }
+  bool empty() const { return size == 0; }
+
+  /// \return A copy of the array.
+  std::vector<T> toVector() const { return std::vector<T>(begin(), end()); }
+};
+
+/// \brief A recorded frame, which refers to the memory of the recording without copying it.
+///
+/// The images are read-only, and are only valid as long as the recording is open.
+struct RecordedFrame
+{
+  int id{0};
+
+  /// \brief The id of the frame the frame was registered against, or -1 if it has none.
+  int reference_id{-1};
+  FramePath path{FramePath::detection};
+  bool estimated{false};
+  bool registered{false};
+  bool is_reference{false};
+  bool is_new_keyframe{false};
+
+  /// \brief The raw frame, which is empty unless the frames were recorded.
+  cv::Mat image;
+  RecordedArray<cv::KeyPoint> keypoints;
+  cv::Mat descriptors;
+
+  /// \brief The matches against the keypoints of the reference frame.
+  RecordedArray<cv::DMatch> matches;
+
+  size_t num_inliers{0};
+  Eigen::Matrix3f homography{Eigen::Matrix3f::Identity()};
+  Eigen::Matrix3f to_mosaic{Eigen::Matrix3f::Identity()};
+};
+
+/// \brief Records processed frames to a compact binary file.
+///
+/// The file starts with a header, followed by one chunk per frame which is appended as the frame is recorded.
+/// A chunk has a fixed size header, followed by the raw frame, the keypoints, the descriptors and the matches,
+/// each aligned to 16 bytes so that they can be used directly from a memory map.
+/// Each chunk is flushed when it is written, so a recording that is cut short is readable up to its last chunk.
+/// The data is written in the byte order of the host.
+class RecordingWriter
+{
+public:
+  /// \brief Creates a recording.
+  /// \param path The file to write, which is overwritten.
+  /// \param record_frames If true, the raw frames are recorded as well, which makes the recording much larger.
+  /// Throws std::runtime_error if the file cannot be written.
+  explicit RecordingWriter(const std::string& path, bool record_frames = false);
+
+  /// \brief Appends a processed frame to the recording.
+  void append(const FrameData& frame);
+
+  /// \return The number of frames recorded.
+  size_t numFrames() const;
+
+private:
+  /// \brief Writes a block of data followed by padding up to the chunk alignment.
+  void writeAligned(const void* data, size_t size);
+
+  std::ofstream file_;
+  bool record_frames_;
+  size_t num_frames_;
+};
+
+/// \brief Reads a recording through a read-only memory map.
+///
+/// The frames refer directly to the mapped memory, so reading a frame does not copy its data.
+class RecordingReader
+{
+public:
+  /// \brief Opens a recording. Throws std::runtime_error if the file cannot be read or is not a recording.
+  explicit RecordingReader(const std::string& path);
+
+  ~RecordingReader();
+
+  RecordingReader(const RecordingReader&) = delete;
+  RecordingReader& operator=(const RecordingReader&) = delete;
+
+  /// \return The number of complete frames in the recording.
+  size_t numFrames() const;
+
+  /// \return The frame at an index in the recording.
+  RecordedFrame frame(size_t index) const;
+
+  /// \return The index of the frame with an id, or -1 if there is no such frame.
+  long findFrame(int id) const;
+
+private:
+  /// \brief Releases the memory map.
+  void unmap();
+
+  const unsigned char* data_;
+  size_t size_;
+  void* mapping_;
+  std::vector<size_t> chunk_offsets_;
+  std::unordered_map<int, size_t> frame_indices_;
+};
+
+/// \return True if a path has the extension of recordings, ".lmrec".
+bool isRecordingPath(const std::string& path);
@@ -0,0 +1,221 @@
+#include "replay.h"
+
+#include "mosaic_pipeline.h"
+#include "recording.h"
+
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace
+{
+/// \brief The total time spent in a stage, and the number of frames it processed.
+struct StageTime
+{
+  DurationInMs total{0};
+  size_t num_frames{0};
+
+  void add(DurationInMs duration)
+  {
+    total += duration;
+    ++num_frames;
+  }
+};
+
+/// \brief Makes a keyframe from a recorded frame, which refers to the recorded image and descriptors.
+std::shared_ptr<const Reference> makeRecordedKeyframe(const RecordedFrame& frame)
+{
+  auto keyframe = std::make_shared<Reference>();
+  keyframe->frame_id = frame.id;
+  keyframe->image = frame.image;
+  keyframe->keypoints = frame.keypoints.toVector();
+  keyframe->descriptors = frame.descriptors;
+  keyframe->to_mosaic = frame.to_mosaic;
+  return keyframe;
+}
+
+void printStageTime(const char* name, const StageTime& time)
+{
+  const double mean_ms = time.num_frames > 0 ? time.total.count() / static_cast<double>(time.num_frames) : 0.;
+  std::cout << "  " << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(3)
+            << std::setw(10) << mean_ms << "ms per frame over " << time.num_frames << " frames\n"
+            << std::defaultfloat;
+}
+}
+
+const char* replayStageName(ReplayStage stage)
+{
+  switch (stage)
+  {
+    case ReplayStage::detection: return "detection";
+    case ReplayStage::matching: return "matching";
+    case ReplayStage::estimation: return "estimation";
+  }
+
+  return "";
+}
+
+ReplayStage parseReplayStage(const std::string& name)
+{
+  for (const auto stage : {ReplayStage::detection, ReplayStage::matching, ReplayStage::estimation})
+  {
+    if (name == replayStageName(stage))
+    { return stage; }
+  }
+
+  throw std::invalid_argument("Unknown replay stage \"" + name + "\"");
+}
+
+void runReplay(const std::string& recording, ReplayStage first_stage, const PipelineSettings& settings)
+{
+  const RecordingReader reader{recording};
+  if (reader.numFrames() == 0)
+  {
+    throw std::runtime_error("The recording " + recording + " has no frames");
+  }
+
+  if (first_stage == ReplayStage::detection)
+  {
+    for (size_t i = 0; i < reader.numFrames(); ++i)
+    {
+      if (reader.frame(i).image.empty())
+      {
+        throw std::invalid_argument("Detection can only be replayed from a recording with frames");
+      }
+    }
+  }
+  else if (first_stage == ReplayStage::matching)
+  {
+    // The matcher must be able to match the recorded descriptors.
+    validateFeatureSettings(settings.features);
+    for (size_t i = 0; i < reader.numFrames(); ++i)
+    {
+      const cv::Mat descriptors = reader.frame(i).descriptors;
+      if (!descriptors.empty() && (descriptors.depth() == CV_8U) != isBinaryDescriptor(settings.features.descriptor))
+      {
+        throw std::invalid_argument("The recorded descriptors are not " +
+                                    std::string{descriptorName(settings.features.descriptor)} + " descriptors");
+      }
+    }
+  }
+
+  // Replay through a pipeline with the same stages as the recorded run, so that the same code is profiled.
+  // Frames are pushed one at a time, the references follow the recording,
+  // and RANSAC has a fixed seed so that replays are reproducible.
+  PipelineSettings replay_settings = settings;
+  replay_settings.live_source = false;
+  replay_settings.auto_reference = false;
+  replay_settings.ransac_seed = 5030u;
+  MosaicPipeline pipeline{MosaicPipeline::FrameSource{}, replay_settings};
+
+  std::unordered_map<int, std::shared_ptr<const Reference>> keyframes;
+  FrameData data;
+
+  StageTime detection_time;
+  StageTime tracking_time;
+  StageTime matching_time;
+  StageTime estimation_time;
+  size_t num_registered = 0;
+  size_t num_recorded_registered = 0;
+  size_t num_skipped = 0;
+
+  const auto start = Clock::now();
+  for (size_t i = 0; i < reader.numFrames(); ++i)
+  {
+    const RecordedFrame frame = reader.frame(i);
+    num_recorded_registered += frame.registered && !frame.is_reference;
+
+    data.reset();
+    data.id = frame.id;
+    data.capture_time = Clock::now();
+
+    if (first_stage == ReplayStage::detection)
+    {
+      // Detect or track, match and estimate like the pipeline does for frames from a source.
+      data.frame = frame.image;
+      pipeline.process(data);
+
+      // Set the reference where it was set in the recording.
+      if (frame.is_reference && !data.is_reference)
+      {
+        pipeline.setReference(data);
+      }
+    }
+    else
+    {
+      // Find the keyframe the frame was registered against.
+      // Frames without a keyframe, and frames that were tracked rather than matched, are not matched.
+      if (frame.reference_id < 0 || frame.is_reference || frame.path == FramePath::tracking)
+      {
+        ++num_skipped;
+        continue;
+      }
+
+      auto keyframe_it = keyframes.find(frame.reference_id);
+      if (keyframe_it == keyframes.end())
+      {
+        const long keyframe_index = reader.findFrame(frame.reference_id);
+        if (keyframe_index < 0)
+        {
+          ++num_skipped;
+          continue;
+        }
+        keyframe_it = keyframes.emplace(frame.reference_id,
+                                        makeRecordedKeyframe(reader.frame(static_cast<size_t>(keyframe_index)))).first;
+      }
+
+      // Match descriptors, or use the recorded matches, and estimate the homography.
+      data.keypoints.assign(frame.keypoints.begin(), frame.keypoints.end());
+      data.descriptors = frame.descriptors;
+      if (first_stage == ReplayStage::matching)
+      {
+        if (data.descriptors.empty() || keyframe_it->second->descriptors.empty())
+        {
+          ++num_skipped;
+          continue;
+        }
+        pipeline.match(data, keyframe_it->second);
+      }
+      else
+      {
+        data.reference = keyframe_it->second;
+        data.good_matches.assign(frame.matches.begin(), frame.matches.end());
+      }
+      pipeline.estimate(data);
+    }
+
+    // Add up the stage times the pipeline measured for the frame.
+    if (data.detected)
+    { detection_time.add(data.detection_duration + data.description_duration); }
+    if (data.path == FramePath::tracking)
+    { tracking_time.add(data.matching_duration); }
+    else if (first_stage != ReplayStage::estimation && data.reference)
+    { matching_time.add(data.matching_duration); }
+    if (data.estimated)
+    { estimation_time.add(data.estimation_duration); }
+
+    num_registered += data.registered && !data.is_reference;
+  }
+  const DurationInMs duration = Clock::now() - start;
+
+  std::cout << "Replayed " << reader.numFrames() << " frames from " << replayStageName(first_stage) << " in "
+            << std::fixed << std::setprecision(1) << duration.count() << "ms ("
+            << 1000. * static_cast<double>(reader.numFrames()) / duration.count() << " frames/s)\n"
+            << std::defaultfloat;
+  if (first_stage == ReplayStage::detection)
+  {
+    printStageTime("Detection", detection_time);
+    printStageTime("Tracking", tracking_time);
+  }
+  if (first_stage != ReplayStage::estimation)
+  { printStageTime("Matching", matching_time); }
+  printStageTime("Estimation", estimation_time);
+  std::cout << "Registered " << num_registered << " frames, " << num_recorded_registered << " in the recording.";
+  if (first_stage != ReplayStage::detection)
+  {
+    std::cout << " " << num_skipped << " frames were skipped, since they had no keyframe or no recorded features.";
+  }
+  std::cout << "\n";
+}
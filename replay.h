@@ -0,0 +1,41 @@
+#pragma once
+
+#include "mosaic_pipeline.h"
+
+#include <string>
+
+/// \brief The first stage that is run when replaying a recording.
+/// The stages before it are replaced by the recorded data.
+enum class ReplayStage
+{
+  /// \brief Run the recorded frames through the pipeline, which detects or tracks, matches and estimates.
+  /// This needs a recording with frames.
+  detection,
+
+  /// \brief Match the recorded descriptors against the descriptors of the recorded keyframes, and estimate.
+  matching,
+
+  /// \brief Estimate homographies from the recorded matches.
+  estimation
+};
+
+/// \return The name of a replay stage, as used on the command line.
+const char* replayStageName(ReplayStage stage);
+
+/// \brief Parses a replay stage name. Throws std::invalid_argument if the name is unknown.
+ReplayStage parseReplayStage(const std::string& name);
+
+/// \brief Replays a recording through the stages from a given stage, to profile them in isolation.
+///
+/// The frames are processed one at a time on this thread by a pipeline, as fast as possible.
+/// When detection is replayed, the frames are processed like the pipeline processes frames from a source,
+/// with the references set where they were set in the recording.
+/// Otherwise, each frame is matched against the keyframe it was registered against in the recording,
+/// with the pipeline's matching and estimation.
+/// Prints the time per frame in each stage, and the number of registered frames compared to the recording.
+/// \param recording Path to a recording.
+/// \param first_stage The first stage to run.
+/// \param settings The pipeline settings, which should be the settings the recording was made with,
+///                 and whose features must describe the recorded descriptors unless detection is replayed.
+void runReplay(const std::string& recording, ReplayStage first_stage = ReplayStage::matching,
+               const PipelineSettings& settings = PipelineSettings{});
@@ -0,0 +1,179 @@
+#include "bench/allocation_counter.h"
+#include "bench/synthetic_data.h"
+#include "homography_estimator.h"
+#include "mosaic_pipeline.h"
+
+#include "opencv2/core/utility.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <array>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Checks that the steady state of the frame loop does not allocate memory, once the buffers have grown.
+// Each test is run by name, and returns 77 when it is skipped, see SKIP_RETURN_CODE in CMakeLists.txt.
+
+namespace
+{
+constexpr int skip_return_code = 77;
+
+/// \brief Prints a failed check.
+/// \return The condition.
+bool check(bool condition, const std::string& message)
+{
+  if (!condition)
+  {
+    std::cerr << "FAILED: " << message << std::endl;
+  }
+
+  return condition;
+}
+
+/// \brief Creates color frames of a textured scene, where the camera moves a few pixels back and forth.
+std::vector<cv::Mat> makeShakyFrames(cv::Size size)
+{
+  cv::Mat scene;
+  cv::cvtColor(makeTexturedImage(size), scene, cv::COLOR_GRAY2BGR);
+
+  std::vector<cv::Mat> frames;
+  for (const float shift : {0.f, 2.f, 4.f, 2.f})
+  {
+    const cv::Matx23f translation{1.f, 0.f, shift, 0.f, 1.f, shift / 2.f};
+    cv::Mat frame;
+    cv::warpAffine(scene, frame, translation, size, cv::INTER_LINEAR, cv::BORDER_REFLECT);
+    frames.push_back(frame);
+  }
+
+  return frames;
+}
+
+/// \brief Estimates homographies into a reused estimate, with one and several threads,
+/// and checks that no memory is allocated once the buffers have grown.
+int testEstimation()
+{
+  bool passed = true;
+  for (const int num_threads : {1, 4})
+  {
+    for (const Eigen::Index num_points : {200, 1000})
+    {
+      const auto data = makeCorrespondences(num_points, 0.5f, 0.5f);
+      HomographyEstimator estimator(0.99f, 3.f, 10000, num_threads, 42u, std::make_unique<ProsacSampler>(), true);
+
+      // Let the buffers grow to their final size.
+      HomographyEstimate estimate;
+      for (int i = 0; i < 3; ++i)
+      {
+        estimator.estimate(data.pts1, data.pts2, estimate);
+      }
+
+      const auto start_count = allocationCount();
+      for (int i = 0; i < 20; ++i)
+      {
+        estimator.estimate(data.pts1, data.pts2, estimate);
+      }
+      const auto num_allocations = allocationCount() - start_count;
+
+      passed = check(num_allocations == 0, "Estimating " + std::to_string(num_points) + " points with " +
+                                           std::to_string(num_threads) + " threads allocated " +
+                                           std::to_string(num_allocations) + " times") && passed;
+    }
+  }
+
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/// \brief Pushes frames through the pipeline on this thread while reusing two frames,
+/// and checks that the pipeline does not allocate memory once the buffers have grown.
+///
+/// OpenCV allocates its image pyramids and scratch buffers inside the calls, which cannot be avoided from outside,
+/// so the allocations are attributed, and only those made by the pipeline itself must be zero.
+/// \param tracking If true, the frames are registered by tracking, and otherwise by detecting and matching keypoints.
+int testPipeline(bool tracking)
+{
+  if (!setOpenCvAttribution(true))
+  {
+    std::cout << "Allocations cannot be attributed to OpenCV with this runtime or OpenCV build, skipping" << std::endl;
+    return skip_return_code;
+  }
+  setOpenCvAttribution(false);
+
+  const auto images = makeShakyFrames({640, 480});
+
+  // Detect on a grid, like the interactive program, and keep the reference for the whole test.
+  PipelineSettings settings;
+  settings.live_source = false;
+  settings.auto_reference = true;
+  settings.tracking = tracking;
+  settings.detection = DetectionStrategy::grid;
+  settings.keyframe_min_overlap = 0.1f;
+  settings.max_tracked_frames = std::numeric_limits<int>::max();
+  settings.ransac_seed = 42u;
+  MosaicPipeline pipeline{MosaicPipeline::FrameSource{}, settings};
+
+  std::array<FrameData, 2> frames;
+  int frame_id = 0;
+  const auto process_next = [&]() -> const FrameData&
+  {
+    FrameData& data = frames[static_cast<size_t>(frame_id) % frames.size()];
+    const cv::Mat& image = images[static_cast<size_t>(frame_id) % images.size()];
+    ++frame_id;
+
+    data.reset();
+    data.id = frame_id;
+    data.capture_time = Clock::now();
+    data.frame = image;
+    pipeline.process(data);
+    return data;
+  };
+
+  // Let the reference be detected, and the buffers grow to their final size.
+  for (int i = 0; i < 20; ++i)
+  {
+    process_next();
+  }
+
+  const FramePath expected_path = tracking ? FramePath::tracking : FramePath::detection;
+  bool on_path = true;
+  const auto start_count = allocationCount();
+  const auto start_own_count = ownAllocationCount();
+  setOpenCvAttribution(true);
+  for (int i = 0; i < 40; ++i)
+  {
+    const FrameData& data = process_next();
+    on_path = on_path && data.registered && data.path == expected_path;
+  }
+  setOpenCvAttribution(false);
+  const auto num_allocations = allocationCount() - start_count;
+  const auto num_own_allocations = ownAllocationCount() - start_own_count;
+
+  std::cout << "Allocations per frame: " << static_cast<double>(num_own_allocations) / 40. << " in the pipeline, "
+            << static_cast<double>(num_allocations - num_own_allocations) / 40. << " in OpenCV" << std::endl;
+
+  const std::string path_name = pathName(expected_path);
+  const bool passed = check(on_path, "A frame was not registered by " + path_name) &
+                      check(num_own_allocations == 0, "Registering frames by " + path_name + " allocated " +
+                                                      std::to_string(num_own_allocations) + " times in the pipeline");
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+}
+
+int main(int argc, char** argv)
+{
+  // Let OpenCV run on this thread, so that its allocations are the same in each run.
+  cv::setNumThreads(1);
+
+  const std::string test = argc == 2 ? argv[1] : "";
+  if (test == "estimation")
+  { return testEstimation(); }
+  if (test == "tracking")
+  { return testPipeline(true); }
+  if (test == "detection")
+  { return testPipeline(false); }
+
+  std::cerr << "Usage: " << argv[0] << " estimation|tracking|detection" << std::endl;
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,87 @@
+#include "thread_pool.h"
+
+#include <stdexcept>
+
+ThreadPool::ThreadPool(int num_threads)
+    : num_threads_{num_threads}
+    , job_{nullptr}
+    , generation_{0}
+    , num_running_{0}
+    , stop_{false}
+{
+  if (num_threads < 1)
+  {
+    throw std::invalid_argument("ThreadPool needs at least one thread");
+  }
+
+  threads_.reserve(num_threads_ - 1);
+  for (int worker = 1; worker < num_threads_; ++worker)
+  {
+    threads_.emplace_back(&ThreadPool::workerLoop, this, worker);
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  job_available_.notify_all();
+
+  for (auto& thread : threads_)
+  {
+    thread.join();
+  }
+}
+
+int ThreadPool::numThreads() const
+{
+  return num_threads_;
+}
+
+void ThreadPool::run(const std::function<void(int)>& job)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    job_ = &job;
+    num_running_ = num_threads_ - 1;
+    ++generation_;
+  }
+  job_available_.notify_all();
+
+  // The calling thread does its share of the work.
+  job(0);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  job_finished_.wait(lock, [this] { return num_running_ == 0; });
+  job_ = nullptr;
+}
+
+void ThreadPool::workerLoop(int worker)
+{
+  unsigned long last_generation = 0;
+
+  while (true)
+  {
+    const std::function<void(int)>* job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      job_available_.wait(lock, [this, last_generation] { return stop_ || generation_ != last_generation; });
+
+      if (stop_)
+      { return; }
+
+      last_generation = generation_;
+      job = job_;
+    }
+
+    (*job)(worker);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --num_running_;
+    }
+    job_finished_.notify_one();
+  }
+}
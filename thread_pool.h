@@ -0,0 +1,42 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// \brief A fixed set of worker threads that repeatedly run the same job in parallel.
+class ThreadPool
+{
+public:
+  /// \brief Constructs the pool.
+  /// \param num_threads Total number of threads running each job, including the calling thread.
+  explicit ThreadPool(int num_threads);
+
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /// \return The total number of threads running each job, including the calling thread.
+  int numThreads() const;
+
+  /// \brief Runs job(worker) for every worker in [0, numThreads()), and waits until all are finished.
+  /// The calling thread runs worker 0.
+  void run(const std::function<void(int)>& job);
+
+private:
+  void workerLoop(int worker);
+
+  int num_threads_;
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  std::condition_variable job_available_;
+  std::condition_variable job_finished_;
+  const std::function<void(int)>* job_;
+  unsigned long generation_;
+  int num_running_;
+  bool stop_;
+};
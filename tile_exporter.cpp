@@ -0,0 +1,266 @@
+#include "tile_exporter.h"
+
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <filesystem>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+/// \brief Divides and rounds towards negative infinity, so that negative tile indices have the right parents.
+int floorDiv(int value, int divisor)
+{
+  return value >= 0 ? value / divisor : -((-value + divisor - 1) / divisor);
+}
+
+/// \return The number of levels needed for the canvas to fit within 2x2 tiles at the top level.
+size_t numLevels(const cv::Rect& bounds, int tile_size)
+{
+  size_t num_levels = 1;
+  while ((bounds.width >> (num_levels - 1)) > tile_size || (bounds.height >> (num_levels - 1)) > tile_size)
+  {
+    ++num_levels;
+  }
+
+  return num_levels;
+}
+}
+
+TileExporter::TileExporter(const std::string& directory, const std::string& extension)
+    : directory_{directory}
+    , extension_{extension}
+    , exported_version_{0}
+    , has_job_{false}
+    , busy_{false}
+    , stop_{false}
+{
+  fs::create_directories(directory_);
+  thread_ = std::thread(&TileExporter::workerLoop, this);
+}
+
+TileExporter::~TileExporter()
+{
+  {
+    const std::lock_guard<std::mutex> lock{mutex_};
+    stop_ = true;
+  }
+  job_available_.notify_one();
+  thread_.join();
+}
+
+bool TileExporter::exportChanges(const MosaicCanvas& canvas, bool wait)
+{
+  if (canvas.tileSize() % 2 != 0)
+  {
+    throw std::invalid_argument("Only canvases with an even tile size can be exported");
+  }
+
+  {
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (wait)
+    {
+      job_finished_.wait(lock, [this]() { return !has_job_ && !busy_; });
+    }
+    rethrowError();
+
+    if (has_job_ || busy_)
+    { return false; }
+  }
+
+  const std::vector<cv::Point> changed = canvas.changedTiles(exported_version_);
+  exported_version_ = canvas.version();
+  if (changed.empty())
+  { return true; }
+
+  // The worker is idle, and only this thread queues jobs, so the job can be filled in without holding the lock.
+  job_.tiles.clear();
+  for (const auto& index : changed)
+  {
+    job_.tiles.emplace(index, canvas.tile(index).clone());
+  }
+  job_.bounds = canvas.bounds();
+  job_.tile_size = canvas.tileSize();
+  job_.type = canvas.type();
+
+  {
+    const std::lock_guard<std::mutex> lock{mutex_};
+    has_job_ = true;
+  }
+  job_available_.notify_one();
+
+  return true;
+}
+
+void TileExporter::flush()
+{
+  std::unique_lock<std::mutex> lock{mutex_};
+  job_finished_.wait(lock, [this]() { return !has_job_ && !busy_; });
+  rethrowError();
+}
+
+void TileExporter::clear()
+{
+  flush();
+
+  for (size_t level = 0; level < written_tiles_.size(); ++level)
+  {
+    for (const auto& index : written_tiles_[level])
+    {
+      fs::remove(tilePath(level, index));
+    }
+  }
+  written_tiles_.clear();
+  fs::remove(fs::path(directory_) / "pyramid.yml");
+  exported_version_ = 0;
+}
+
+std::uint64_t TileExporter::exportedVersion() const
+{
+  return exported_version_;
+}
+
+void TileExporter::workerLoop()
+{
+  std::unique_lock<std::mutex> lock{mutex_};
+  while (true)
+  {
+    // Finish the queued export before stopping.
+    job_available_.wait(lock, [this]() { return has_job_ || stop_; });
+    if (!has_job_)
+    { return; }
+
+    has_job_ = false;
+    busy_ = true;
+    lock.unlock();
+
+    std::exception_ptr error;
+    try
+    {
+      write(job_);
+    }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+
+    lock.lock();
+    busy_ = false;
+    if (error)
+    { error_ = error; }
+    job_finished_.notify_all();
+  }
+}
+
+void TileExporter::write(const Export& job)
+{
+  const size_t num_levels = numLevels(job.bounds, job.tile_size);
+  const size_t num_built_levels = written_tiles_.size();
+  if (written_tiles_.size() < num_levels)
+  {
+    written_tiles_.resize(num_levels);
+  }
+
+  TileImages changed = job.tiles;
+  for (const auto& [index, image] : changed)
+  {
+    writeTile(0, index, image);
+  }
+
+  // Update the quadrants of the overview tiles above the changed tiles, one level at a time.
+  const int half = job.tile_size / 2;
+  for (size_t level = 0; level + 1 < num_levels; ++level)
+  {
+    // A new overview level is built from all the tiles below it, not only the changed ones.
+    // Tiles that are not in memory are read back.
+    if (level + 1 >= num_built_levels)
+    {
+      for (const auto& index : written_tiles_[level])
+      {
+        changed.emplace(index, cv::Mat{});
+      }
+    }
+
+    TileImages parents;
+    for (const auto& [index, image] : changed)
+    {
+      const cv::Point parent{floorDiv(index.x, 2), floorDiv(index.y, 2)};
+      auto [parent_tile, inserted] = parents.try_emplace(parent);
+      if (inserted && written_tiles_[level + 1].count(parent) > 0)
+      {
+        parent_tile->second = readTile(level + 1, parent);
+      }
+      else if (inserted)
+      {
+        parent_tile->second = cv::Mat::zeros(job.tile_size, job.tile_size, job.type);
+      }
+
+      const cv::Mat child = image.empty() ? readTile(level, index) : image;
+      cv::resize(child, downsampled_, cv::Size{half, half}, 0., 0., cv::INTER_AREA);
+      downsampled_.copyTo(parent_tile->second(cv::Rect{(index.x - 2 * parent.x) * half,
+                                                       (index.y - 2 * parent.y) * half, half, half}));
+    }
+
+    for (const auto& [index, image] : parents)
+    {
+      writeTile(level + 1, index, image);
+    }
+    changed = std::move(parents);
+  }
+
+  cv::FileStorage manifest{(fs::path(directory_) / "pyramid.yml").string(), cv::FileStorage::WRITE};
+  if (!manifest.isOpened())
+  {
+    throw std::runtime_error("Could not write the pyramid description to " + directory_);
+  }
+  manifest << "tile_size" << job.tile_size;
+  manifest << "extension" << extension_;
+  manifest << "num_levels" << static_cast<int>(written_tiles_.size());
+  manifest << "bounds" << job.bounds;
+}
+
+void TileExporter::writeTile(size_t level, const cv::Point& index, const cv::Mat& image)
+{
+  std::set<cv::Point, TileIndexLess>& level_tiles = written_tiles_[level];
+  if (level_tiles.empty())
+  {
+    fs::create_directories(fs::path(directory_) / std::to_string(level));
+  }
+
+  const std::string path = tilePath(level, index);
+  if (!cv::imwrite(path, image))
+  {
+    throw std::runtime_error("Could not write tile " + path);
+  }
+  level_tiles.insert(index);
+}
+
+cv::Mat TileExporter::readTile(size_t level, const cv::Point& index) const
+{
+  const std::string path = tilePath(level, index);
+  cv::Mat image = cv::imread(path, cv::IMREAD_UNCHANGED);
+  if (image.empty())
+  {
+    throw std::runtime_error("Could not read tile " + path);
+  }
+
+  return image;
+}
+
+std::string TileExporter::tilePath(size_t level, const cv::Point& index) const
+{
+  const std::string name = std::to_string(index.x) + "_" + std::to_string(index.y) + extension_;
+  return (fs::path(directory_) / std::to_string(level) / name).string();
+}
+
+void TileExporter::rethrowError()
+{
+  if (error_)
+  {
+    std::exception_ptr error = error_;
+    error_ = nullptr;
+    std::rethrow_exception(error);
+  }
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "mosaic_canvas.h"
+
+#include "opencv2/core.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/// \brief Writes a mosaic canvas to disk as a pyramid of tiles, on a background thread.
+///
+/// Level 0 holds the canvas tiles at full resolution, and each following level halves the resolution,
+/// until the whole canvas fits within 2x2 tiles.
+/// The tile with index (x, y) at level l covers the canvas pixels from (x, y) * tile_size * 2^l,
+/// and is written to "<directory>/<l>/<x>_<y><extension>".
+/// The indices may be negative, since the canvas may grow in any direction.
+/// The directory also gets "pyramid.yml", with the tile size, the number of levels and the canvas bounds.
+///
+/// Each export copies only the tiles that have changed since the previous export,
+/// and only the overview tiles above them are updated, by reading them back and replacing the changed quadrants.
+/// The canvas is therefore never rendered into one image, and its size is only limited by the disk.
+/// The exporter must be used from one thread at a time.
+class TileExporter
+{
+public:
+  /// \brief Constructs the exporter, and starts its thread.
+  /// \param directory The directory to write the pyramid to, which is created if necessary.
+  /// \param extension The file extension of the tiles, which selects the image format.
+  explicit TileExporter(const std::string& directory, const std::string& extension = ".png");
+
+  /// \brief Writes the queued export, and stops the thread.
+  ~TileExporter();
+
+  TileExporter(const TileExporter&) = delete;
+  TileExporter& operator=(const TileExporter&) = delete;
+
+  /// \brief Queues the tiles that have changed since the previous export for writing.
+  /// The tiles are copied, so the canvas may be changed as soon as this returns.
+  /// Throws std::invalid_argument if the tile size of the canvas is odd,
+  /// and rethrows the exception from a previous export that failed.
+  /// \param canvas The canvas to export, which must be the same canvas each time until clear() is called.
+  /// \param wait If true, waits for the previous export to be written instead of returning false.
+  /// \return False if the previous export is still being written, in which case the changes are exported next time.
+  bool exportChanges(const MosaicCanvas& canvas, bool wait = false);
+
+  /// \brief Waits until the queued export has been written, and rethrows the exception if it failed.
+  void flush();
+
+  /// \brief Waits for the queued export, and removes all tiles written so far, to start exporting a new canvas.
+  void clear();
+
+  /// \return The canvas version of the latest queued export.
+  std::uint64_t exportedVersion() const;
+
+private:
+  /// \brief Orders tile indices row by row.
+  struct TileIndexLess
+  {
+    bool operator()(const cv::Point& a, const cv::Point& b) const
+    { return a.y < b.y || (a.y == b.y && a.x < b.x); }
+  };
+
+  using TileImages = std::map<cv::Point, cv::Mat, TileIndexLess>;
+
+  /// \brief Copies of the changed tiles in a canvas.
+  struct Export
+  {
+    TileImages tiles;
+    cv::Rect bounds;
+    int tile_size{0};
+    int type{0};
+  };
+
+  void workerLoop();
+
+  /// \brief Writes the changed tiles, and updates the overview tiles above them.
+  void write(const Export& job);
+
+  /// \brief Writes a tile, and creates the directory for its level if necessary.
+  void writeTile(size_t level, const cv::Point& index, const cv::Mat& image);
+
+  /// \brief Reads a tile that has been written. Throws std::runtime_error if it cannot be read.
+  cv::Mat readTile(size_t level, const cv::Point& index) const;
+
+  std::string tilePath(size_t level, const cv::Point& index) const;
+
+  /// \brief Rethrows the exception from the latest failed export, if any. Must be called with the mutex locked.
+  void rethrowError();
+
+  std::string directory_;
+  std::string extension_;
+  std::uint64_t exported_version_;
+
+  /// \brief The tiles that have been written at each level. Only used by the worker, or while it is idle.
+  std::vector<std::set<cv::Point, TileIndexLess>> written_tiles_;
+  cv::Mat downsampled_;
+
+  std::mutex mutex_;
+  std::condition_variable job_available_;
+  std::condition_variable job_finished_;
+  Export job_;
+  bool has_job_;
+  bool busy_;
+  bool stop_;
+  std::exception_ptr error_;
+  std::thread thread_;
+};